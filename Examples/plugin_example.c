@@ -0,0 +1,48 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Example plugin: the C example as a shared object (programflag 6)
+ *
+ * Compile with:
+ *      gcc -shared -fPIC -I/path/to/PBala/include -o plugin_example.so \
+ *          plugin_example.c
+ * and use with:
+ *      PBala --plugin-threads=4 6 plugin_example.so datafile nodefile outdir
+ */
+
+#include <PBala_plugin.h>
+#include <stdio.h>
+
+int pbala_task(int id, int argc, char **argv) {
+    double x1;
+    int x2;
+
+    /* argv is the same as for a C program: argv[1] is the task number and
+     * the arguments of the datafile come next */
+    if (argc != 4 || sscanf(argv[2], "%lf", &x1) != 1 ||
+        sscanf(argv[3], "%d", &x2) != 1) {
+        fprintf(pbala_error(), "Error: wrong arguments passed.\n");
+        return -1;
+    }
+
+    /* Tasks share the process, so write to pbala_output() and not to
+     * stdout, and do not use global variables */
+    fprintf(pbala_output(), "Task %d: %g * %d = %g\n", id, x1, x2, x1 * x2);
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Example reducer: counts how many tasks printed the word "found" and
+ * writes their task numbers to out_dir/found.txt
+ *
+ * Compile with:
+ *      gcc -shared -fPIC -o reducer_example.so reducer_example.c
+ * and use with:
+ *      PBala --reducer=./reducer_example.so ...
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+static FILE *out;
+static int count;
+
+int pbala_reducer_init(const char *out_dir, const char *arg) {
+    char fname[1024];
+    sprintf(fname, "%s/found.txt", out_dir);
+    out = fopen(fname, "w");
+    return out == NULL ? -1 : 0;
+}
+
+int pbala_reducer_accumulate(int task, const char *data, size_t len) {
+    /* data is NUL-terminated, so we can use string functions */
+    if (strstr(data, "found") != NULL) {
+        fprintf(out, "%d\n", task);
+        count++;
+    }
+    return 0;
+}
+
+int pbala_reducer_finalize(void) {
+    fprintf(out, "# %d tasks found something\n", count);
+    return fclose(out);
+}
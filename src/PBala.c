@@ -25,13 +25,21 @@
  * \author Oscar Saleta Reig
  */
 
+#include "PBala_affinity.h"
+#include "PBala_cache.h"
 #include "PBala_config.h"
+#include "PBala_compress.h"
+#include "PBala_dag.h"
 #include "PBala_errcodes.h"
+#include "PBala_launch.h"
 #include "PBala_lib.h"
+#include "PBala_output.h"
+#include "PBala_reducer.h"
+#include "PBala_worker.h"
 
 #include <argp.h>
-#include <dirent.h>
 #include <pvm3.h>
+#include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,10 +53,43 @@ const char *argp_program_bug_address = "<osr@mat.uab.cat>";
 /* Program documentation */
 static char doc[] = "PBala -- PVM SPMD execution parallellizer.\n\tprogramflag "
                     "argument can be: 0 (Maple), 1 (C), 2 (Python), 3 (Pari), "
-                    "4 (Sage), or 5 (Octave)";
+                    "4 (Sage), 5 (Octave) or 6 (C plugin), or the name of a "
+                    "launcher (maple, c, python, pari, sage, octave, plugin "
+                    "or one defined with --launchers)";
 /* Arguments we accept */
 static char args_doc[] = "programflag programfile datafile nodefile outdir";
 
+/* Keys of the options that only have a long name */
+enum long_opts {
+    OPT_DEPENDS = 256,
+    OPT_REDUCER,
+    OPT_STOP_WHEN,
+    OPT_DEADLINE,
+    OPT_ESTIMATES,
+    OPT_WORKER_MODE,
+    OPT_WORKER_RECYCLE,
+    OPT_PLUGIN_THREADS,
+    OPT_PLUGIN_ISOLATION,
+    OPT_BATCH_SIZE,
+    OPT_LAUNCHER,
+    OPT_LAUNCHERS,
+    OPT_CGROUP,
+    OPT_SAMPLE_INTERVAL,
+    OPT_LEDGER,
+    OPT_PIN,
+    OPT_TASK_CORES,
+    OPT_NODE_AGENT,
+    OPT_WORK_STEALING,
+    OPT_OUTPUT_MODE,
+    OPT_SHARD_OUTPUT,
+    OPT_COMPRESS_OUTPUT,
+    OPT_COMPRESS_LEVEL,
+    OPT_SCRATCH,
+    OPT_CACHE,
+    OPT_CACHE_INPUT,
+    OPT_CACHE_SIZE
+};
+
 /* Options we understand */
 static struct argp_option options[] = {
     {"kill", 'k', 0, 0,
@@ -57,12 +98,94 @@ static struct argp_option options[] = {
      "execution and PVM stops working and you have no other "
      "important processes running)"},
     {"max-mem-size", 'm', "MAX_MEM", 0, "Max memory size of a task (KB)"},
-    {"maple-single-core", 's', 0, 0, "Force single core Maple"},
+    {"maple-single-core", 's', 0, 0,
+     "Run each task on a single core (same as --task-cores=1)"},
     {"create-errfiles", 'e', 0, 0, "Create stderr files"},
     {"create-memfiles", 103, 0, 0, "Create memory files"},
     {"create-slavefile", 104, 0, 0, "Create node file"},
     {"custom-process", 'c', "/path/to/exec", 0,
      "Specify a custom path for the executable program"},
+    {"depends", OPT_DEPENDS, "DEPFILE", 0,
+     "Task dependency file, with lines like \"task 42 after 17,18\""},
+    {"reducer", OPT_REDUCER, "NAME[:ARG]", 0,
+     "Reduce task outputs as they arrive (concat, sum, min, max, csv or "
+     "/path/to/reducer.so)"},
+    {"stop-when", OPT_STOP_WHEN, "PRED", 0,
+     "Stop the execution when a task satisfies PRED: a regular expression "
+     "over its stdout, or exit:N for exit code N"},
+    {"deadline", OPT_DEADLINE, "TIME", 0,
+     "Only start tasks that can finish before TIME ([[HH:]MM:]SS from now, or "
+     "@HH:MM), and stop the execution when it is reached"},
+    {"time-estimates", OPT_ESTIMATES, "FILE", 0,
+     "Predicted task durations for --deadline (lines: tasknumber,seconds)"},
+    {"worker-mode", OPT_WORKER_MODE, "MODE", 0,
+     "fork (new process per task, default), persistent (one interpreter "
+     "per slave fed through a pipe, not for C programs) or zygote (Python "
+     "only, fork each task from a process that already did the imports)"},
+    {"worker-recycle", OPT_WORKER_RECYCLE, "N", 0,
+     "Restart persistent interpreters and zygotes after N tasks (default "
+     "100, 0 = never)"},
+    {"plugin-threads", OPT_PLUGIN_THREADS, "N", 0,
+     "Tasks run at once by each slave with C plugins (default 1)"},
+    {"plugin-isolation", OPT_PLUGIN_ISOLATION, 0, 0,
+     "Run C plugin tasks in forked processes instead of threads, so they can "
+     "crash or be killed without taking the slave down"},
+    {"batch-size", OPT_BATCH_SIZE, "N", 0,
+     "Send up to N tasks at once to each C plugin thread, for plugins that "
+     "define pbala_batch (default 1)"},
+    {"launcher", OPT_LAUNCHER, "fork|spawn", 0,
+     "How slaves start each program: fork and exec (default) or posix_spawn, "
+     "which does not copy the slave"},
+    {"launchers", OPT_LAUNCHERS, "FILE", 0,
+     "File with launchers (\"name exe template\" per line) that define new "
+     "program types or replace the built-in command lines"},
+    {"cgroup", OPT_CGROUP, "CORES", OPTION_ARG_OPTIONAL,
+     "Run each program in its own cgroup (Linux cgroup v2), limited to "
+     "MAX_MEM and CORES cores, and report the resources of its whole "
+     "process tree"},
+    {"sample-interval", OPT_SAMPLE_INTERVAL, "MS", 0,
+     "Write the memory, CPU, threads and I/O of the process tree of each "
+     "program every MS milliseconds to taskN_samples.csv"},
+    {"ledger", OPT_LEDGER, 0, 0,
+     "Write the resources used by every task to a single ledger.csv file in "
+     "the output directory"},
+    {"pin", OPT_PIN, "threads|cores", OPTION_ARG_OPTIONAL,
+     "Give each slave of a node its own CPUs and the memory of their NUMA "
+     "node, using every hardware thread (default) or one per core"},
+    {"task-cores", OPT_TASK_CORES, "N", 0,
+     "Cores used by each task: every node runs one task per N cores of the "
+     "nodefile, and programs are told to use N threads"},
+    {"node-agent", OPT_NODE_AGENT, 0, 0,
+     "Spawn one slave per node that runs all the tasks of the node at once, "
+     "instead of one slave per task slot"},
+    {"work-stealing", OPT_WORK_STEALING, 0, 0,
+     "Deal the tasks to the slaves in large chunks, and let slaves that run "
+     "out of tasks take half of the queue of another slave"},
+    {"output-mode", OPT_OUTPUT_MODE, "files|stream|archive", 0,
+     "Write the output of each task to its own files (default), or send it "
+     "to the master, which appends it to output.txt (stream) or to indexed "
+     "segment files read with PBala_cat (archive)"},
+    {"shard-output", OPT_SHARD_OUTPUT, 0, 0,
+     "Write the files of each task to out_dir/xx/yy, where xx and yy are the "
+     "last two and the previous two digits of the task number"},
+    {"compress-output", OPT_COMPRESS_OUTPUT, "none|gzip|zstd", 0,
+     "Compress the stdout and stderr files of the tasks while they are "
+     "written (taskN_stdout.txt.gz or .zst)"},
+    {"compress-level", OPT_COMPRESS_LEVEL, "N", 0,
+     "Compression level of --compress-output (default: that of gzip or "
+     "zstd)"},
+    {"scratch", OPT_SCRATCH, "DIR", 0,
+     "Let the tasks write their files to DIR, a node-local directory, and "
+     "move them to the output directory while the next tasks run"},
+    {"cache", OPT_CACHE, "DIR", 0,
+     "Send the program file to each node once, and run the tasks with its "
+     "copy in DIR, a node-local directory"},
+    {"cache-input", OPT_CACHE_INPUT, "FILE", 0,
+     "Also cache FILE, and replace the task arguments that name it by its "
+     "copy (can be given several times)"},
+    {"cache-size", OPT_CACHE_SIZE, "MB", 0,
+     "Remove the least recently used files of the cache when it grows over "
+     "MB megabytes (default 1024)"},
     {0}};
 
 /* Struct for communicating arguments to main */
@@ -73,6 +196,35 @@ struct arguments {
     int maple_single_cpu, create_err, create_mem, create_slave;
     int custom_path;
     char program_path[BUFFER_SIZE];
+    int depends;
+    char depfile[FNAME_SIZE];
+    char *reducer;
+    char *stop_when;
+    char *deadline;
+    char *estimates;
+    char *worker_mode;
+    int worker_recycle;
+    int plugin_threads, plugin_isolation;
+    int batch_size;
+    char *launcher;
+    char *launchers;
+    int cgroup_cores;
+    int sample_interval;
+    int ledger;
+    char *pin;
+    int pin_set;
+    int task_cores;
+    int node_agent;
+    int work_stealing;
+    char *output_mode;
+    int shard_output;
+    char *compress_output;
+    int compress_level;
+    char *scratch;
+    char *cache;
+    char **cache_inputs;
+    int nCacheInputs;
+    long int cache_size;
 };
 
 /* Parse a single option */
@@ -102,6 +254,94 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         arguments->custom_path = 1;
         sscanf(arg, "%s", arguments->program_path);
         break;
+    case OPT_DEPENDS:
+        arguments->depends = 1;
+        sscanf(arg, "%s", arguments->depfile);
+        break;
+    case OPT_REDUCER:
+        arguments->reducer = arg;
+        break;
+    case OPT_STOP_WHEN:
+        arguments->stop_when = arg;
+        break;
+    case OPT_DEADLINE:
+        arguments->deadline = arg;
+        break;
+    case OPT_ESTIMATES:
+        arguments->estimates = arg;
+        break;
+    case OPT_WORKER_MODE:
+        arguments->worker_mode = arg;
+        break;
+    case OPT_WORKER_RECYCLE:
+        sscanf(arg, "%d", &(arguments->worker_recycle));
+        break;
+    case OPT_PLUGIN_THREADS:
+        sscanf(arg, "%d", &(arguments->plugin_threads));
+        break;
+    case OPT_PLUGIN_ISOLATION:
+        arguments->plugin_isolation = 1;
+        break;
+    case OPT_BATCH_SIZE:
+        sscanf(arg, "%d", &(arguments->batch_size));
+        break;
+    case OPT_LAUNCHER:
+        arguments->launcher = arg;
+        break;
+    case OPT_LAUNCHERS:
+        arguments->launchers = arg;
+        break;
+    case OPT_OUTPUT_MODE:
+        arguments->output_mode = arg;
+        break;
+    case OPT_SHARD_OUTPUT:
+        arguments->shard_output = 1;
+        break;
+    case OPT_COMPRESS_OUTPUT:
+        arguments->compress_output = arg;
+        break;
+    case OPT_COMPRESS_LEVEL:
+        sscanf(arg, "%d", &(arguments->compress_level));
+        break;
+    case OPT_SCRATCH:
+        arguments->scratch = arg;
+        break;
+    case OPT_CACHE:
+        arguments->cache = arg;
+        break;
+    case OPT_CACHE_INPUT:
+        arguments->cache_inputs = (char **)realloc(
+            arguments->cache_inputs,
+            (arguments->nCacheInputs + 1) * sizeof(char *));
+        arguments->cache_inputs[arguments->nCacheInputs++] = arg;
+        break;
+    case OPT_CACHE_SIZE:
+        sscanf(arg, "%ld", &(arguments->cache_size));
+        break;
+    case OPT_WORK_STEALING:
+        arguments->work_stealing = 1;
+        break;
+    case OPT_NODE_AGENT:
+        arguments->node_agent = 1;
+        break;
+    case OPT_TASK_CORES:
+        sscanf(arg, "%d", &(arguments->task_cores));
+        break;
+    case OPT_PIN:
+        arguments->pin = arg;
+        arguments->pin_set = 1;
+        break;
+    case OPT_LEDGER:
+        arguments->ledger = 1;
+        break;
+    case OPT_SAMPLE_INTERVAL:
+        sscanf(arg, "%d", &(arguments->sample_interval));
+        break;
+    case OPT_CGROUP:
+        arguments->cgroup_cores = 0;
+        if (arg != NULL)
+            sscanf(arg, "%d", &(arguments->cgroup_cores));
+        break;
 
     case ARGP_KEY_ARG:
         if (state->arg_num >= 5)
@@ -123,6 +363,128 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 /* argp parser */
 static struct argp argp = {options, parse_opt, args_doc, doc};
 
+/**
+ * Put a failed task back in the queue, or record it as unfinished if it
+ * already used all its tries
+ *
+ * \param[in,out] currentTask head of the task linked list
+ * \param[in] graph           dependency graph (NULL if not used)
+ * \param[in] datafile        name of the input data file
+ * \param[in] taskNumber      task number
+ * \param[in] args            task arguments
+ * \param[in] tries           number of tries performed for this task
+ *
+ * \return 1 if the task was recorded as unfinished, 0 if it was requeued
+ */
+static int retryTask(task_ptr *currentTask, dag_ptr graph, char *datafile,
+                     int taskNumber, char *args, int tries) {
+    if (tries < MAX_TASK_TRIES) {
+        if (graph == NULL) {
+            addTask(currentTask, taskNumber, args, tries);
+        } else {
+            task_ptr t = newTask(taskNumber, args, tries, NULL);
+            t->priority = dagPriority(graph, taskNumber);
+            insertTask(currentTask, t);
+        }
+        return 0;
+    }
+    addUnfinishedTask(datafile, taskNumber, args);
+    if (graph != NULL)
+        dagFail(graph, taskNumber, datafile);
+    return 1;
+}
+
+/**
+ * Current wall-clock time
+ *
+ * \return seconds since the Epoch
+ */
+static double wallTime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Ask every slave that is running a task to kill it
+ *
+ * \param[in] slaveId    PVM identifiers of the slaves
+ * \param[in] slaveTask  task running in each slot (-1 if idle)
+ * \param[in] nSlots     number of slots
+ * \param[in] slotSlave  slave of each slot
+ */
+static void killRunningTasks(int *slaveId, int *slaveTask, int nSlots,
+                             int *slotSlave) {
+    int i;
+    for (i = 0; i < nSlots; i++) {
+        if (slaveTask[i] < 0)
+            continue;
+        pvm_initsend(PVM_ENCODING);
+        pvm_pkint(&slaveTask[i], 1, 1);
+        pvm_send(slaveId[slotSlave[i]], MSG_KILL);
+        printf("%-20s - Killing task %4d in slave %d\n", "[STOP]",
+               slaveTask[i], i);
+    }
+}
+
+/**
+ * Ask every slave to kill its program and cancel its queued tasks (with work
+ * stealing the master does not know where each task is)
+ *
+ * \param[in] slaveId PVM identifiers of the slaves
+ * \param[in] nSlaves number of slaves
+ */
+static void cancelAllTasks(int *slaveId, int nSlaves) {
+    int all = -1;
+    pvm_initsend(PVM_ENCODING);
+    pvm_pkint(&all, 1, 1);
+    pvm_mcast(slaveId, nSlaves, MSG_KILL);
+    printf("%-20s - Cancelling the tasks of every slave\n", "[STOP]");
+}
+
+/**
+ * Choose the next task to send
+ *
+ * Without a deadline this is the head of the list. With a deadline, tasks
+ * whose predicted duration (its estimate or, if unknown, the mean observed
+ * duration) does not fit in the remaining time are skipped, and near the end
+ * the shortest task that fits is chosen.
+ *
+ * \param[in] currentTask head of the task linked list
+ * \param[in] remaining   seconds until the deadline (negative if none, 0 if
+ *                        it passed)
+ * \param[in] mean        mean duration of the completed tasks
+ * \param[in] estimates   sorted array of predicted durations
+ * \param[in] nEstimates  size of the estimates array
+ *
+ * \return link to the chosen task (for removeTask), NULL if none can start
+ */
+static task_ptr *pickTask(task_ptr *currentTask, double remaining,
+                          double mean, estimate *estimates, int nEstimates) {
+    task_ptr *link, *best = NULL;
+    double t, best_t = 0;
+    int endgame;
+
+    if (remaining < 0 || *currentTask == NULL)
+        return *currentTask == NULL ? NULL : currentTask;
+    if (remaining == 0)
+        return NULL;
+    endgame = remaining < ENDGAME_FACTOR * mean;
+    for (link = currentTask; *link != NULL; link = &(*link)->next) {
+        if ((t = findEstimate(estimates, nEstimates, (*link)->number)) < 0)
+            t = mean;
+        if (t > remaining)
+            continue;
+        if (!endgame)
+            return link;
+        if (best == NULL || t < best_t) {
+            best = link;
+            best_t = t;
+        }
+    }
+    return best;
+}
+
 /**
  * Main PVM function. Handles task creation and result gathering.
  * Call: ./PBala programFlag programFile dataFile nodeFile outDir [max_mem_size
@@ -150,6 +512,35 @@ int main(int argc, char *argv[]) {
     arguments.create_mem = 0;
     arguments.create_slave = 0;
     arguments.custom_path = 0;
+    arguments.depends = 0;
+    arguments.reducer = NULL;
+    arguments.stop_when = NULL;
+    arguments.deadline = NULL;
+    arguments.estimates = NULL;
+    arguments.worker_mode = NULL;
+    arguments.worker_recycle = WORKER_RECYCLE;
+    arguments.plugin_threads = 1;
+    arguments.plugin_isolation = 0;
+    arguments.batch_size = 1;
+    arguments.launcher = NULL;
+    arguments.launchers = NULL;
+    arguments.cgroup_cores = -1;
+    arguments.sample_interval = 0;
+    arguments.ledger = 0;
+    arguments.pin = NULL;
+    arguments.pin_set = 0;
+    arguments.task_cores = 0;
+    arguments.node_agent = 0;
+    arguments.work_stealing = 0;
+    arguments.output_mode = NULL;
+    arguments.shard_output = 0;
+    arguments.compress_output = NULL;
+    arguments.compress_level = 0;
+    arguments.scratch = NULL;
+    arguments.cache = NULL;
+    arguments.cache_inputs = NULL;
+    arguments.nCacheInputs = 0;
+    arguments.cache_size = CACHE_SIZE_MB;
     // PVM args
     int myparent, mytid;
     int itid;
@@ -159,22 +550,52 @@ int main(int argc, char *argv[]) {
     char inp_dataFile[FNAME_SIZE];
     char inp_nodes[FNAME_SIZE];
     char out_dir[FNAME_SIZE];
+    char task_dir[FNAME_SIZE]; // where the files of a task are
     char nodeInfoFileName[FNAME_SIZE];
     char out_file[FNAME_SIZE];
     char cwd[FNAME_SIZE];
     // Files
     FILE *nodeInfoFile = NULL;
+    FILE *ledger = NULL;
+    struct rusage usage;
     FILE *f_out = NULL;
     // Nodes variables
     char **nodes;
     int *nodeCores;
     int nNodes, maxConcurrentTasks;
+    int slotsPerSlave, nSlots; // C plugins run several tasks in each slave
+    int nSlaves;               // one per slot, or one per node (node agents)
+    int slaveSlots, firstSlot;
     // tasks
     int nTasks, runningTasks = 0;
+    int nextTaskNumber; // number given to the next emitted task
+    int nEmitted;
     task_ptr currentTask;
+    dag_ptr graph = NULL;
+    int heldTasks = 0;
+    // result reduction
+    reducer red;
+    // early termination
+    int stop_mode = STOP_NONE, stop_code = 0;
+    int stopping = 0;
+    // deadline
+    double deadline = 0;
+    estimate *estimates = NULL;
+    int nEstimates = 0;
+    // how slaves run the programs
+    int worker_mode = WORKER_FORK;
+    int launcher = LAUNCH_FORK;
+    int output_mode = OUTPUT_FILES;
+    int compress_mode = COMPRESS_NONE;
+    output_writer outw;
+    file_cache cache = {0, NULL}; // files sent to the nodes
+    long int cache_bytes;
+    int pin_mode = PIN_NONE;
+    launch_def ldef;
+    launch_tpl ltpl;
     int unfinished_tasks_present = 0;
     // Aux variables
-    int i, j;
+    int i, j, k;
     char aux_str[BUFFER_SIZE];
     // Task variables
     int task_type;
@@ -197,8 +618,7 @@ int main(int argc, char *argv[]) {
     if (arguments.kill)
         return killPBala();
 
-    if (sscanf(arguments.args[0], "%d", &task_type) != 1 ||
-        sscanf(arguments.args[1], "%s", inp_programFile) != 1 ||
+    if (sscanf(arguments.args[1], "%s", inp_programFile) != 1 ||
         sscanf(arguments.args[2], "%s", inp_dataFile) != 1 ||
         sscanf(arguments.args[3], "%s", inp_nodes) != 1 ||
         sscanf(arguments.args[4], "%s", out_dir) != 1) {
@@ -206,21 +626,25 @@ int main(int argc, char *argv[]) {
         return E_ARGS;
     }
 
-    // sanitize maple library if single cpu is required
-    if (arguments.maple_single_cpu) {
-        if (mapleSingleCPU(inp_programFile) != 0)
-            return E_MPL;
-    }
-
-    // check if task type is correct
-    if (task_type != 0 && task_type != 1 && task_type != 2 && task_type != 3 &&
-        task_type != 4 && task_type != 5) {
+    // check if task type is correct and find its command line
+    if (launchFind(arguments.args[0], arguments.launchers, &ldef) != 0) {
         fprintf(stderr,
-                "%-20s - Wrong task_type value (must be one of: "
-                "0,1,2,3,4,5)\n",
-                "[ERROR]");
+                "%-20s - Wrong programflag %s (must be one of: "
+                "0,1,2,3,4,5,6 or a launcher name)\n",
+                "[ERROR]", arguments.args[0]);
         return E_WRONG_TASK;
     }
+    task_type = ldef.task_type;
+    if (task_type != 6) {
+        if (launchCompile(ldef.exe, ldef.tmpl, &ltpl) != 0) {
+            fprintf(stderr, "%-20s - Wrong launcher %s: %s %s\n", "[ERROR]",
+                    ldef.name, ldef.exe, ldef.tmpl);
+            return E_WRONG_TASK;
+        }
+        launchFree(&ltpl);
+        printf("%-20s - Launcher %s: %s %s\n", "[INFO]", ldef.name, ldef.exe,
+               ldef.tmpl);
+    }
 
     // prepare node_info.txt file if desired
     if (arguments.create_slave) {
@@ -237,6 +661,281 @@ int main(int argc, char *argv[]) {
         fprintf(nodeInfoFile, "# NODE CODENAMES\n");
     }
 
+    // one ledger instead of a memory file per task
+    if (arguments.ledger && (ledger = ledgerOpen(out_dir)) == NULL) {
+        fprintf(stderr,
+                "%-20s - Cannot create file %s/%s, make sure the output "
+                "folder %s exists\n",
+                "[ERROR]", out_dir, LEDGER_FILE, out_dir);
+        return E_OUTDIR;
+    }
+
+    // parse the stop predicate
+    if (arguments.stop_when != NULL) {
+        if (strncmp(arguments.stop_when, "exit:", 5) == 0) {
+            stop_mode = STOP_EXIT;
+            if (sscanf(arguments.stop_when + 5, "%d", &stop_code) != 1) {
+                fprintf(stderr, "%-20s - Wrong exit code in --stop-when=%s\n",
+                        "[ERROR]", arguments.stop_when);
+                return E_ARGS;
+            }
+        } else {
+            regex_t re;
+            stop_mode = STOP_REGEX;
+            if (regcomp(&re, arguments.stop_when,
+                        REG_EXTENDED | REG_NEWLINE | REG_NOSUB) != 0) {
+                fprintf(stderr,
+                        "%-20s - Wrong regular expression in --stop-when=%s\n",
+                        "[ERROR]", arguments.stop_when);
+                return E_ARGS;
+            }
+            regfree(&re);
+        }
+    }
+
+    // the deadline counts from now
+    if (arguments.deadline != NULL &&
+        parseDeadline(arguments.deadline, &deadline) != 0) {
+        fprintf(stderr, "%-20s - Wrong deadline %s\n", "[ERROR]",
+                arguments.deadline);
+        return E_ARGS;
+    }
+    if (arguments.estimates != NULL &&
+        (nEstimates = loadEstimates(arguments.estimates, &estimates)) < 0) {
+        printAbort();
+        return E_ARGS;
+    }
+
+    // persistent interpreters and zygotes
+    if (arguments.worker_mode != NULL) {
+        if ((worker_mode = workerParseMode(arguments.worker_mode)) < 0) {
+            fprintf(stderr, "%-20s - Wrong worker mode %s (use fork, "
+                            "persistent or zygote)\n",
+                    "[ERROR]", arguments.worker_mode);
+            return E_ARGS;
+        }
+        if (worker_mode == WORKER_ZYGOTE && task_type != 2) {
+            fprintf(stderr,
+                    "%-20s - --worker-mode=zygote is only available for "
+                    "Python programs\n",
+                    "[ERROR]");
+            return E_ARGS;
+        }
+        if (worker_mode == WORKER_PERSISTENT &&
+            (task_type == 1 || task_type == 6 || task_type == LAUNCH_CUSTOM)) {
+            fprintf(stderr, "%-20s - Only built-in interpreters can be "
+                            "persistent, using "
+                            "--worker-mode=fork\n",
+                    "[WARNING]");
+            worker_mode = WORKER_FORK;
+        }
+    }
+    if (arguments.plugin_threads < 1) {
+        fprintf(stderr, "%-20s - Wrong number of plugin threads %d\n",
+                "[ERROR]", arguments.plugin_threads);
+        return E_ARGS;
+    }
+    if (arguments.launcher != NULL &&
+        (launcher = launchParse(arguments.launcher)) < 0) {
+        fprintf(stderr, "%-20s - Wrong launcher %s (use fork or spawn)\n",
+                "[ERROR]", arguments.launcher);
+        return E_ARGS;
+    }
+    if (arguments.output_mode != NULL) {
+        if (strcmp(arguments.output_mode, "stream") == 0) {
+            output_mode = OUTPUT_STREAM;
+        } else if (strcmp(arguments.output_mode, "archive") == 0) {
+            output_mode = OUTPUT_ARCHIVE;
+        } else if (strcmp(arguments.output_mode, "files") != 0) {
+            fprintf(stderr,
+                    "%-20s - Wrong output mode %s (use files, stream or "
+                    "archive)\n",
+                    "[ERROR]", arguments.output_mode);
+            return E_ARGS;
+        }
+    }
+    if (output_mode != OUTPUT_FILES &&
+        (task_type == 6 || worker_mode != WORKER_FORK ||
+         arguments.node_agent)) {
+        fprintf(stderr,
+                "%-20s - Only slaves that start a program for each task can "
+                "stream its output, using --output-mode=files\n",
+                "[WARNING]");
+        output_mode = OUTPUT_FILES;
+    }
+    if (output_mode != OUTPUT_FILES && launcher == LAUNCH_SPAWN) {
+        fprintf(stderr,
+                "%-20s - Streamed output is read from pipes set up after "
+                "forking, using --launcher=fork\n",
+                "[WARNING]");
+        launcher = LAUNCH_FORK;
+    }
+    if (arguments.compress_output != NULL &&
+        (compress_mode = compressMethod(arguments.compress_output)) < 0) {
+        fprintf(stderr,
+                "%-20s - Wrong compression %s (use none, gzip or zstd)\n",
+                "[ERROR]", arguments.compress_output);
+        return E_ARGS;
+    }
+    if (arguments.compress_level < 0 ||
+        arguments.compress_level >
+            (compress_mode == COMPRESS_GZIP ? 9 : COMPRESS_MAX_LEVEL)) {
+        fprintf(stderr, "%-20s - Wrong compression level %d\n", "[ERROR]",
+                arguments.compress_level);
+        return E_ARGS;
+    }
+    if (compress_mode != COMPRESS_NONE &&
+        (task_type == 6 || worker_mode != WORKER_FORK ||
+         output_mode != OUTPUT_FILES)) {
+        fprintf(stderr,
+                "%-20s - Only the files written by programs started for each "
+                "task can be compressed, ignoring --compress-output\n",
+                "[WARNING]");
+        compress_mode = COMPRESS_NONE;
+    }
+    if (compress_mode != COMPRESS_NONE && launcher == LAUNCH_SPAWN) {
+        fprintf(stderr,
+                "%-20s - Compressed output is written through pipes set up "
+                "after forking, using --launcher=fork\n",
+                "[WARNING]");
+        launcher = LAUNCH_FORK;
+    }
+    if (arguments.cgroup_cores >= 0 &&
+        (task_type == 6 || worker_mode != WORKER_FORK)) {
+        fprintf(stderr,
+                "%-20s - Only programs started for each task can run in "
+                "their own cgroup, ignoring --cgroup\n",
+                "[WARNING]");
+        arguments.cgroup_cores = -1;
+    }
+    if (arguments.cgroup_cores >= 0 && launcher == LAUNCH_SPAWN) {
+        fprintf(stderr,
+                "%-20s - Programs move to their cgroup after forking, using "
+                "--launcher=fork\n",
+                "[WARNING]");
+        launcher = LAUNCH_FORK;
+    }
+    // -s used to edit the Maple program, now it is just one core per task
+    if (arguments.maple_single_cpu && arguments.task_cores == 0)
+        arguments.task_cores = 1;
+    if (arguments.task_cores < 0) {
+        fprintf(stderr, "%-20s - Wrong number of cores per task %d\n",
+                "[ERROR]", arguments.task_cores);
+        return E_ARGS;
+    }
+    if (arguments.cgroup_cores == 0)
+        arguments.cgroup_cores = arguments.task_cores;
+    if (arguments.pin_set && (pin_mode = pinParse(arguments.pin)) < 0) {
+        fprintf(stderr, "%-20s - Wrong placement %s (use threads or cores)\n",
+                "[ERROR]", arguments.pin);
+        return E_ARGS;
+    }
+    if (arguments.node_agent && task_type != 6 &&
+        worker_mode != WORKER_FORK) {
+        fprintf(stderr,
+                "%-20s - Persistent interpreters and zygotes run one task at "
+                "a time, ignoring --node-agent\n",
+                "[WARNING]");
+        arguments.node_agent = 0;
+    }
+    if (arguments.node_agent && pin_mode != PIN_NONE) {
+        if (task_type == 6) {
+            fprintf(stderr, "%-20s - Plugin threads of a node agent cannot be "
+                            "pinned, ignoring --pin\n",
+                    "[WARNING]");
+            pin_mode = PIN_NONE;
+        } else if (launcher == LAUNCH_SPAWN) {
+            fprintf(stderr, "%-20s - Node agents pin each program after "
+                            "forking it, using --launcher=fork\n",
+                    "[WARNING]");
+            launcher = LAUNCH_FORK;
+        }
+    }
+    if (arguments.work_stealing &&
+        (task_type == 6 || worker_mode != WORKER_FORK ||
+         arguments.node_agent)) {
+        fprintf(stderr,
+                "%-20s - Only slaves that start a program for each task can "
+                "steal work, ignoring --work-stealing\n",
+                "[WARNING]");
+        arguments.work_stealing = 0;
+    }
+    if (arguments.scratch != NULL &&
+        (task_type == 6 || worker_mode != WORKER_FORK ||
+         arguments.node_agent || output_mode != OUTPUT_FILES)) {
+        fprintf(stderr,
+                "%-20s - Only slaves that start a program for each task and "
+                "write its files can stage them, ignoring --scratch\n",
+                "[WARNING]");
+        arguments.scratch = NULL;
+    }
+    if (arguments.cache_size <= 0) {
+        fprintf(stderr, "%-20s - Wrong cache size %ld\n", "[ERROR]",
+                arguments.cache_size);
+        return E_ARGS;
+    }
+    if (arguments.cache == NULL && arguments.nCacheInputs > 0)
+        fprintf(stderr,
+                "%-20s - Input files are only cached with --cache, ignoring "
+                "--cache-input\n",
+                "[WARNING]");
+    // the files sent to the nodes are read once
+    if (arguments.cache != NULL) {
+        if (cacheAdd(&cache, inp_programFile) != 0)
+            fprintf(stderr, "%-20s - Cannot read %s, it is not cached\n",
+                    "[WARNING]", inp_programFile);
+        for (i = 0; i < arguments.nCacheInputs; i++)
+            if (cacheAdd(&cache, arguments.cache_inputs[i]) != 0)
+                fprintf(stderr, "%-20s - Cannot read %s, it is not cached\n",
+                        "[WARNING]", arguments.cache_inputs[i]);
+        if (cache.n == 0)
+            arguments.cache = NULL;
+    }
+    if (arguments.sample_interval < 0) {
+        fprintf(stderr, "%-20s - Wrong sample interval %d\n", "[ERROR]",
+                arguments.sample_interval);
+        return E_ARGS;
+    }
+    if (arguments.sample_interval > 0 &&
+        (task_type == 6 || worker_mode != WORKER_FORK)) {
+        fprintf(stderr,
+                "%-20s - Only programs started for each task can be sampled, "
+                "ignoring --sample-interval\n",
+                "[WARNING]");
+        arguments.sample_interval = 0;
+    }
+    if (arguments.batch_size < 1) {
+        fprintf(stderr, "%-20s - Wrong batch size %d\n", "[ERROR]",
+                arguments.batch_size);
+        return E_ARGS;
+    }
+    if (arguments.batch_size > 1 && task_type != 6) {
+        fprintf(stderr,
+                "%-20s - Only C plugins run tasks in batches, ignoring "
+                "--batch-size\n",
+                "[WARNING]");
+        arguments.batch_size = 1;
+    }
+
+    // the output of every task goes to a single file, or to the archive
+    if (output_mode != OUTPUT_FILES &&
+        outputOpen(&outw, output_mode, out_dir,
+                   arguments.reducer != NULL) != 0) {
+        fprintf(stderr,
+                "%-20s - Cannot create the output files in %s, make sure "
+                "the output folder exists\n",
+                "[ERROR]", out_dir);
+        return E_OUTDIR;
+    }
+
+    // load the reducer before anything is executed
+    if (arguments.reducer != NULL) {
+        if (reducerLoad(arguments.reducer, out_dir, &red) != 0) {
+            printAbort();
+            return E_REDUCER;
+        }
+    }
+
     /*
      * Read node configuration file
      */
@@ -244,6 +943,14 @@ int main(int argc, char *argv[]) {
         printAbort();
         return E_NODEFILE;
     }
+    // multi-core tasks take several cores of the node each
+    if (arguments.task_cores > 1) {
+        for (i = 0; i < nNodes; i++) {
+            nodeCores[i] /= arguments.task_cores;
+            if (nodeCores[i] < 1)
+                nodeCores[i] = 1;
+        }
+    }
 
     /*
      * READ DATAFILE
@@ -254,6 +961,19 @@ int main(int argc, char *argv[]) {
         printAbort();
         return E_DATAFILE;
     }
+    // emitted tasks are numbered after the last task of the datafile
+    nextTaskNumber = 0;
+    for (task_ptr t = currentTask; t != NULL; t = t->next)
+        if (t->number >= nextTaskNumber)
+            nextTaskNumber = t->number + 1;
+    // hold tasks that have to wait for others
+    if (arguments.depends) {
+        if ((heldTasks = dagLoad(arguments.depfile, &currentTask, &graph)) <
+            0) {
+            printAbort();
+            return E_DEPFILE;
+        }
+    }
 
     /*
      * INITIALIZE PVMD
@@ -314,6 +1034,9 @@ int main(int argc, char *argv[]) {
     for (i = 0; i < nNodes; i++) {
         maxConcurrentTasks += nodeCores[i];
     }
+    slotsPerSlave = task_type == 6 ? arguments.plugin_threads : 1;
+    nSlots = maxConcurrentTasks * slotsPerSlave;
+    nSlaves = arguments.node_agent ? nNodes : maxConcurrentTasks;
 
     // Print execution info
     printf("\n\n == PRINCESS BALA v%s ==\n", VERSION);
@@ -332,16 +1055,54 @@ int main(int argc, char *argv[]) {
         printf("%s (%d), ", nodes[i], nodeCores[i]);
     printf("%s (%d)\n", nodes[nNodes - 1], nodeCores[nNodes - 1]);
     printf("%-20s - Will create %d tasks for %d slaves in %d nodes\n\n",
-           "[INFO]", nTasks, maxConcurrentTasks, nNodes);
+           "[INFO]", nTasks, nSlaves, nNodes);
+    if (arguments.node_agent)
+        printf("%-20s - Each node will run all its tasks in one slave\n\n",
+               "[INFO]");
+    if (worker_mode == WORKER_PERSISTENT)
+        printf("%-20s - Tasks will run in persistent interpreters (restarted "
+               "every %d tasks)\n\n",
+               "[INFO]", arguments.worker_recycle);
+    else if (worker_mode == WORKER_ZYGOTE)
+        printf("%-20s - Tasks will be forked from Python zygotes (restarted "
+               "every %d tasks)\n\n",
+               "[INFO]", arguments.worker_recycle);
+    if (task_type == 6)
+        printf("%-20s - Each %s will run %d plugin tasks at once in %s\n\n",
+               "[INFO]", arguments.node_agent ? "core" : "slave", slotsPerSlave,
+               arguments.plugin_isolation ? "forked processes" : "threads");
+    if (arguments.batch_size > 1)
+        printf("%-20s - Tasks will be sent in batches of up to %d tasks\n\n",
+               "[INFO]", arguments.batch_size);
+    if (arguments.task_cores > 0)
+        printf("%-20s - Each task will use %d cores\n\n", "[INFO]",
+               arguments.task_cores);
+    if (pin_mode != PIN_NONE)
+        printf("%-20s - %s will be pinned to their own %s and NUMA "
+               "node\n\n",
+               "[INFO]", arguments.node_agent ? "Tasks" : "Slaves",
+               pin_mode == PIN_CORES ? "cores" : "hardware threads");
+    if (arguments.depends)
+        printf("%-20s - %d tasks will wait for their dependencies (%s)\n\n",
+               "[INFO]", heldTasks, arguments.depfile);
 
     // Spawn all the slaves
     printf("== INITIALISING PVM NODES ==\n");
-    int slaveId[maxConcurrentTasks];
+    int slaveId[nSlaves];
+    char *slaveNode[nSlaves]; // node of each slave
+    int slaveTask[nSlots]; // task running in each slot, or -1
+    int slotSlave[nSlots]; // slave of each slot
+    for (i = 0; i < nSlots; i++)
+        slaveTask[i] = -1;
     itid = 0;
+    firstSlot = 0;
     int numt;
     int numnode = 0;
     for (i = 0; i < nNodes; i++) {
-        for (j = 0; j < nodeCores[i]; j++) {
+        // a node agent takes every slot of its node
+        slaveSlots = arguments.node_agent ? nodeCores[i] * slotsPerSlave
+                                          : slotsPerSlave;
+        for (j = 0; j < (arguments.node_agent ? 1 : nodeCores[i]); j++) {
             if (access("PBala_task", F_OK) != -1) {
                 numt = pvm_spawn("PBala_task", NULL, PvmTaskHost, nodes[i], 1,
                                  &slaveId[itid]);
@@ -373,6 +1134,9 @@ int main(int argc, char *argv[]) {
                 pvm_halt();
                 return E_PVM_SPAWN;
             }
+            slaveNode[itid] = nodes[i];
+            for (k = 0; k < slaveSlots; k++)
+                slotSlave[firstSlot + k] = itid;
             // Send info to task
             pvm_initsend(PVM_ENCODING);
             pvm_pkint(&itid, 1, 1);
@@ -383,195 +1147,350 @@ int main(int argc, char *argv[]) {
             pvm_pkint(&(arguments.custom_path), 1, 1);
             if (arguments.custom_path)
                 pvm_pkstr(arguments.program_path);
+            pvm_pkint(&stop_mode, 1, 1);
+            if (stop_mode == STOP_REGEX)
+                pvm_pkstr(arguments.stop_when);
+            else if (stop_mode == STOP_EXIT)
+                pvm_pkint(&stop_code, 1, 1);
+            pvm_pkint(&worker_mode, 1, 1);
+            pvm_pkint(&(arguments.worker_recycle), 1, 1);
+            pvm_pkint(&slaveSlots, 1, 1);
+            pvm_pkint(&(arguments.plugin_isolation), 1, 1);
+            pvm_pkint(&(arguments.batch_size), 1, 1);
+            pvm_pkint(&launcher, 1, 1);
+            pvm_pkstr(ldef.exe);
+            pvm_pkstr(ldef.tmpl);
+            pvm_pkint(&(arguments.cgroup_cores), 1, 1);
+            pvm_pkint(&(arguments.sample_interval), 1, 1);
+            pvm_pkint(&(arguments.ledger), 1, 1);
+            pvm_pkint(&pin_mode, 1, 1);
+            pvm_pkint(&j, 1, 1); // slave of the node, out of nodeCores[i]
+            pvm_pkint(&nodeCores[i], 1, 1);
+            pvm_pkint(&(arguments.task_cores), 1, 1);
+            pvm_pkint(&(arguments.node_agent), 1, 1);
+            pvm_pkint(&firstSlot, 1, 1);
+            pvm_pkint(&(arguments.work_stealing), 1, 1);
+            pvm_pkint(&output_mode, 1, 1);
+            pvm_pkint(&(arguments.shard_output), 1, 1);
+            pvm_pkint(&compress_mode, 1, 1);
+            pvm_pkint(&(arguments.compress_level), 1, 1);
+            pvm_pkstr(arguments.scratch != NULL ? arguments.scratch : "");
+            // the first slave of each node writes the files to the cache
+            pvm_pkstr(arguments.cache != NULL ? arguments.cache : "");
+            if (arguments.cache != NULL) {
+                cache_bytes = arguments.cache_size * 1024 * 1024;
+                pvm_pklong(&cache_bytes, 1, 1);
+                cachePack(&cache, j == 0);
+            }
             pvm_send(slaveId[itid], MSG_GREETING);
             printf("%-20s - Initialised node %d\n", "[CREATE NODE]", itid);
             if (arguments.create_slave)
                 fprintf(nodeInfoFile, "# Node %2d -> %s\n", numnode, nodes[i]);
             numnode++;
 
+            firstSlot += slaveSlots;
             itid++;
         }
     }
     printf("%-20s - All nodes created successfully\n\n", "[INFO]");
+    cacheFree(&cache);
+    free(arguments.cache_inputs);
+    // slaves that steal work talk to each other
+    if (arguments.work_stealing) {
+        pvm_initsend(PVM_ENCODING);
+        pvm_pkint(&nSlaves, 1, 1);
+        pvm_pkint(slaveId, nSlaves, 1);
+        pvm_mcast(slaveId, nSlaves, MSG_PEERS);
+    }
 
     if (arguments.create_slave)
         fprintf(nodeInfoFile, "\nNODE,TASK\n");
 
     printf("== SENDING WORK TO NODES ==\n");
-    int status, taskNumber, tries;
+    int status, taskNumber, tries, exit_code, stop_match, bufid;
+    int msgtag, msgbytes, msgtid;
+    double slave_time;
+    // slots waiting for work
+    int idleSlaves[nSlots];
+    int nIdle = 0;
+    int batch; // tasks sent at once to a slot
+    // observed task durations (for the deadline)
+    double mean_time = 0;
+    int nCompleted = 0;
+    double remaining;
+    struct timeval tmout;
+    task_ptr *nextTask;
     work_code = MSG_GREETING;
     while (currentTask != NULL || runningTasks != 0) {
-        if (runningTasks != maxConcurrentTasks && currentTask != NULL) {
-            // wait for a ready signal
-            if (pvm_nrecv(-1, MSG_READY)) {
-                pvm_upkint(&itid, 1, 1);
-                // send a job if there is one
-                if (currentTask != NULL) {
-                    pvm_initsend(PVM_ENCODING);
-                    pvm_pkint(&work_code, 1, 1);
-                    pvm_pkint(&currentTask->number, 1, 1);
-                    pvm_pkint(&currentTask->tries, 1, 1);
-                    pvm_pkstr(inp_programFile);
-                    pvm_pkstr(out_dir);
-                    pvm_pkstr(currentTask->args);
-                    // create file for pari execution if needed
-                    if (task_type == 3) {
-                        if (parifile(currentTask->number, currentTask->args,
-                                     inp_programFile, out_dir) == -1)
-                            return E_IO; // i/o error
-                        printf("%-20s Creating auxiliary Pari script for task "
-                               "%d\n",
-                               "[CREATED SCRIPT]", currentTask->number);
-                    } else if (task_type == 4) {
-                        if (sagefile(currentTask->number, currentTask->args,
-                                     inp_programFile, out_dir) == -1)
-                            return E_IO; // i/o error
-                        printf("%-20s Creating auxiliary Sage script for task "
-                               "%d\n",
-                               "[CREATED SCRIPT]", currentTask->number);
-                    } else if (task_type == 5) {
-                        if (octavefile(currentTask->number, currentTask->args,
-                                       inp_programFile, out_dir) == -1)
-                            return E_IO;
-                        printf("%-20s Creating auxiliary Octave script for "
-                               "task %d\n",
-                               "[CREATED SCRIPT]", currentTask->number);
-                    }
-
-                    // send the job
-                    pvm_send(slaveId[itid], MSG_WORK);
-                    printf("%-20s - Sent task %3d for execution in slave %d\n",
-                           "[TASK SENT]", currentTask->number, itid);
-                    if (arguments.create_slave)
-                        fprintf(nodeInfoFile, "%2d,%4d\n", i,
-                                currentTask->number);
-
-                    removeTask(&currentTask);
-                    runningTasks++;
-                }
+        // Deadline reached: kill running tasks and drain
+        if (deadline > 0 && !stopping && wallTime() >= deadline) {
+            stopping = 1;
+            printf("%-20s - Deadline reached, stopping the execution\n",
+                   "[DEADLINE]");
+            if (arguments.work_stealing)
+                cancelAllTasks(slaveId, nSlaves);
+            else
+                killRunningTasks(slaveId, slaveTask, nSlots, slotSlave);
+            if (graph != NULL && dagFlush(graph, inp_dataFile) > 0)
+                unfinished_tasks_present = 1;
+        }
+        // Nothing else is started once we are stopping
+        if (stopping && flushTasks(&currentTask, inp_dataFile) > 0)
+            unfinished_tasks_present = 1;
+        remaining = -1;
+        if (deadline > 0 && (remaining = deadline - wallTime()) < 0)
+            remaining = 0; // passed since the check above
+
+        // Send work to every idle slave while there are tasks that can start
+        while (nIdle > 0 && currentTask != NULL &&
+               (nextTask = pickTask(&currentTask, remaining, mean_time,
+                                    estimates, nEstimates)) != NULL) {
+            itid = idleSlaves[--nIdle];
+            // with work stealing each slave gets its share of the queue
+            batch = arguments.batch_size;
+            if (arguments.work_stealing) {
+                batch = 0;
+                for (task_ptr t = currentTask; t != NULL; t = t->next)
+                    batch++;
+                batch = (batch + nSlots - 1) / nSlots;
             }
-            // wait for a job result
-            if (pvm_nrecv(-1, MSG_RESULT)) {
-                pvm_upkint(&itid, 1, 1);
-                pvm_upkint(&taskNumber, 1, 1);
-                pvm_upkint(&tries, 1, 1);
-                pvm_upkint(&status, 1, 1);
-                pvm_upkstr(aux_str);
-                // Check if response is error at forking
-                if (status == ST_MEM_ERR) {
-                    fprintf(stderr,
-                            "%-20s - Could not execute task %d in slave %d "
-                            "(out of memory)\n",
-                            "[ERROR]", taskNumber, itid);
-                    if (tries < MAX_TASK_TRIES)
-                        addTask(&currentTask, taskNumber, aux_str, tries);
-                    else {
-                        addUnfinishedTask(inp_dataFile, taskNumber, aux_str);
-                        unfinished_tasks_present = 1;
-                    }
-                } else if (status == ST_FORK_ERR) {
-                    fprintf(stderr,
-                            "%-20s - Could not fork process for task "
-                            "%d in slave %d\n",
-                            "[ERROR]", taskNumber, itid);
-                    if (tries < MAX_TASK_TRIES)
-                        addTask(&currentTask, taskNumber, aux_str, tries);
-                    else {
-                        addUnfinishedTask(inp_dataFile, taskNumber, aux_str);
-                        unfinished_tasks_present = 1;
-                    }
+            pvm_initsend(PVM_ENCODING);
+            pvm_pkint(&work_code, 1, 1);
+            pvm_pkint(&(*nextTask)->number, 1, 1);
+            pvm_pkint(&(*nextTask)->tries, 1, 1);
+            pvm_pkstr(inp_programFile);
+            pvm_pkstr(out_dir);
+            pvm_pkstr((*nextTask)->args);
+            pvm_pkint(&itid, 1, 1); // slot, for slaves with several
+
+            printf("%-20s - Sent task %3d for execution in slave %d\n",
+                   "[TASK SENT]", (*nextTask)->number, itid);
+            if (arguments.create_slave)
+                fprintf(nodeInfoFile, "%2d,%4d\n", itid,
+                        (*nextTask)->number);
+            slaveTask[itid] = (*nextTask)->number;
+            removeTask(nextTask);
+            runningTasks++;
+
+            // fill the batch, each task preceded by a nonzero int
+            for (j = 1; j < batch && currentTask != NULL &&
+                        (nextTask = pickTask(&currentTask, remaining,
+                                             mean_time, estimates,
+                                             nEstimates)) != NULL;
+                 j++) {
+                pvm_pkint(&j, 1, 1);
+                pvm_pkint(&(*nextTask)->number, 1, 1);
+                pvm_pkint(&(*nextTask)->tries, 1, 1);
+                pvm_pkstr((*nextTask)->args);
+                printf("%-20s - Sent task %3d for execution in slave %d\n",
+                       "[TASK SENT]", (*nextTask)->number, itid);
+                if (arguments.create_slave)
+                    fprintf(nodeInfoFile, "%2d,%4d\n", itid,
+                            (*nextTask)->number);
+                removeTask(nextTask);
+                runningTasks++;
+            }
+            j = 0;
+            pvm_pkint(&j, 1, 1);
+
+            // send the job
+            pvm_send(slaveId[slotSlave[itid]], MSG_WORK);
+        }
+
+        // None of the remaining tasks can finish before the deadline
+        if (runningTasks == 0 && currentTask != NULL && deadline > 0 &&
+            pickTask(&currentTask, remaining, mean_time, estimates,
+                     nEstimates) == NULL) {
+            printf("%-20s - Remaining tasks cannot finish before the "
+                   "deadline\n",
+                   "[DEADLINE]");
+            stopping = 1;
+            continue;
+        }
+
+        // Wait for a message (ready signal or job result)
+        if (deadline > 0 && !stopping) {
+            remaining = deadline - wallTime();
+            if (remaining < 0)
+                remaining = 0;
+            tmout.tv_sec = (long)remaining;
+            tmout.tv_usec = (long)((remaining - tmout.tv_sec) * 1e6);
+            bufid = pvm_trecv(-1, -1, &tmout);
+        } else {
+            bufid = pvm_recv(-1, -1);
+        }
+        if (bufid <= 0)
+            continue;
+        pvm_bufinfo(bufid, &msgbytes, &msgtag, &msgtid);
+        // slaves offer all their idle slots at once
+        if (msgtag == MSG_READY) {
+            pvm_upkint(&j, 1, 1);
+            pvm_upkint(&idleSlaves[nIdle], j, 1);
+            nIdle += j;
+            continue;
+        }
+        // output of a task that is still running
+        if (msgtag == MSG_OUTPUT) {
+            if (output_mode != OUTPUT_FILES &&
+                outputReceive(&outw, &taskNumber) != 0)
+                fprintf(stderr,
+                        "%-20s - Cannot write the output of task %d\n",
+                        "[ERROR]", taskNumber);
+            continue;
+        }
+        if (msgtag != MSG_RESULT)
+            continue;
+
+        pvm_upkint(&itid, 1, 1);
+        pvm_upkint(&taskNumber, 1, 1);
+        pvm_upkint(&tries, 1, 1);
+        pvm_upkint(&status, 1, 1);
+        pvm_upkstr(aux_str);
+        runningTasks--;
+        // staged results can arrive after the slot got its next task
+        if (slaveTask[itid] == taskNumber)
+            slaveTask[itid] = -1;
+        // Check if response is error at forking
+        if (status == ST_MEM_ERR) {
+            fprintf(stderr,
+                    "%-20s - Could not execute task %d in slave %d "
+                    "(out of memory)\n",
+                    "[ERROR]", taskNumber, itid);
+            if (retryTask(&currentTask, graph, inp_dataFile, taskNumber,
+                          aux_str, tries))
+                unfinished_tasks_present = 1;
+        } else if (status == ST_FORK_ERR) {
+            fprintf(stderr,
+                    "%-20s - Could not fork process for task "
+                    "%d in slave %d\n",
+                    "[ERROR]", taskNumber, itid);
+            if (retryTask(&currentTask, graph, inp_dataFile, taskNumber,
+                          aux_str, tries))
+                unfinished_tasks_present = 1;
+        } else {
+            pvm_upkdouble(&exec_time, 1, 1);
+            pvm_upkdouble(&slave_time, 1, 1);
+            pvm_upkint(&exit_code, 1, 1);
+            pvm_upkint(&stop_match, 1, 1);
+            // push new tasks emitted by this one into the queue
+            pvm_upkint(&nEmitted, 1, 1);
+            for (j = 0; j < nEmitted; j++) {
+                char emitted_args[BUFFER_SIZE];
+                pvm_upkstr(emitted_args);
+                if (graph == NULL) {
+                    addTask(&currentTask, nextTaskNumber, emitted_args, 0);
                 } else {
-                    pvm_upkdouble(&exec_time, 1, 1);
-                    // Check if task was killed or completed
-                    if (status == ST_TASK_KILLED) {
-                        // no retry if task was killed (was killed for a
-                        // reason!)
-                        fprintf(stderr,
-                                "%-20s - Task %4d was stopped or killed "
-                                "after %14.9G seconds\n",
-                                "[ERROR]", taskNumber, exec_time);
-                        addUnfinishedTask(inp_dataFile, taskNumber, aux_str);
-                        unfinished_tasks_present = 1;
-                    } else {
-                        printf("%-20s - Task %4d completed in %14.9G seconds\n",
-                               "[TASK COMPLETED]", taskNumber, exec_time);
-                        if (arguments.create_slave) {
-                            fprintf(nodeInfoFile, "%2d,%4d\n", itid,
-                                    taskNumber);
-                        }
-                    }
-                    total_time += exec_time;
-                    runningTasks--;
+                    task_ptr t = newTask(nextTaskNumber, emitted_args, 0, NULL);
+                    t->priority = dagPriority(graph, taskNumber);
+                    insertTask(&currentTask, t);
                 }
+                printf("%-20s - Task %4d emitted task %4d (%s)\n",
+                       "[TASK EMITTED]", taskNumber, nextTaskNumber,
+                       emitted_args);
+                nextTaskNumber++;
+                nTasks++;
             }
-        } else {
-            // wait for a job result
-            if (pvm_recv(-1, MSG_RESULT)) {
-                pvm_upkint(&itid, 1, 1);
-                pvm_upkint(&taskNumber, 1, 1);
-                pvm_upkint(&tries, 1, 1);
-                pvm_upkint(&status, 1, 1);
-                pvm_upkstr(aux_str);
-                // Check if response is error at forking
-                if (status == ST_MEM_ERR) {
-                    fprintf(stderr,
-                            "%-20s - Could not execute task %d in slave %d "
-                            "(out of memory)\n",
-                            "[ERROR]", taskNumber, itid);
-                    if (tries < MAX_TASK_TRIES)
-                        addTask(&currentTask, taskNumber, aux_str, tries);
-                    else {
-                        addUnfinishedTask(inp_dataFile, taskNumber, aux_str);
-                        unfinished_tasks_present = 1;
-                    }
-                } else if (status == ST_FORK_ERR) {
+            if (arguments.ledger) {
+                unpackUsage(&usage);
+                ledgerWrite(ledger, taskNumber,
+                            slaveNode[slotSlave[itid]], itid, tries,
+                            status, exit_code, exec_time, &usage);
+            }
+            // Check if task was killed or completed
+            if (status == ST_TASK_KILLED) {
+                // no retry if task was killed (was killed for a
+                // reason!)
+                fprintf(stderr,
+                        "%-20s - Task %4d was stopped or killed "
+                        "after %14.9G seconds\n",
+                        "[ERROR]", taskNumber, exec_time);
+                addUnfinishedTask(inp_dataFile, taskNumber, aux_str);
+                unfinished_tasks_present = 1;
+                if (graph != NULL)
+                    dagFail(graph, taskNumber, inp_dataFile);
+            } else if (status == ST_TASK_CANCELLED) {
+                fprintf(stderr,
+                        "%-20s - Task %4d was killed after %14.9G seconds "
+                        "because the execution is stopping\n",
+                        "[CANCELLED]", taskNumber, exec_time);
+                addUnfinishedTask(inp_dataFile, taskNumber, aux_str);
+                unfinished_tasks_present = 1;
+            } else {
+                printf("%-20s - Task %4d completed in %14.9G seconds\n",
+                       "[TASK COMPLETED]", taskNumber, exec_time);
+                mean_time = (mean_time * nCompleted + exec_time) /
+                            (nCompleted + 1);
+                nCompleted++;
+                if (arguments.create_slave) {
+                    fprintf(nodeInfoFile, "%2d,%4d\n", itid, taskNumber);
+                }
+                if (arguments.reducer != NULL &&
+                    output_mode != OUTPUT_FILES) {
+                    size_t len;
+                    const char *data = outputData(&outw, taskNumber, &len);
+                    reducerFeed(&red, taskNumber, data, len);
+                } else if (arguments.reducer != NULL) {
+                    taskDir(task_dir, out_dir, taskNumber,
+                            arguments.shard_output, 0);
+                    reducerAccumulate(&red, task_dir, taskNumber);
+                }
+                // dependents only run after a successful exit
+                if (graph != NULL && exit_code != 0) {
                     fprintf(stderr,
-                            "%-20s - Could not fork process for task "
-                            "%d in slave %d\n",
-                            "[ERROR]", taskNumber, itid);
-                    if (tries < MAX_TASK_TRIES)
-                        addTask(&currentTask, taskNumber, aux_str, tries);
-                    else {
-                        addUnfinishedTask(inp_dataFile, taskNumber, aux_str);
-                        unfinished_tasks_present = 1;
-                    }
-                } else {
-                    pvm_upkdouble(&exec_time, 1, 1);
-                    // Check if task was killed or completed
-                    if (status == ST_TASK_KILLED) {
-                        // no retry if task was killed (was killed for a
-                        // reason!)
-                        fprintf(stderr,
-                                "%-20s - Task %4d was stopped or killed "
-                                "after %14.9G seconds\n",
-                                "[ERROR]", taskNumber, exec_time);
-                        addUnfinishedTask(inp_dataFile, taskNumber, aux_str);
-                        unfinished_tasks_present = 1;
-                    } else {
-                        printf("%-20s - Task %4d completed in %14.9G seconds\n",
-                               "[TASK COMPLETED]", taskNumber, exec_time);
-                        if (arguments.create_slave) {
-                            fprintf(nodeInfoFile, "%2d,%4d\n", itid,
-                                    taskNumber);
-                        }
-                    }
-                    total_time += exec_time;
-                    runningTasks--;
+                            "%-20s - Task %4d exited with code %d, its "
+                            "dependents will not be executed\n",
+                            "[ERROR]", taskNumber, exit_code);
+                    // rerunning the unfinished file must run it again
+                    addUnfinishedTask(inp_dataFile, taskNumber, aux_str);
+                    unfinished_tasks_present = 1;
+                    dagFail(graph, taskNumber, inp_dataFile);
+                } else if (graph != NULL) {
+                    dagComplete(graph, taskNumber, &currentTask);
                 }
             }
+            total_time += exec_time;
+
+            // A task satisfied the stop predicate: kill everything
+            if (stop_match && !stopping) {
+                stopping = 1;
+                printf("%-20s - Task %4d satisfied the stop predicate %s, "
+                       "stopping the execution\n",
+                       "[STOP]", taskNumber, arguments.stop_when);
+                if (arguments.work_stealing)
+                    cancelAllTasks(slaveId, nSlaves);
+                else
+                    killRunningTasks(slaveId, slaveTask, nSlots,
+                                     slotSlave);
+                if (graph != NULL && dagFlush(graph, inp_dataFile) > 0)
+                    unfinished_tasks_present = 1;
+            }
         }
+        if (output_mode != OUTPUT_FILES &&
+            outputFlush(&outw, taskNumber) != 0)
+            fprintf(stderr, "%-20s - Cannot write the output of task %d\n",
+                    "[ERROR]", taskNumber);
     }
+    // tasks whose dependencies could not be satisfied
+    if (graph != NULL && dagFlush(graph, inp_dataFile) > 0)
+        unfinished_tasks_present = 1;
     printf("%-20s - End of work, all unfinished jobs (if any) have been "
            "recorded\n\n",
            "[INFO]");
+    if (arguments.reducer != NULL) {
+        if (reducerFinalize(&red) != 0)
+            fprintf(stderr, "%-20s - Reducer %s failed to finalize\n",
+                    "[ERROR]", red.name);
+        else
+            printf("%-20s - Reducer %s finished\n\n", "[INFO]", red.name);
+    }
 
     // Shut down all the slaves
     printf("== SHUTTING DOWN ALL SLAVES ==\n");
     work_code = MSG_STOP;
-    for (i = 0; i < maxConcurrentTasks; i++) {
+    for (i = 0; i < nSlaves; i++) {
         pvm_initsend(PVM_ENCODING);
         pvm_pkint(&work_code, 1, 1);
-        pvm_send(slaveId[i], MSG_STOP);
+        pvm_send(slaveId[i], MSG_WORK);
         printf("%-20s - Shutting down slave %2d\n", "[INFO]", i);
     }
     printf("%-20s - All slaves have been successfully dismantled\n\n",
@@ -593,36 +1512,18 @@ int main(int argc, char *argv[]) {
     printf("%-20s - Freeing used memory\n", "[CLEANUP]");
     while (currentTask != NULL)
         removeTask(&currentTask);
+    dagFree(graph);
+    free(estimates);
     free(nodes);
     free(nodeCores);
     // close files
     fclose(f_out);
     if (arguments.create_slave)
         fclose(nodeInfoFile);
-    // remove tmp program (if modified)
-    if (arguments.maple_single_cpu) {
-        printf("%-20s - Removing temporary Maple program\n", "[CLEANUP]");
-        sprintf(aux_str, "[ ! -f %s.bak ] || mv %s.bak %s", inp_programFile,
-                inp_programFile, inp_programFile);
-        if (system(aux_str))
-            fprintf(stderr,
-                    "%-20s - Could not clean up Maple single CPU aux scripts\n",
-                    "[ERROR]");
-    }
-    // remove tmp pari/sage/octave programs (if created)
-    if (task_type == 3 || task_type == 4 || task_type == 5) {
-        printf("%-20s - Removing PARI/Sage/Octave aux programs\n", "[CLEANUP]");
-        DIR *dir;
-        struct dirent *ent;
-        dir = opendir(out_dir);
-        while ((ent = readdir(dir))) {
-            if (strstr(ent->d_name, "auxprog") != NULL) {
-                sprintf(aux_str, "%s/%s", out_dir, ent->d_name);
-                remove(aux_str);
-            }
-        }
-        closedir(dir);
-    }
+    if (arguments.ledger)
+        fclose(ledger);
+    if (output_mode != OUTPUT_FILES)
+        outputClose(&outw);
     // warn that there are unfinished tasks
     if (unfinished_tasks_present == 1) {
         printf("%-20s - Unfinished tasks present, run the following "
@@ -0,0 +1,193 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // sched_setaffinity
+#include "PBala_affinity.h"
+#include "PBala_lib.h"
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_NUMA 64 ///< NUMA domains that memory can be bound to
+
+/* Variables that set the number of threads of common runtimes */
+static const char *threadVars[] = {
+    "OMP_NUM_THREADS",   "OPENBLAS_NUM_THREADS",   "MKL_NUM_THREADS",
+    "BLIS_NUM_THREADS",  "VECLIB_MAXIMUM_THREADS", "NUMEXPR_NUM_THREADS",
+    "JULIA_NUM_THREADS", NULL};
+
+int pinParse(char *str) {
+    if (str == NULL || strcmp(str, "threads") == 0)
+        return PIN_THREADS;
+    if (strcmp(str, "cores") == 0)
+        return PIN_CORES;
+    return -1;
+}
+
+/* Parse a sysfs CPU list ("0-3,8,10-11") into a set */
+static int readCpuList(char *fname, cpu_set_t *set) {
+    FILE *f;
+    char buf[BUFFER_SIZE];
+    char *p, *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    if ((f = fopen(fname, "r")) == NULL)
+        return -1;
+    p = fgets(buf, BUFFER_SIZE, f);
+    fclose(f);
+    while (p != NULL && *p >= '0' && *p <= '9') {
+        lo = hi = strtol(p, &end, 10);
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+            CPU_SET(lo, set);
+        p = *end == ',' ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+/* 1 if cpu is the first allowed hardware thread of its core */
+static int firstSibling(int cpu, cpu_set_t *allowed) {
+    char fname[FNAME_SIZE];
+    cpu_set_t siblings;
+    int i;
+
+    sprintf(fname,
+            "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+            cpu);
+    if (readCpuList(fname, &siblings) != 0)
+        return 1;
+    for (i = 0; i < cpu; i++)
+        if (CPU_ISSET(i, &siblings) && CPU_ISSET(i, allowed))
+            return 0;
+    return 1;
+}
+
+int pinSlot(int mode, int slot, int nSlots, char *desc) {
+    cpu_set_t allowed, domain, mine;
+    char fname[FNAME_SIZE];
+    int cpus[CPU_SETSIZE];
+    int nodeStart[MAX_NUMA + 1], nodeId[MAX_NUMA];
+    int nCpus = 0, nNodes = 0, node, i, d, rank, inDomain, lo, hi;
+    unsigned long nodemask;
+    double center;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0)
+        return -1;
+
+    // allowed CPUs grouped by NUMA domain
+    for (node = 0; node < MAX_NUMA; node++) {
+        sprintf(fname, "/sys/devices/system/node/node%d/cpulist", node);
+        if (readCpuList(fname, &domain) != 0)
+            continue;
+        nodeStart[nNodes] = nCpus;
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (!CPU_ISSET(i, &domain) || !CPU_ISSET(i, &allowed) ||
+                (mode == PIN_CORES && !firstSibling(i, &allowed)))
+                continue;
+            cpus[nCpus++] = i;
+        }
+        if (nCpus > nodeStart[nNodes])
+            nodeId[nNodes++] = node;
+    }
+    // without NUMA information the whole machine is one domain
+    if (nNodes == 0) {
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (!CPU_ISSET(i, &allowed) ||
+                (mode == PIN_CORES && !firstSibling(i, &allowed)))
+                continue;
+            cpus[nCpus++] = i;
+        }
+        nodeStart[0] = 0;
+        nodeId[nNodes++] = -1;
+    }
+    nodeStart[nNodes] = nCpus;
+    if (nCpus == 0 || nSlots < 1)
+        return -1;
+
+    // the domain of a slot is the one holding its share of the CPUs, and
+    // the slots of a domain split its CPUs evenly
+    center = (slot + 0.5) * nCpus / nSlots;
+    for (d = 0; d < nNodes - 1 && center >= nodeStart[d + 1]; d++)
+        ;
+    rank = inDomain = 0;
+    for (i = 0; i < nSlots; i++) {
+        double c = (i + 0.5) * nCpus / nSlots;
+        if (c >= nodeStart[d] && (c < nodeStart[d + 1] || d == nNodes - 1)) {
+            if (i < slot)
+                rank++;
+            inDomain++;
+        }
+    }
+    lo = nodeStart[d] + rank * (nodeStart[d + 1] - nodeStart[d]) / inDomain;
+    hi = nodeStart[d] +
+         (rank + 1) * (nodeStart[d + 1] - nodeStart[d]) / inDomain;
+    if (hi <= lo)
+        hi = lo + 1;
+
+    CPU_ZERO(&mine);
+    for (i = lo; i < hi; i++)
+        CPU_SET(cpus[i], &mine);
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &mine) != 0)
+        return -1;
+    if (hi - lo == 1)
+        snprintf(desc, BUFFER_SIZE, "CPU %d", cpus[lo]);
+    else
+        snprintf(desc, BUFFER_SIZE, "CPUs %d-%d", cpus[lo], cpus[hi - 1]);
+    if (hi - lo > 1 && cpus[hi - 1] - cpus[lo] != hi - lo - 1) {
+        // not a contiguous range, list them all
+        int len = snprintf(desc, BUFFER_SIZE, "CPUs %d", cpus[lo]);
+        for (i = lo + 1; i < hi && len < BUFFER_SIZE - 16; i++)
+            len += sprintf(desc + len, ",%d", cpus[i]);
+    }
+
+    // memory comes from the domain of the CPUs
+    if (nodeId[d] >= 0) {
+        nodemask = 1UL << nodeId[d];
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, &nodemask,
+                    sizeof(nodemask) * 8) != 0)
+            return -1;
+        sprintf(desc + strlen(desc), ", memory of NUMA node %d", nodeId[d]);
+    }
+    return 0;
+}
+
+int pinCpus(void) {
+    cpu_set_t allowed;
+    int n;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0 ||
+        (n = CPU_COUNT(&allowed)) < 1)
+        return 1;
+    return n;
+}
+
+void pinThreadEnv(int cores) {
+    char value[16];
+    int i;
+
+    sprintf(value, "%d", cores);
+    for (i = 0; threadVars[i] != NULL; i++)
+        setenv(threadVars[i], value, 1);
+}
@@ -0,0 +1,70 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_AFFINITY_H
+#define PBALA_AFFINITY_H
+/*! \file PBala_affinity.h
+ * \brief Placement of the slaves of a node on its cores and NUMA domains, and
+ * number of threads of their programs
+ * \author Oscar Saleta Reig
+ *
+ * The CPUs a slave may use are listed by NUMA domain (from
+ * /sys/devices/system/node). The slaves of the node are spread over the
+ * domains in proportion to their CPUs, and the CPUs of each domain are split
+ * evenly among the slaves placed in it. Each slave pins itself to its CPUs
+ * and binds its memory to its domain before starting any program, and the
+ * programs inherit both.
+ */
+
+#define PIN_NONE 0    ///< Leave the slaves to the scheduler
+#define PIN_THREADS 1 ///< Use every hardware thread
+#define PIN_CORES 2   ///< Use one hardware thread per core (SMT siblings idle)
+
+/**
+ * Parse a placement mode
+ *
+ * @param  str "threads" or "cores" (NULL for the default, "threads")
+ * @return     PIN_THREADS or PIN_CORES, -1 if unknown
+ */
+int pinParse(char *str);
+/**
+ * Pin the calling process to the CPUs and memory of its slot
+ *
+ * @param  mode   PIN_THREADS or PIN_CORES
+ * @param  slot   index of the slave among the slaves of its node
+ * @param  nSlots number of slaves in the node
+ * @param  desc   where a description of the placement is written (at least
+ *                BUFFER_SIZE bytes)
+ * @return        0 if successful, -1 if error
+ */
+int pinSlot(int mode, int slot, int nSlots, char *desc);
+/**
+ * Number of CPUs the calling process may run on
+ *
+ * @return number of CPUs (at least 1)
+ */
+int pinCpus(void);
+/**
+ * Limit the threads of the programs started from now on, through the
+ * variables read by OpenMP, the BLAS libraries, NumExpr and Julia
+ *
+ * @param cores threads per program
+ */
+void pinThreadEnv(int cores);
+
+#endif /* PBALA_AFFINITY_H */
@@ -0,0 +1,423 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PBala_cache.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pvm3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/* Files of the cache directory, for the eviction */
+typedef struct cached_ {
+    char path[2 * FNAME_SIZE];
+    off_t size;
+    time_t mtime;
+} cached;
+
+/* FNV-1a hash of the contents of a file */
+static void hashData(char *data, long size, char *hash) {
+    uint64_t h = 14695981039346656037ULL;
+    long i;
+
+    for (i = 0; i < size; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    sprintf(hash, "%016llx", (unsigned long long)h);
+}
+
+int cacheAdd(file_cache *c, char *name) {
+    cache_entry *e;
+    struct stat st;
+    FILE *f;
+
+    if (stat(name, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size > INT_MAX || (f = fopen(name, "rb")) == NULL)
+        return -1;
+    c->files = (cache_entry *)realloc(c->files,
+                                      (c->n + 1) * sizeof(cache_entry));
+    e = &c->files[c->n];
+    memset(e, 0, sizeof(cache_entry));
+    e->lock = -1;
+    snprintf(e->name, FNAME_SIZE, "%s", name);
+    e->size = st.st_size;
+    e->mode = st.st_mode & 0777;
+    e->data = (char *)malloc(e->size + 1);
+    if (fread(e->data, 1, e->size, f) != (size_t)e->size) {
+        fclose(f);
+        free(e->data);
+        return -1;
+    }
+    fclose(f);
+    hashData(e->data, e->size, e->hash);
+    c->n++;
+    return 0;
+}
+
+void cachePack(file_cache *c, int data) {
+    int i;
+
+    pvm_pkint(&c->n, 1, 1);
+    pvm_pkint(&data, 1, 1);
+    for (i = 0; i < c->n; i++) {
+        pvm_pkstr(c->files[i].name);
+        pvm_pkstr(c->files[i].hash);
+        pvm_pklong(&c->files[i].size, 1, 1);
+        pvm_pkint(&c->files[i].mode, 1, 1);
+        if (data)
+            pvm_pkbyte(c->files[i].data, (int)c->files[i].size, 1);
+    }
+}
+
+/* Directory of the copies of the contents with the hash of e */
+static int hashDir(cache_entry *e, char *dir, char *hdir) {
+    return snprintf(hdir, FNAME_SIZE, "%s/%s", dir, e->hash) >= FNAME_SIZE
+               ? -1
+               : 0;
+}
+
+/* Take a shared lock on the copy of a file, -1 if there is no complete
+ * copy (or it was removed before it could be locked) */
+static int lockCopy(cache_entry *e) {
+    struct stat st, lst;
+    int fd;
+
+    if ((fd = open(e->path, O_RDONLY)) < 0)
+        return -1;
+    if (flock(fd, LOCK_SH) != 0 || fstat(fd, &lst) != 0 ||
+        lst.st_size != e->size || stat(e->path, &st) != 0 ||
+        st.st_ino != lst.st_ino || st.st_dev != lst.st_dev) {
+        close(fd);
+        return -1;
+    }
+    e->lock = fd;
+    return 0;
+}
+
+/* 1 if the locked copy of a file has the contents received, 0 if it was
+ * changed in place (the name of a copy alone does not prove it) */
+static int sameCopy(cache_entry *e, char *data) {
+    char buf[BUFSIZ];
+    long done = 0;
+    ssize_t n;
+
+    while (done < e->size &&
+           (n = pread(e->lock, buf, sizeof(buf), done)) > 0) {
+        if (n > e->size - done || memcmp(buf, data + done, n) != 0)
+            return 0;
+        done += n;
+    }
+    return done == e->size;
+}
+
+/* Write a file to the cache, through a temporary file so that the other
+ * slaves never see it half written, and lock it, -1 if error (the file is
+ * locked from the start, so that no slave removes it) */
+static int storeFile(cache_entry *e, char *hdir, char *data) {
+    char tmp[FNAME_SIZE + 16];
+    long done = 0;
+    ssize_t n;
+    int fd, err;
+
+    if (mkdir(hdir, 0755) != 0 && errno != EEXIST)
+        return -1;
+    snprintf(tmp, sizeof(tmp), "%s.%d", e->path, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return -1;
+    flock(fd, LOCK_EX);
+    while (done < e->size &&
+           (n = write(fd, data + done, e->size - done)) > 0)
+        done += n;
+    err = fchmod(fd, e->mode) != 0 || done < e->size ||
+          rename(tmp, e->path) != 0;
+    if (err) {
+        unlink(tmp);
+        close(fd);
+        return -1;
+    }
+    // other slaves can use it now, and it is locked through a read-only fd
+    // (a program cannot be executed while it is open for writing)
+    flock(fd, LOCK_SH);
+    err = lockCopy(e);
+    close(fd);
+    return err;
+}
+
+/* Wait for another slave to store a file and lock it, 0 if it did (left is
+ * the time left for every file, in ms) */
+static int waitFile(cache_entry *e, int *left) {
+    struct timespec nap = {0, CACHE_POLL_MS * 1000000L};
+
+    while (lockCopy(e) != 0) {
+        if (*left <= 0)
+            return -1;
+        nanosleep(&nap, NULL);
+        *left -= CACHE_POLL_MS;
+    }
+    return 0;
+}
+
+/* 1 if a name of the cache directory is a directory of copies (HASH) */
+static int isHashDir(char *name) {
+    int i;
+    for (i = 0; i < CACHE_HASH_LEN; i++)
+        if (!isxdigit((unsigned char)name[i]))
+            return 0;
+    return name[CACHE_HASH_LEN] == '\0';
+}
+
+static int byAge(const void *a, const void *b) {
+    time_t ta = ((const cached *)a)->mtime, tb = ((const cached *)b)->mtime;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* Add the copies of a directory of copies to the list */
+static void listCopies(char *hdir, cached **files, int *n, int *cap,
+                       long *total) {
+    char path[2 * FNAME_SIZE];
+    struct dirent *ent;
+    struct stat st;
+    DIR *d;
+
+    if ((d = opendir(hdir)) == NULL)
+        return;
+    while ((ent = readdir(d)) != NULL) {
+        if (snprintf(path, sizeof(path), "%s/%s", hdir, ent->d_name) >=
+                (int)sizeof(path) ||
+            stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        *total += st.st_size;
+        if (*n == *cap) {
+            *cap = *cap ? 2 * *cap : 64;
+            *files = (cached *)realloc(*files, *cap * sizeof(cached));
+        }
+        snprintf((*files)[*n].path, sizeof((*files)[*n].path), "%s", path);
+        (*files)[*n].size = st.st_size;
+        (*files)[(*n)++].mtime = st.st_mtime;
+    }
+    closedir(d);
+}
+
+/* Remove the least recently used copies until the cache fits in max_size,
+ * except those locked by a slave (of this execution or of another one) */
+static void trimCache(char *dir, long max_size) {
+    char hdir[2 * FNAME_SIZE];
+    cached *files = NULL;
+    struct dirent *ent;
+    long total = 0;
+    int i, fd, n = 0, cap = 0;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL)
+        return;
+    while ((ent = readdir(d)) != NULL) {
+        if (!isHashDir(ent->d_name))
+            continue;
+        snprintf(hdir, sizeof(hdir), "%s/%s", dir, ent->d_name);
+        listCopies(hdir, &files, &n, &cap, &total);
+    }
+    closedir(d);
+    qsort(files, n, sizeof(cached), byAge);
+    for (i = 0; i < n && total > max_size; i++) {
+        if ((fd = open(files[i].path, O_RDONLY)) < 0)
+            continue;
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0 && unlink(files[i].path) == 0) {
+            total -= files[i].size;
+            // the directory is only removed once it is empty
+            *strrchr(files[i].path, '/') = '\0';
+            rmdir(files[i].path);
+        }
+        close(fd);
+    }
+    free(files);
+}
+
+/* 1 if dir is one of the entries of a search path */
+static int inSearchPath(char *path, size_t len, char *dir) {
+    size_t n = strlen(dir);
+    char *p;
+
+    for (p = path; p != NULL && p + n <= path + len; p = strchr(p, ':')) {
+        if (*p == ':')
+            p++;
+        if (strncmp(p, dir, n) == 0 && (p[n] == ':' || p[n] == '\0'))
+            return 1;
+    }
+    return 0;
+}
+
+/* Prepend the directories of the files to a search path */
+static void addSearchPath(file_cache *c, char *var) {
+    char *path = NULL, *old = getenv(var), *slash;
+    char dir[PATH_MAX], abs[PATH_MAX];
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < c->n; i++) {
+        if (c->files[i].path[0] == '\0')
+            continue;
+        snprintf(dir, PATH_MAX, "%s", c->files[i].name);
+        slash = strrchr(dir, '/');
+        if (slash == dir)
+            slash[1] = '\0';
+        else if (slash != NULL)
+            *slash = '\0';
+        else
+            strcpy(dir, ".");
+        if (realpath(dir, abs) == NULL || inSearchPath(path, len, abs))
+            continue;
+        path = (char *)realloc(path, len + strlen(abs) + 2);
+        len += sprintf(path + len, "%s%s", len > 0 ? ":" : "", abs);
+    }
+    if (path == NULL)
+        return;
+    if (old != NULL && old[0] != '\0') {
+        path = (char *)realloc(path, len + strlen(old) + 2);
+        sprintf(path + len, ":%s", old);
+    }
+    setenv(var, path, 1);
+    free(path);
+}
+
+int cacheUnpack(file_cache *c, char *dir, long max_size, char *path_var) {
+    cache_entry *e;
+    char *data = NULL, *base;
+    char hdir[FNAME_SIZE];
+    int i, has_data, nCached = 0, left = CACHE_WAIT_MS;
+
+    pvm_upkint(&c->n, 1, 1);
+    pvm_upkint(&has_data, 1, 1);
+    c->files = (cache_entry *)calloc(c->n, sizeof(cache_entry));
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        fprintf(stderr, "%-20s - Cannot create the cache directory %s\n",
+                "[WARNING]", dir);
+    for (i = 0; i < c->n; i++) {
+        e = &c->files[i];
+        e->lock = -1;
+        pvm_upkstr(e->name);
+        pvm_upkstr(e->hash);
+        pvm_upklong(&e->size, 1, 1);
+        pvm_upkint(&e->mode, 1, 1);
+        if (has_data) {
+            data = (char *)realloc(data, e->size + 1);
+            pvm_upkbyte(data, (int)e->size, 1);
+        }
+        base = strrchr(e->name, '/');
+        base = base != NULL ? base + 1 : e->name;
+        if (hashDir(e, dir, hdir) != 0 ||
+            snprintf(e->path, FNAME_SIZE, "%s/%s", hdir, base) >=
+                FNAME_SIZE) {
+            e->path[0] = '\0';
+            continue;
+        }
+        // a copy of the same contents may be left by a previous execution,
+        // which the slave with the contents replaces if it was changed
+        if (lockCopy(e) == 0 && has_data && !sameCopy(e, data)) {
+            close(e->lock);
+            e->lock = -1;
+        }
+        if (e->lock >= 0) {
+            utimes(e->path, NULL); // most recently used
+        } else if (has_data ? storeFile(e, hdir, data) != 0
+                            : waitFile(e, &left) != 0) {
+            fprintf(stderr,
+                    "%-20s - %s is not cached, the tasks read it from its "
+                    "usual path\n",
+                    "[WARNING]", e->name);
+            e->path[0] = '\0';
+            continue;
+        }
+        nCached++;
+    }
+    free(data);
+    // the slave that writes the copies also makes room for them
+    if (has_data)
+        trimCache(dir, max_size);
+    if (path_var != NULL)
+        addSearchPath(c, path_var);
+    return nCached;
+}
+
+void cacheLookup(file_cache *c, char *name) {
+    int i;
+    for (i = 0; i < c->n; i++) {
+        if (c->files[i].path[0] != '\0' &&
+            strcmp(c->files[i].name, name) == 0) {
+            strcpy(name, c->files[i].path);
+            return;
+        }
+    }
+}
+
+void cacheArgs(file_cache *c, char *args, char *out) {
+    char *p = args, *end;
+    int i, len, quoted, n = 0;
+
+    out[0] = '\0';
+    while (1) {
+        end = strchr(p, ',');
+        len = end != NULL ? end - p : (int)strlen(p);
+        quoted = len >= 2 && p[0] == '"' && p[len - 1] == '"';
+        for (i = 0; i < c->n; i++)
+            if (c->files[i].path[0] != '\0' &&
+                (int)strlen(c->files[i].name) == len - 2 * quoted &&
+                strncmp(p + quoted, c->files[i].name, len - 2 * quoted) == 0)
+                break;
+        if (i < c->n)
+            n += snprintf(out + n, BUFFER_SIZE - n, "%s%s%s",
+                          quoted ? "\"" : "", c->files[i].path,
+                          quoted ? "\"" : "");
+        else
+            n += snprintf(out + n, BUFFER_SIZE - n, "%.*s", len, p);
+        if (n >= BUFFER_SIZE - 1) {
+            // the local paths do not fit, keep the arguments as they are
+            snprintf(out, BUFFER_SIZE, "%s", args);
+            return;
+        }
+        if (end == NULL)
+            return;
+        out[n++] = ',';
+        out[n] = '\0';
+        p = end + 1;
+    }
+}
+
+void cacheFree(file_cache *c) {
+    int i;
+    for (i = 0; i < c->n; i++) {
+        free(c->files[i].data);
+        if (c->files[i].lock >= 0)
+            close(c->files[i].lock);
+    }
+    free(c->files);
+    c->files = NULL;
+    c->n = 0;
+}
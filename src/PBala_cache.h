@@ -0,0 +1,129 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_CACHE_H
+#define PBALA_CACHE_H
+/*! \file PBala_cache.h
+ * \brief Node-local cache of the program file and the input files
+ * \author Oscar Saleta Reig
+ *
+ * With --cache=DIR the master reads the program file (and the files given
+ * with --cache-input) once, and sends them in the greeting of the first
+ * slave of each node. That slave stores each file as DIR/HASH/NAME, where
+ * HASH is a hash of its contents, so a file that did not change since the
+ * last execution is not written again and two versions of a file never
+ * collide, while the copy keeps the name of the file. A copy that is already
+ * there is compared with the contents received, and written again if it was
+ * changed in place. The other slaves of
+ * the node only get the names and hashes, and wait for the copies of the
+ * first one.
+ *
+ * Slaves then run the tasks with the local copy of the program, and task
+ * arguments that name an input file (alone or between double quotes) are
+ * replaced by its local copy. The master still gets the arguments of the
+ * datafile in the results. Files that cannot be cached are read from their
+ * usual path.
+ *
+ * The cache keeps the files of previous executions, and the least recently
+ * used ones are removed when it grows over --cache-size MB. Every slave holds
+ * a shared flock on the copies it uses until it ends, and copies that are
+ * locked are never removed, so executions that share the cache directory do
+ * not remove the files of each other.
+ */
+
+#include "PBala_lib.h"
+
+#define CACHE_HASH_LEN 16    ///< Hex digits of the hash of a file
+#define CACHE_SIZE_MB 1024   ///< Default max size of a cache directory
+#define CACHE_WAIT_MS 10000  ///< Max wait for the copies of another slave
+#define CACHE_POLL_MS 100    ///< ms between checks for those copies
+
+typedef struct cache_entry_ {
+    char name[FNAME_SIZE];           ///< path of the file in the master
+    char path[FNAME_SIZE];           ///< local copy ("" if not cached)
+    char hash[CACHE_HASH_LEN + 1];   ///< hash of the contents (hex)
+    long size;                       ///< size in bytes
+    int mode;                        ///< permission bits
+    int lock;                        ///< fd locking the copy (-1 if none)
+    char *data;                      ///< contents (master only)
+} cache_entry;
+
+typedef struct file_cache_ {
+    int n;              ///< number of files
+    cache_entry *files; ///< files
+} file_cache;
+
+/**
+ * Read a file to be sent to the slaves (master)
+ *
+ * @param  c    cache (zeroed before the first file)
+ * @param  name path of the file
+ * @return      0 if successful, -1 if the file cannot be read
+ */
+int cacheAdd(file_cache *c, char *name);
+/**
+ * Pack the files in the active send buffer (master)
+ *
+ * @param c    cache
+ * @param data 1 to pack their contents, 0 for their names and hashes only
+ */
+void cachePack(file_cache *c, int data);
+/**
+ * Unpack the files from the active receive buffer and store them in the
+ * cache directory (slave)
+ *
+ * Files whose contents were not sent are waited for (CACHE_WAIT_MS in all),
+ * since another slave of the node writes them.
+ *
+ * The copies are in other directories than the files, so the directories of
+ * the files can be prepended to the module search path of the programs (such
+ * as PYTHONPATH), for the copy of a program to still find the modules next
+ * to it.
+ *
+ * @param  c        cache (filled)
+ * @param  dir      cache directory, created if it does not exist
+ * @param  max_size max size of the cache directory in bytes
+ * @param  path_var environment variable of the module search path (NULL
+ *                  to leave it as it is)
+ * @return          number of files that have a local copy
+ */
+int cacheUnpack(file_cache *c, char *dir, long max_size, char *path_var);
+/**
+ * Replace the name of a cached file by its local copy (slave)
+ *
+ * @param c    cache
+ * @param name path of the file (FNAME_SIZE bytes), changed if cached
+ */
+void cacheLookup(file_cache *c, char *name);
+/**
+ * Replace the task arguments that name cached files by their local copies
+ * (slave)
+ *
+ * @param c    cache
+ * @param args task arguments
+ * @param out  where the new arguments are stored (BUFFER_SIZE bytes)
+ */
+void cacheArgs(file_cache *c, char *args, char *out);
+/**
+ * Free the files and release the locks on their copies
+ *
+ * @param c cache
+ */
+void cacheFree(file_cache *c);
+
+#endif /* PBALA_CACHE_H */
@@ -0,0 +1,266 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file PBala_cat.c
+ * \brief Print the output of the tasks stored in an output archive
+ * \author Oscar Saleta Reig
+ *
+ * Reads the indexes of the segments written with --output-mode=archive (see
+ * PBala_output.h) and prints the output of one task, or of every task in
+ * task order. A task that was run more than once has records for each run,
+ * and only the streams of its last run are printed.
+ */
+#include "PBala_config.h"
+#include "PBala_errcodes.h"
+#include "PBala_output.h"
+
+#include <argp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Program version and bug email */
+const char *argp_program_version = VERSION;
+const char *argp_program_bug_address = "<osr@mat.uab.cat>";
+
+/* Program documentation */
+static char doc[] = "PBala_cat -- print the output of the tasks of a PBala "
+                    "output archive (--output-mode=archive).\n\tWithout a "
+                    "task number, the output of every task is printed in "
+                    "task order";
+/* Arguments we accept */
+static char args_doc[] = "outdir [tasknumber]";
+
+/* Options */
+static struct argp_option options[] = {
+    {"stream", 's', "NAME", 0,
+     "Stream to print: stdout (default), stderr, mem, killed or all"},
+    {"headers", 'H', 0, 0,
+     "Print a \"==> task N stream (LEN bytes) <==\" line before each output"},
+    {0}};
+
+/* Used by main to communicate with parse_opt */
+struct arguments {
+    char *out_dir;
+    int task;     // -1 for every task
+    char *stream; // NULL for stdout
+    int headers;
+};
+
+/* Parse options */
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+    case 's':
+        arguments->stream = arg;
+        break;
+    case 'H':
+        arguments->headers = 1;
+        break;
+    case ARGP_KEY_ARG:
+        if (state->arg_num == 0)
+            arguments->out_dir = arg;
+        else if (state->arg_num == 1 &&
+                 sscanf(arg, "%d", &arguments->task) == 1)
+            break;
+        else
+            argp_usage(state);
+        break;
+    case ARGP_KEY_END:
+        if (state->arg_num < 1)
+            argp_usage(state);
+        break;
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+/* argp parser */
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+/* A record of the archive */
+typedef struct record_ {
+    int task;
+    int stream;
+    int segment;
+    long offset;
+    size_t len;
+    int execution; // first segment of the execution that wrote it
+    int tries;     // try of the task
+    long order;    // position in the archive, later runs come later
+} record;
+
+/* Order records by task and position (the chunks of a run are written in
+ * the order they arrived) */
+static int cmpRecords(const void *a, const void *b) {
+    const record *x = (const record *)a, *y = (const record *)b;
+    if (x->task != y->task)
+        return x->task < y->task ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * Read the indexes of every segment of the archive
+ *
+ * \param[in]  out_dir  output directory
+ * \param[out] records  where the allocated array of records is stored
+ * \param[out] nSegs    where the number of segments is stored
+ *
+ * \return number of records, -1 if there is no archive
+ */
+static long readIndexes(char *out_dir, record **records, int *nSegs) {
+    char fname[2 * FNAME_SIZE], line[BUFFER_SIZE], name[32];
+    FILE *f;
+    record r;
+    long n = 0, size = 1024;
+    int k, fields;
+
+    *records = (record *)malloc(size * sizeof(record));
+    for (k = 0;; k++) {
+        snprintf(fname, sizeof(fname), ARCHIVE_IDX, out_dir, k);
+        if ((f = fopen(fname, "r")) == NULL)
+            break;
+        while (fgets(line, BUFFER_SIZE, f) != NULL) {
+            fields = sscanf(line, "%d %31s %ld %zu %d %d", &r.task, name,
+                            &r.offset, &r.len, &r.execution, &r.tries);
+            if (fields < 6 || (r.stream = outputStream(name)) < 0)
+                continue;
+            r.segment = k;
+            r.order = n;
+            if (n == size) {
+                size *= 2;
+                *records = (record *)realloc(*records, size * sizeof(record));
+            }
+            (*records)[n++] = r;
+        }
+        fclose(f);
+    }
+    *nSegs = k;
+    if (k == 0) {
+        free(*records);
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * Copy a record to stdout
+ *
+ * \param[in] segs open segments
+ * \param[in] r    record
+ *
+ * \return 0 if successful, -1 if error
+ */
+static int printRecord(FILE **segs, record *r) {
+    char buf[OUTPUT_CHUNK];
+    size_t left = r->len, n;
+
+    if (segs[r->segment] == NULL ||
+        fseek(segs[r->segment], r->offset, SEEK_SET) != 0)
+        return -1;
+    while (left > 0) {
+        n = fread(buf, 1, left < sizeof(buf) ? left : sizeof(buf),
+                  segs[r->segment]);
+        if (n == 0)
+            return -1;
+        fwrite(buf, 1, n, stdout);
+        left -= n;
+    }
+    return 0;
+}
+
+/**
+ * Main function
+ *
+ * \return 0 if successful
+ */
+int main(int argc, char *argv[]) {
+    struct arguments arguments;
+    record *records;
+    FILE **segs;
+    char fname[2 * FNAME_SIZE];
+    long n, i, last, printed = 0;
+    int nSegs, stream = OUTPUT_STDOUT, k, err = 0;
+
+    arguments.out_dir = NULL;
+    arguments.task = -1;
+    arguments.stream = NULL;
+    arguments.headers = 0;
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if (arguments.stream != NULL) {
+        if (strcmp(arguments.stream, "all") == 0) {
+            stream = -1;
+        } else if ((stream = outputStream(arguments.stream)) < 0) {
+            fprintf(stderr, "%-20s - Wrong stream %s\n", "[ERROR]",
+                    arguments.stream);
+            return E_ARGS;
+        }
+    }
+
+    if ((n = readIndexes(arguments.out_dir, &records, &nSegs)) < 0) {
+        fprintf(stderr, "%-20s - No output archive in %s\n", "[ERROR]",
+                arguments.out_dir);
+        return E_OUTDIR;
+    }
+    qsort(records, n, sizeof(record), cmpRecords);
+    segs = (FILE **)calloc(nSegs, sizeof(FILE *));
+    for (k = 0; k < nSegs; k++) {
+        snprintf(fname, sizeof(fname), ARCHIVE_SEG, arguments.out_dir, k);
+        segs[k] = fopen(fname, "r");
+    }
+
+    for (i = 0; i < n; i++) {
+        record *r = &records[i];
+        if ((arguments.task >= 0 && r->task != arguments.task) ||
+            (stream >= 0 && r->stream != stream))
+            continue;
+        // only the streams of the last run of each task
+        for (last = i; last + 1 < n && records[last + 1].task == r->task;
+             last++)
+            ;
+        if (r->execution != records[last].execution ||
+            r->tries != records[last].tries)
+            continue;
+        if (arguments.headers)
+            printf("==> task %d %s (%zu bytes) <==\n", r->task,
+                   outputStreamName(r->stream), r->len);
+        if (printRecord(segs, r) != 0) {
+            fprintf(stderr, "%-20s - Cannot read the output of task %d\n",
+                    "[ERROR]", r->task);
+            err = E_IO;
+        }
+        if (arguments.headers)
+            printf("\n");
+        printed++;
+    }
+    if (printed == 0 && arguments.task >= 0) {
+        fprintf(stderr, "%-20s - No output of task %d in the archive\n",
+                "[ERROR]", arguments.task);
+        err = E_ARGS;
+    }
+
+    for (k = 0; k < nSegs; k++)
+        if (segs[k] != NULL)
+            fclose(segs[k]);
+    free(segs);
+    free(records);
+    return err;
+}
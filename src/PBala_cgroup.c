@@ -0,0 +1,291 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PBala_cgroup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Controllers that can be enabled for the tasks */
+static const char *controllerNames[] = {"memory", "cpu", "io"};
+static const int controllerBits[] = {CG_MEMORY, CG_CPU, CG_IO};
+
+/* Write a value to a cgroup file */
+static int cgWrite(char *dir, const char *file, const char *value) {
+    char fname[BUFFER_SIZE];
+    int fd, n;
+
+    if (snprintf(fname, BUFFER_SIZE, "%s/%s", dir, file) >= BUFFER_SIZE ||
+        (fd = open(fname, O_WRONLY)) < 0)
+        return -1;
+    n = write(fd, value, strlen(value));
+    close(fd);
+    return n == (int)strlen(value) ? 0 : -1;
+}
+
+/* Read a cgroup file into buf */
+static int cgRead(char *dir, const char *file, char *buf, int size) {
+    char fname[BUFFER_SIZE];
+    int fd, n;
+
+    if (snprintf(fname, BUFFER_SIZE, "%s/%s", dir, file) >= BUFFER_SIZE ||
+        (fd = open(fname, O_RDONLY)) < 0)
+        return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+/* Value of a "key value" line of a cgroup file, -1 if not found */
+static long long cgKey(char *buf, const char *key) {
+    char *p = buf;
+    size_t len = strlen(key);
+
+    while (p != NULL && *p != '\0') {
+        if (strncmp(p, key, len) == 0 && p[len] == ' ')
+            return atoll(p + len + 1);
+        if ((p = strchr(p, '\n')) != NULL)
+            p++;
+    }
+    return -1;
+}
+
+/* Mount point of cgroup v2 (also found in hybrid hierarchies) */
+static void cgMount(char *mnt) {
+    FILE *f;
+    char dev[FNAME_SIZE], dir[FNAME_SIZE], type[32];
+
+    strcpy(mnt, CGROUP_ROOT);
+    if ((f = fopen("/proc/self/mounts", "r")) == NULL)
+        return;
+    while (fscanf(f, "%149s %149s %31s %*[^\n]", dev, dir, type) == 3) {
+        if (strcmp(type, "cgroup2") == 0) {
+            strcpy(mnt, dir);
+            break;
+        }
+    }
+    fclose(f);
+}
+
+int cgroupInit(cgroup_ptr cg) {
+    FILE *f;
+    char line[BUFFER_SIZE], buf[BUFFER_SIZE], ctl[16];
+    char mnt[FNAME_SIZE];
+    char *path = NULL;
+    int i;
+
+    // cgroup v2 processes have a single "0::/path" line
+    if ((f = fopen("/proc/self/cgroup", "r")) == NULL)
+        return -1;
+    while (fgets(line, BUFFER_SIZE, f) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            path = line + 3;
+            break;
+        }
+    }
+    fclose(f);
+    if (path == NULL)
+        return -1;
+    cgMount(mnt);
+    if (snprintf(cg->parent, BUFFER_SIZE, "%s%s", mnt,
+                 strcmp(path, "/") == 0 ? "" : path) >= BUFFER_SIZE ||
+        snprintf(cg->root, BUFFER_SIZE, "%s/pbala-%d", cg->parent,
+                 (int)getpid()) >= BUFFER_SIZE - 16)
+        return -1;
+    cg->task[0] = '\0';
+    cg->controllers = 0;
+
+    // processes can only live in the leaves, so the slave gets its own
+    if (mkdir(cg->root, 0755) != 0 && errno != EEXIST)
+        return -1;
+    if (snprintf(buf, BUFFER_SIZE, "%s/slave", cg->root) >= BUFFER_SIZE ||
+        (mkdir(buf, 0755) != 0 && errno != EEXIST) ||
+        cgWrite(buf, "cgroup.procs", "0") != 0) {
+        rmdir(buf);
+        rmdir(cg->root);
+        return -1;
+    }
+
+    // enable what the parent can give (fails if it still has processes)
+    for (i = 0; i < 3; i++) {
+        snprintf(ctl, 16, "+%s", controllerNames[i]);
+        cgWrite(cg->parent, "cgroup.subtree_control", ctl);
+    }
+    if (cgRead(cg->root, "cgroup.controllers", buf, BUFFER_SIZE) != 0)
+        return 0;
+    for (i = 0; i < 3; i++) {
+        snprintf(ctl, 16, "+%s", controllerNames[i]);
+        if (strstr(buf, controllerNames[i]) != NULL &&
+            cgWrite(cg->root, "cgroup.subtree_control", ctl) == 0)
+            cg->controllers |= controllerBits[i];
+    }
+    return 0;
+}
+
+int cgroupCreate(cgroup_ptr cg, int taskNumber, long max_mem, int cores) {
+    char value[64];
+
+    if (snprintf(cg->task, BUFFER_SIZE, "%s/task%d", cg->root, taskNumber) >=
+            BUFFER_SIZE ||
+        snprintf(cg->procs, BUFFER_SIZE, "%s/cgroup.procs", cg->task) >=
+            BUFFER_SIZE ||
+        (mkdir(cg->task, 0755) != 0 && errno != EEXIST)) {
+        cg->task[0] = '\0';
+        return -1;
+    }
+    if ((cg->controllers & CG_MEMORY) && max_mem > 0) {
+        snprintf(value, 64, "%ld", max_mem * 1024);
+        if (cgWrite(cg->task, "memory.max", value) != 0)
+            return -1;
+        // no swapping past the limit, and an OOM kill takes the whole task
+        cgWrite(cg->task, "memory.swap.max", "0");
+        cgWrite(cg->task, "memory.oom.group", "1");
+    }
+    if ((cg->controllers & CG_CPU) && cores > 0) {
+        snprintf(value, 64, "%ld %d", (long)cores * CGROUP_PERIOD,
+                 CGROUP_PERIOD);
+        if (cgWrite(cg->task, "cpu.max", value) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int cgroupJoin(cgroup_ptr cg) {
+    int fd, n;
+
+    if ((fd = open(cg->procs, O_WRONLY)) < 0)
+        return -1;
+    n = write(fd, "0", 1);
+    close(fd);
+    return n == 1 ? 0 : -1;
+}
+
+/* Kill every process of a cgroup and wait until it is empty (up to 1s) */
+static void cgKill(char *dir) {
+    char buf[BUFFER_SIZE];
+    char *p;
+    struct timespec ts = {0, 10000000};
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        if (cgRead(dir, "cgroup.events", buf, BUFFER_SIZE) != 0 ||
+            cgKey(buf, "populated") == 0)
+            return;
+        // cgroup.kill appeared in Linux 5.14
+        if (cgWrite(dir, "cgroup.kill", "1") != 0 &&
+            cgRead(dir, "cgroup.procs", buf, BUFFER_SIZE) == 0) {
+            for (p = buf; *p != '\0'; p = strchr(p, '\n') + 1) {
+                kill(atoi(p), SIGKILL);
+                if (strchr(p, '\n') == NULL)
+                    break;
+            }
+        }
+        nanosleep(&ts, NULL);
+    }
+}
+
+int cgroupFinish(cgroup_ptr cg, cgroup_usage *u) {
+    char buf[BUFFER_SIZE];
+    char *p;
+    int ret = 0;
+
+    u->peak = -1;
+    u->user_usec = u->system_usec = 0;
+    u->rbytes = u->wbytes = -1;
+    u->oom_kills = -1;
+    if (cg->task[0] == '\0')
+        return -1;
+
+    // leftovers (daemons, orphaned workers) die with the task
+    cgKill(cg->task);
+
+    if (cgRead(cg->task, "cpu.stat", buf, BUFFER_SIZE) == 0) {
+        u->user_usec = cgKey(buf, "user_usec");
+        u->system_usec = cgKey(buf, "system_usec");
+    } else {
+        ret = -1;
+    }
+    if (cgRead(cg->task, "memory.peak", buf, BUFFER_SIZE) == 0)
+        u->peak = atol(buf) / 1024;
+    if (cgRead(cg->task, "memory.events", buf, BUFFER_SIZE) == 0)
+        u->oom_kills = cgKey(buf, "oom_kill");
+    // one "MAJ:MIN rbytes=N wbytes=N ..." line per device
+    if (cgRead(cg->task, "io.stat", buf, BUFFER_SIZE) == 0) {
+        u->rbytes = u->wbytes = 0;
+        for (p = strstr(buf, "rbytes="); p != NULL;
+             p = strstr(p + 1, "rbytes="))
+            u->rbytes += atoll(p + 7);
+        for (p = strstr(buf, "wbytes="); p != NULL;
+             p = strstr(p + 1, "wbytes="))
+            u->wbytes += atoll(p + 7);
+    }
+
+    rmdir(cg->task);
+    cg->task[0] = '\0';
+    return ret;
+}
+
+void cgroupUsage(cgroup_usage *u, struct rusage *usage) {
+    usage->ru_utime.tv_sec = u->user_usec / 1000000;
+    usage->ru_utime.tv_usec = u->user_usec % 1000000;
+    usage->ru_stime.tv_sec = u->system_usec / 1000000;
+    usage->ru_stime.tv_usec = u->system_usec % 1000000;
+    if (u->peak >= 0)
+        usage->ru_maxrss = u->peak;
+}
+
+int cgroupPrint(cgroup_usage *u, int taskNumber, char *out_dir) {
+    FILE *memlog;
+    char memlogfilename[FNAME_SIZE];
+
+    sprintf(memlogfilename, "%s/task%d_mem.txt", out_dir, taskNumber);
+    if ((memlog = fopen(memlogfilename, "a")) == NULL)
+        return -1;
+    cgroupReport(memlog, u);
+    fclose(memlog);
+    return 0;
+}
+
+void cgroupReport(FILE *memlog, cgroup_usage *u) {
+    fprintf(memlog, "CGROUP (WHOLE PROCESS TREE)\n");
+    fprintf(memlog, "----------------------\n");
+    fprintf(memlog, "Peak memory (KB):                 %20ld\n", u->peak);
+    fprintf(memlog, "Block bytes read:                 %20lld\n", u->rbytes);
+    fprintf(memlog, "Block bytes written:              %20lld\n", u->wbytes);
+    fprintf(memlog, "OOM kills:                        %20d\n", u->oom_kills);
+}
+
+void cgroupStop(cgroup_ptr cg) {
+    char leaf[BUFFER_SIZE];
+
+    cgWrite(cg->parent, "cgroup.procs", "0");
+    if (snprintf(leaf, BUFFER_SIZE, "%s/slave", cg->root) < BUFFER_SIZE)
+        rmdir(leaf);
+    rmdir(cg->root);
+}
@@ -0,0 +1,134 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_CGROUP_H
+#define PBALA_CGROUP_H
+/*! \file PBala_cgroup.h
+ * \brief Per-task cgroups (Linux cgroup v2) for the slaves
+ * \author Oscar Saleta Reig
+ *
+ * The slave creates a subtree `pbala-PID` under its own cgroup, moves itself
+ * to the leaf `pbala-PID/slave` and runs every task in a new leaf
+ * `pbala-PID/taskN`. Every process started by the task stays in its cgroup,
+ * so the memory, CPU and I/O counters of the cgroup are those of the whole
+ * process tree, and the memory and CPU limits of the task are enforced by the
+ * kernel. The cgroup is removed (killing any process left) when the task
+ * ends.
+ *
+ * Limits need the memory and cpu controllers to be delegated to the user.
+ * Without them the task still gets its cgroup and its CPU time, but not its
+ * peak memory or limits.
+ */
+
+#include "PBala_lib.h"
+
+#include <sys/resource.h>
+
+#define CGROUP_ROOT "/sys/fs/cgroup" ///< Default mount point of cgroup v2
+#define CGROUP_PERIOD 100000 ///< Period of cpu.max (microseconds)
+#define CG_MEMORY 1          ///< memory controller enabled
+#define CG_CPU 2             ///< cpu controller enabled
+#define CG_IO 4              ///< io controller enabled
+
+typedef struct cgroup_ {
+    char parent[BUFFER_SIZE]; ///< cgroup where the slave was started
+    char root[BUFFER_SIZE];   ///< subtree of the slave
+    char task[BUFFER_SIZE];   ///< cgroup of the current task
+    char procs[BUFFER_SIZE];  ///< its cgroup.procs file, for cgroupJoin()
+    int controllers;          ///< CG_* controllers enabled for the tasks
+} cgroup, *cgroup_ptr;
+
+typedef struct cgroup_usage_ {
+    long peak;        ///< peak memory of the task (KB, -1 if unknown)
+    long user_usec;   ///< user CPU time (microseconds)
+    long system_usec; ///< system CPU time (microseconds)
+    long long rbytes; ///< bytes read from block devices (-1 if unknown)
+    long long wbytes; ///< bytes written to block devices (-1 if unknown)
+    int oom_kills;    ///< processes killed by the OOM killer (-1 if unknown)
+} cgroup_usage;
+
+/**
+ * Create the subtree of the slave and move the slave to it
+ *
+ * @param  cg where the subtree is stored
+ * @return    0 if successful, -1 if cgroup v2 is not available or the
+ *            user cannot create cgroups
+ */
+int cgroupInit(cgroup_ptr cg);
+/**
+ * Create the cgroup of a task and set its limits
+ *
+ * @param  cg         subtree of the slave
+ * @param  taskNumber task number
+ * @param  max_mem    memory limit (KB, 0 for no limit)
+ * @param  cores      CPU limit (cores, 0 for no limit)
+ * @return            0 if successful, -1 if error
+ */
+int cgroupCreate(cgroup_ptr cg, int taskNumber, long max_mem, int cores);
+/**
+ * Move the calling process to the cgroup of the task
+ *
+ * Called by the child of the slave between fork and exec, so that only the
+ * program and the processes it starts belong to the task (the threads of the
+ * slave stay in its leaf). Only uses async-signal-safe calls.
+ *
+ * @param  cg subtree of the slave
+ * @return    0 if successful, -1 if error
+ */
+int cgroupJoin(cgroup_ptr cg);
+/**
+ * Read the counters of the task, kill what is left of it and remove its
+ * cgroup
+ *
+ * @param  cg    subtree of the slave
+ * @param  u     where the counters are stored
+ * @return       0 if successful, -1 if the counters cannot be read
+ */
+int cgroupFinish(cgroup_ptr cg, cgroup_usage *u);
+/**
+ * Replace the CPU time and peak memory of a getrusage() report with the
+ * totals of the task cgroup
+ *
+ * @param u     counters of the task cgroup
+ * @param usage report to update
+ */
+void cgroupUsage(cgroup_usage *u, struct rusage *usage);
+/**
+ * Append the counters of the task cgroup to its taskN_mem.txt file
+ *
+ * @param  u          counters of the task cgroup
+ * @param  taskNumber task number
+ * @param  out_dir    output directory
+ * @return            0 if successful, -1 if error
+ */
+int cgroupPrint(cgroup_usage *u, int taskNumber, char *out_dir);
+/**
+ * Write the counters of cgroupPrint() to an open file
+ *
+ * @param memlog file where the counters are written
+ * @param u      counters of the task cgroup
+ */
+void cgroupReport(FILE *memlog, cgroup_usage *u);
+/**
+ * Move the slave back to its original cgroup and remove its subtree
+ *
+ * @param cg subtree of the slave
+ */
+void cgroupStop(cgroup_ptr cg);
+
+#endif /* PBALA_CGROUP_H */
@@ -0,0 +1,288 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // pipe2
+
+#include "PBala_compress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+extern char **environ;
+
+static const char *methodName[] = {"none", "gzip", "zstd"};
+static const char *methodSuffix[] = {"", ".gz", ".zst"};
+static const char *streamFile[] = {NULL, "stdout", "stderr"};
+
+int compressMethod(const char *name) {
+    int m;
+    for (m = COMPRESS_NONE; m <= COMPRESS_ZSTD; m++)
+        if (strcmp(name, methodName[m]) == 0)
+            return m;
+    return -1;
+}
+
+/* Start a tool with the given stdin (if not -1) and stdout, -1 if error */
+static pid_t spawnTool(char **args, int in, int out) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    pid_t pid;
+    int err;
+
+    posix_spawn_file_actions_init(&actions);
+    if (in >= 0)
+        posix_spawn_file_actions_adddup2(&actions, in, 0);
+    posix_spawn_file_actions_adddup2(&actions, out, 1);
+    // no signals blocked or ignored by the slave
+    posix_spawnattr_init(&attr);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    err = posix_spawnp(&pid, args[0], &actions, &attr, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return err != 0 ? -1 : pid;
+}
+
+int compressStart(compressor *c, int method, int level, char *out_dir,
+                  int taskNumber, int flag_err) {
+    char fname[2 * FNAME_SIZE], lvl[16];
+    char *args[6];
+    int fds[2], file, n = 0, s;
+
+    memset(c, 0, sizeof(compressor));
+    c->method = method;
+    c->taskNumber = taskNumber;
+    for (s = 0; s < 3; s++) {
+        c->pid[s] = -1;
+        c->fd[s] = -1;
+    }
+    args[n++] = (char *)methodName[method];
+    if (method == COMPRESS_ZSTD)
+        args[n++] = "-q";
+    args[n++] = "-c";
+    if (level > 0) {
+        sprintf(lvl, "-%d", level);
+        args[n++] = lvl;
+    }
+    args[n] = NULL;
+
+    for (s = 1; s <= (flag_err ? 2 : 1); s++) {
+        snprintf(fname, sizeof(fname), "%s/task%d_%s.txt%s", out_dir,
+                 taskNumber, streamFile[s], methodSuffix[method]);
+        if ((file = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         0666)) < 0)
+            break;
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            close(file);
+            break;
+        }
+        c->pid[s] = spawnTool(args, fds[0], file);
+        close(fds[0]);
+        close(file);
+        c->fd[s] = fds[1];
+        if (c->pid[s] < 0)
+            break;
+    }
+    if (s <= (flag_err ? 2 : 1)) {
+        compressFinish(c, 0);
+        // the program writes plain files instead
+        for (; s > 0; s--) {
+            snprintf(fname, sizeof(fname), "%s/task%d_%s.txt%s", out_dir,
+                     taskNumber, streamFile[s], methodSuffix[method]);
+            unlink(fname);
+        }
+        fprintf(stderr,
+                "%-20s - Cannot start %s for task %d, its output is not "
+                "compressed\n",
+                "[WARNING]", methodName[method], taskNumber);
+        return -1;
+    }
+    return 0;
+}
+
+void compressChild(compressor *c) {
+    int s;
+    for (s = 1; s < 3; s++)
+        if (c->fd[s] >= 0)
+            dup2(c->fd[s], s); // dup2 clears close-on-exec
+}
+
+void compressStarted(compressor *c) {
+    int s;
+    for (s = 1; s < 3; s++) {
+        if (c->fd[s] >= 0)
+            close(c->fd[s]);
+        c->fd[s] = -1;
+    }
+}
+
+/* Reap the compressors that ended, and those still running if wait is 1,
+ * 1 if some are still running */
+static int reapCompressors(compressor *c, int wait, int *err) {
+    struct rusage usage;
+    pid_t pid;
+    int s, status, running = 0;
+
+    for (s = 1; s < 3; s++) {
+        if (c->pid[s] <= 0)
+            continue;
+        memset(&usage, 0, sizeof(struct rusage));
+        while ((pid = wait4(c->pid[s], &status, wait ? 0 : WNOHANG,
+                            &usage)) < 0 &&
+               errno == EINTR)
+            ;
+        if (pid == 0) {
+            running = 1;
+            continue;
+        }
+        if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            *err = -1;
+        timeradd(&c->usage.ru_utime, &usage.ru_utime, &c->usage.ru_utime);
+        timeradd(&c->usage.ru_stime, &usage.ru_stime, &c->usage.ru_stime);
+        c->pid[s] = -1;
+    }
+    return running;
+}
+
+/* Wait up to COMPRESS_WAIT_MS for the compressors, 1 if some are still
+ * running */
+static int waitCompressors(compressor *c, int *err) {
+    struct timespec nap = {0, 2000000L};
+    int waited;
+
+    for (waited = 0; reapCompressors(c, 0, err); waited += 2) {
+        if (waited >= COMPRESS_WAIT_MS)
+            return 1;
+        nanosleep(&nap, NULL);
+    }
+    return 0;
+}
+
+int compressFinish(compressor *c, pid_t pgid) {
+    int s, err = 0;
+
+    compressStarted(c);
+    if (!waitCompressors(c, &err))
+        return err;
+    // what the program left behind keeps the pipes open
+    if (pgid > 0) {
+        fprintf(stderr,
+                "%-20s - Processes left by task %d keep its output open, "
+                "killing them\n",
+                "[WARNING]", c->taskNumber);
+        kill(-pgid, SIGKILL);
+        if (!waitCompressors(c, &err))
+            return err;
+    }
+    fprintf(stderr,
+            "%-20s - The compressed output of task %d is truncated\n",
+            "[WARNING]", c->taskNumber);
+    for (s = 1; s < 3; s++)
+        if (c->pid[s] > 0)
+            kill(c->pid[s], SIGKILL);
+    reapCompressors(c, 1, &err);
+    return -1;
+}
+
+double compressCpu(compressor *c) {
+    return c->usage.ru_utime.tv_sec + c->usage.ru_utime.tv_usec / 1e6 +
+           c->usage.ru_stime.tv_sec + c->usage.ru_stime.tv_usec / 1e6;
+}
+
+int compressPrint(compressor *c, int taskNumber, char *out_dir) {
+    FILE *memlog;
+    char memlogfilename[FNAME_SIZE];
+
+    sprintf(memlogfilename, "%s/task%d_mem.txt", out_dir, taskNumber);
+    if ((memlog = fopen(memlogfilename, "a")) == NULL)
+        return -1;
+    fprintf(memlog, "COMPRESSION (%s)\n", methodName[c->method]);
+    fprintf(memlog, "----------------------\n");
+    fprintf(memlog, "User CPU time used:               %20.10g\n",
+            c->usage.ru_utime.tv_sec + c->usage.ru_utime.tv_usec / 1e6);
+    fprintf(memlog, "System CPU time used:             %20.10g\n",
+            c->usage.ru_stime.tv_sec + c->usage.ru_stime.tv_usec / 1e6);
+    fclose(memlog);
+    return 0;
+}
+
+char *compressRead(char *out_dir, int taskNumber, size_t *len) {
+    char fname[2 * FNAME_SIZE];
+    char *args[4], *data;
+    size_t size = BUFFER_SIZE;
+    ssize_t n;
+    pid_t pid = -1;
+    int fds[2], m, status;
+
+    for (m = COMPRESS_GZIP; m <= COMPRESS_ZSTD; m++) {
+        snprintf(fname, sizeof(fname), "%s/task%d_stdout.txt%s", out_dir,
+                 taskNumber, methodSuffix[m]);
+        if (access(fname, R_OK) == 0)
+            break;
+    }
+    if (m > COMPRESS_ZSTD || pipe2(fds, O_CLOEXEC) != 0)
+        return NULL;
+    args[0] = (char *)methodName[m];
+    args[1] = "-dc";
+    args[2] = fname;
+    args[3] = NULL;
+    pid = spawnTool(args, -1, fds[1]);
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return NULL;
+    }
+
+    data = (char *)malloc(size);
+    *len = 0;
+    while ((n = read(fds[0], data + *len, size - *len - 1)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        *len += n;
+        if (*len + 1 == size) {
+            size *= 2;
+            data = (char *)realloc(data, size);
+        }
+    }
+    data[*len] = '\0';
+    close(fds[0]);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (n < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
@@ -0,0 +1,135 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_COMPRESS_H
+#define PBALA_COMPRESS_H
+/*! \file PBala_compress.h
+ * \brief Compression of the output files of the tasks
+ * \author Oscar Saleta Reig
+ *
+ * With --compress-output=gzip or zstd the slave starts one compressor
+ * (`gzip -c` or `zstd -c`) for the stdout of each task, and another one for
+ * its stderr with -e. The program writes to a pipe that is the standard
+ * input of its compressor, and the compressor writes taskN_stdout.txt.gz (or
+ * .zst), so the output is compressed while the program runs and no
+ * uncompressed copy ever reaches the disk. The compressors are children of
+ * the slave, outside of the process group of the program, so killing a task
+ * still lets them write what the program printed before dying.
+ *
+ * The CPU time of the compressors is added to the memory report of the task
+ * (-g) and to a total for the slave, printed when it ends. readTaskOutput
+ * reads compressed stdout files through a decompressor, so reducers and
+ * --stop-when work the same.
+ */
+
+#include "PBala_lib.h"
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#define COMPRESS_NONE 0 ///< Plain output files
+#define COMPRESS_GZIP 1 ///< Output files compressed with gzip
+#define COMPRESS_ZSTD 2 ///< Output files compressed with zstd
+#define COMPRESS_MAX_LEVEL 19 ///< Highest level accepted (zstd)
+#define COMPRESS_WAIT_MS 1000 ///< Max wait for the compressors of a task
+
+typedef struct compressor_ {
+    int method;          ///< COMPRESS_GZIP or COMPRESS_ZSTD
+    int taskNumber;      ///< task whose output is compressed
+    pid_t pid[3];        ///< compressor of each stream (1 stdout, 2 stderr)
+    int fd[3];           ///< write end of its pipe (-1 once closed)
+    struct rusage usage; ///< usage of the compressors that ended
+} compressor;
+
+/**
+ * Compression method of a name
+ *
+ * @param  name none, gzip or zstd
+ * @return      COMPRESS_NONE, COMPRESS_GZIP or COMPRESS_ZSTD, -1 if unknown
+ */
+int compressMethod(const char *name);
+/**
+ * Start the compressors of a task
+ *
+ * @param  c          compressors to fill
+ * @param  method     COMPRESS_GZIP or COMPRESS_ZSTD
+ * @param  level      compression level (0 for the default of the method)
+ * @param  out_dir    directory of the files of the task
+ * @param  taskNumber task number
+ * @param  flag_err   1 if stderr is kept too
+ * @return            0 if successful, -1 if error (nothing is left running)
+ */
+int compressStart(compressor *c, int method, int level, char *out_dir,
+                  int taskNumber, int flag_err);
+/**
+ * Move stdout and stderr of the program to the compressors (in the child)
+ *
+ * @param c compressors
+ */
+void compressChild(compressor *c);
+/**
+ * Close the ends of the program (in the slave, once it started), so the
+ * compressors end with it
+ *
+ * @param c compressors
+ */
+void compressStarted(compressor *c);
+/**
+ * Wait for the compressors to write everything and end
+ *
+ * A compressor only ends when every process that holds its pipe closed it,
+ * and a program can leave a background process writing to it. If the
+ * compressors are still running after COMPRESS_WAIT_MS, the process group of
+ * the program is killed, and if they still do not end after another
+ * COMPRESS_WAIT_MS they are killed too and the files are truncated.
+ *
+ * @param  c    compressors
+ * @param  pgid process group of the program (0 if it did not start)
+ * @return      0 if every compressor succeeded, -1 otherwise
+ */
+int compressFinish(compressor *c, pid_t pgid);
+/**
+ * CPU time of the compressors of a task (once finished)
+ *
+ * @param  c compressors
+ * @return   user and system seconds
+ */
+double compressCpu(compressor *c);
+/**
+ * Append the CPU time of the compressors to taskN_mem.txt
+ *
+ * @param  c          compressors (finished)
+ * @param  taskNumber task number
+ * @param  out_dir    directory of the files of the task
+ * @return            0 if successful, -1 if file error
+ */
+int compressPrint(compressor *c, int taskNumber, char *out_dir);
+/**
+ * Read a whole compressed stdout file of a task into memory
+ *
+ * Tries taskN_stdout.txt.gz and taskN_stdout.txt.zst, and decompresses the
+ * first one that exists with `gzip -dc` or `zstd -dc`.
+ *
+ * @param  out_dir    directory of the files of the task
+ * @param  taskNumber task number
+ * @param  len        where the number of bytes read is stored
+ * @return            malloc'd NUL-terminated buffer, NULL if error
+ */
+char *compressRead(char *out_dir, int taskNumber, size_t *len);
+
+#endif /* PBALA_COMPRESS_H */
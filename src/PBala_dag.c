@@ -0,0 +1,321 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PBala_dag.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int cmpint(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static int cmpnode(const void *a, const void *b) {
+    return cmpint(&((const dag_node *)a)->number,
+                  &((const dag_node *)b)->number);
+}
+
+typedef struct ready_task_ {
+    task_ptr t;
+    int index; // position in the original list, keeps the sort stable
+} ready_task;
+
+static int cmpready(const void *a, const void *b) {
+    const ready_task *x = (const ready_task *)a, *y = (const ready_task *)b;
+    if (x->t->priority != y->t->priority)
+        return y->t->priority - x->t->priority;
+    return x->index - y->index;
+}
+
+/* Index of task number in the (sorted) node array, -1 if not present */
+static int dagIndex(dag_ptr graph, int number) {
+    dag_node key;
+    dag_node *node;
+    key.number = number;
+    node = bsearch(&key, graph->nodes, graph->nNodes, sizeof(dag_node),
+                   cmpnode);
+    return node == NULL ? -1 : (int)(node - graph->nodes);
+}
+
+/* Append value to a dynamic int array of size *n */
+static void pushInt(int **array, int *n, int value) {
+    *array = realloc(*array, (*n + 1) * sizeof(int));
+    (*array)[(*n)++] = value;
+}
+
+/* Parse one line of the dependency file. Returns 0 if the line was empty or
+ * a comment, 1 if it was parsed, -1 if it is malformed. */
+static int parseDepLine(char *line, int *number, int **deps, int *nDeps) {
+    char *p = line, *end;
+    long value;
+
+    while (isspace((unsigned char)*p))
+        p++;
+    if (*p == '\0' || *p == '#')
+        return 0;
+    if (strncmp(p, "task", 4) == 0 && isspace((unsigned char)p[4]))
+        p += 4;
+    value = strtol(p, &end, 10);
+    if (end == p)
+        return -1;
+    *number = (int)value;
+    p = end;
+    while (isspace((unsigned char)*p))
+        p++;
+    if (strncmp(p, "after", 5) != 0)
+        return -1;
+    p += 5;
+    *nDeps = 0;
+    *deps = NULL;
+    while (1) {
+        while (isspace((unsigned char)*p) || *p == ',')
+            p++;
+        if (*p == '\0')
+            break;
+        value = strtol(p, &end, 10);
+        if (end == p) {
+            free(*deps);
+            return -1;
+        }
+        pushInt(deps, nDeps, (int)value);
+        p = end;
+    }
+    return 1;
+}
+
+int dagLoad(char *depfile, task_ptr *currentTask, dag_ptr *graph) {
+    FILE *f;
+    char line[BUFFER_SIZE];
+    int i, j, k, n, lineno, number, nDeps, *deps;
+    int *order, head, tail, held;
+    task_ptr t;
+    ready_task *ready;
+    dag_ptr g;
+
+    f = fopen(depfile, "r");
+    if (f == NULL) {
+        fprintf(stderr, "%-20s - cannot open file %s\n", "[ERROR]", depfile);
+        return -1;
+    }
+
+    // One node per task in the list
+    g = (dag_ptr)malloc(sizeof(dag));
+    for (n = 0, t = *currentTask; t != NULL; t = t->next)
+        n++;
+    g->nNodes = n;
+    g->nodes = (dag_node *)calloc(n > 0 ? n : 1, sizeof(dag_node));
+    for (i = 0, t = *currentTask; t != NULL; t = t->next, i++)
+        g->nodes[i].number = t->number;
+    qsort(g->nodes, n, sizeof(dag_node), cmpnode);
+    for (i = 1; i < n; i++) {
+        if (g->nodes[i].number == g->nodes[i - 1].number) {
+            fprintf(stderr,
+                    "%-20s - task %d appears twice in the datafile, task "
+                    "numbers must be unique when using dependencies\n",
+                    "[ERROR]", g->nodes[i].number);
+            fclose(f);
+            dagFree(g);
+            return -1;
+        }
+    }
+
+    // Read edges
+    lineno = 0;
+    while (fgets(line, BUFFER_SIZE, f) != NULL) {
+        lineno++;
+        k = parseDepLine(line, &number, &deps, &nDeps);
+        if (k == 0)
+            continue;
+        if (k < 0) {
+            fprintf(stderr, "%-20s - cannot read line %d in file %s\n",
+                    "[ERROR]", lineno, depfile);
+            fclose(f);
+            dagFree(g);
+            return -1;
+        }
+        // tasks that are not in the datafile were completed in a previous
+        // run, so their edges are irrelevant
+        if ((i = dagIndex(g, number)) >= 0) {
+            qsort(deps, nDeps, sizeof(int), cmpint);
+            for (k = 0; k < nDeps; k++) {
+                if (k > 0 && deps[k] == deps[k - 1])
+                    continue;
+                if ((j = dagIndex(g, deps[k])) < 0)
+                    continue;
+                if (j == i) {
+                    fprintf(stderr, "%-20s - task %d depends on itself\n",
+                            "[ERROR]", number);
+                    free(deps);
+                    fclose(f);
+                    dagFree(g);
+                    return -1;
+                }
+                pushInt(&g->nodes[i].deps, &g->nodes[i].nDeps, j);
+                pushInt(&g->nodes[j].dependents, &g->nodes[j].nDependents, i);
+            }
+        }
+        free(deps);
+    }
+    fclose(f);
+
+    // Topological order (Kahn), detects cycles
+    order = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+    head = tail = 0;
+    for (i = 0; i < n; i++) {
+        g->nodes[i].pending = g->nodes[i].nDeps;
+        if (g->nodes[i].pending == 0)
+            order[tail++] = i;
+    }
+    while (head < tail) {
+        dag_node *node = &g->nodes[order[head++]];
+        for (k = 0; k < node->nDependents; k++)
+            if (--g->nodes[node->dependents[k]].pending == 0)
+                order[tail++] = node->dependents[k];
+    }
+    if (tail != n) {
+        fprintf(stderr, "%-20s - dependency cycle found in file %s\n",
+                "[ERROR]", depfile);
+        free(order);
+        dagFree(g);
+        return -1;
+    }
+    // Critical path: longest chain of dependents, computed backwards
+    for (i = n - 1; i >= 0; i--) {
+        dag_node *node = &g->nodes[order[i]];
+        node->priority = 1;
+        for (k = 0; k < node->nDependents; k++)
+            if (g->nodes[node->dependents[k]].priority + 1 > node->priority)
+                node->priority = g->nodes[node->dependents[k]].priority + 1;
+    }
+    free(order);
+
+    // Hold blocked tasks, keep ready ones (in list order) sorted by priority
+    held = 0;
+    ready = (ready_task *)malloc((n > 0 ? n : 1) * sizeof(ready_task));
+    k = 0;
+    while (*currentTask != NULL) {
+        t = *currentTask;
+        *currentTask = t->next;
+        dag_node *node = &g->nodes[dagIndex(g, t->number)];
+        node->pending = node->nDeps;
+        t->priority = node->priority;
+        t->next = NULL;
+        if (node->pending > 0) {
+            node->state = DAG_BLOCKED;
+            node->held = t;
+            held++;
+        } else {
+            node->state = DAG_READY;
+            ready[k].t = t;
+            ready[k].index = k;
+            k++;
+        }
+    }
+    qsort(ready, k, sizeof(ready_task), cmpready);
+    for (i = k - 1; i >= 0; i--) {
+        ready[i].t->next = *currentTask;
+        *currentTask = ready[i].t;
+    }
+    free(ready);
+
+    *graph = g;
+    return held;
+}
+
+int dagPriority(dag_ptr graph, int number) {
+    int i = dagIndex(graph, number);
+    return i < 0 ? 0 : graph->nodes[i].priority;
+}
+
+int dagComplete(dag_ptr graph, int number, task_ptr *currentTask) {
+    int i, k, released = 0;
+    dag_node *node, *dep;
+
+    if ((i = dagIndex(graph, number)) < 0)
+        return 0;
+    node = &graph->nodes[i];
+    node->state = DAG_DONE;
+    for (k = 0; k < node->nDependents; k++) {
+        dep = &graph->nodes[node->dependents[k]];
+        if (--dep->pending == 0 && dep->state == DAG_BLOCKED) {
+            dep->state = DAG_READY;
+            insertTask(currentTask, dep->held);
+            dep->held = NULL;
+            released++;
+        }
+    }
+    return released;
+}
+
+int dagFail(dag_ptr graph, int number, char *datafile) {
+    int i, k, n = 0, top = 0;
+    int *stack;
+    dag_node *node, *dep;
+
+    if ((i = dagIndex(graph, number)) < 0)
+        return 0;
+    graph->nodes[i].state = DAG_FAILED;
+    stack = (int *)malloc(graph->nNodes * sizeof(int));
+    stack[top++] = i;
+    while (top > 0) {
+        node = &graph->nodes[stack[--top]];
+        for (k = 0; k < node->nDependents; k++) {
+            dep = &graph->nodes[node->dependents[k]];
+            if (dep->state != DAG_BLOCKED)
+                continue;
+            dep->state = DAG_FAILED;
+            addUnfinishedTask(datafile, dep->number, dep->held->args);
+            free(dep->held);
+            dep->held = NULL;
+            stack[top++] = node->dependents[k];
+            n++;
+        }
+    }
+    free(stack);
+    return n;
+}
+
+int dagFlush(dag_ptr graph, char *datafile) {
+    int i, n = 0;
+    for (i = 0; i < graph->nNodes; i++) {
+        if (graph->nodes[i].held == NULL)
+            continue;
+        addUnfinishedTask(datafile, graph->nodes[i].number,
+                          graph->nodes[i].held->args);
+        free(graph->nodes[i].held);
+        graph->nodes[i].held = NULL;
+        graph->nodes[i].state = DAG_FAILED;
+        n++;
+    }
+    return n;
+}
+
+void dagFree(dag_ptr graph) {
+    int i;
+    if (graph == NULL)
+        return;
+    for (i = 0; i < graph->nNodes; i++) {
+        free(graph->nodes[i].deps);
+        free(graph->nodes[i].dependents);
+        free(graph->nodes[i].held);
+    }
+    free(graph->nodes);
+    free(graph);
+}
@@ -0,0 +1,114 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_DAG_H
+#define PBALA_DAG_H
+/*! \file PBala_dag.h
+ * \brief Task dependency graph and ready-queue scheduling
+ * \author Oscar Saleta Reig
+ */
+
+#include "PBala_lib.h"
+
+#define DAG_BLOCKED 0 ///< Task is waiting for its dependencies
+#define DAG_READY 1   ///< Task is in the ready queue or running
+#define DAG_DONE 2    ///< Task completed successfully
+#define DAG_FAILED 3  ///< Task (or one of its dependencies) failed
+
+typedef struct dag_node_ {
+    int number;      ///< task number
+    int state;       ///< one of DAG_BLOCKED, DAG_READY, DAG_DONE, DAG_FAILED
+    int pending;     ///< number of dependencies not yet completed
+    int priority;    ///< length of the longest chain of tasks from here
+    int nDeps;       ///< number of dependencies
+    int *deps;       ///< indices of the dependencies in the node array
+    int nDependents; ///< number of tasks that depend on this one
+    int *dependents; ///< indices of the dependents in the node array
+    task_ptr held;   ///< task kept aside until its dependencies complete
+} dag_node;
+
+typedef struct dag_ {
+    int nNodes;      ///< number of tasks in the graph
+    dag_node *nodes; ///< nodes sorted by task number
+} dag, *dag_ptr;
+
+/**
+ * Read a dependency file and build the task graph
+ *
+ * Each line of the file has the form "task 42 after 17,18" (the leading
+ * "task" word is optional). Empty lines and lines starting with '#' are
+ * ignored. Dependencies on tasks that are not in the task list are considered
+ * satisfied, so an unfinished_ datafile can be rerun with the same dependency
+ * file.
+ *
+ * Tasks with pending dependencies are removed from the task list and held in
+ * the graph. The remaining ready tasks are reordered so that tasks on the
+ * critical path come first.
+ *
+ * @param  depfile     name of the dependency file
+ * @param  currentTask pointer to the head of the task linked list
+ * @param  graph       pointer where the allocated graph is stored
+ * @return             number of held tasks, -1 if error (or cycle)
+ */
+int dagLoad(char *depfile, task_ptr *currentTask, dag_ptr *graph);
+/**
+ * Priority of a task (0 if the task is not in the graph)
+ *
+ * @param  graph  task graph
+ * @param  number task number
+ * @return        length of the longest chain of dependents of the task
+ */
+int dagPriority(dag_ptr graph, int number);
+/**
+ * Mark a task as successfully completed and release its dependents
+ *
+ * Every dependent whose dependencies are now all completed is moved from the
+ * graph into the task list, sorted by priority.
+ *
+ * @param  graph       task graph
+ * @param  number      task number
+ * @param  currentTask pointer to the head of the task linked list
+ * @return             number of tasks released
+ */
+int dagComplete(dag_ptr graph, int number, task_ptr *currentTask);
+/**
+ * Mark a task as failed and record all its (transitive) dependents in the
+ * unfinished file
+ *
+ * @param  graph    task graph
+ * @param  number   task number
+ * @param  datafile name of the input data file
+ * @return          number of dependents recorded as unfinished
+ */
+int dagFail(dag_ptr graph, int number, char *datafile);
+/**
+ * Record every task still held in the graph in the unfinished file
+ *
+ * @param  graph    task graph
+ * @param  datafile name of the input data file
+ * @return          number of tasks recorded
+ */
+int dagFlush(dag_ptr graph, char *datafile);
+/**
+ * Free the graph and any task still held in it
+ *
+ * @param graph task graph
+ */
+void dagFree(dag_ptr graph);
+
+#endif /* PBALA_DAG_H */
@@ -38,11 +38,14 @@
 #define E_MPL 21
 #define E_PVM_DUP 22
 #define E_NO_PBALA_TASK 23
+#define E_DEPFILE 24
+#define E_REDUCER 25
 
 /* ERROR CODES FOR PBala_task.c SLAVE RETURN STATUS */
 #define ST_READY 10
 #define ST_FORK_ERR 11
 #define ST_TASK_KILLED 12
 #define ST_MEM_ERR 13
+#define ST_TASK_CANCELLED 14
 
 #endif /* PBALA_ERRCODES_H */
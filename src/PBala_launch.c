@@ -0,0 +1,304 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PBala_launch.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Kinds of the parts of a word */
+#define LP_TEXT 0
+#define LP_EXE 1
+#define LP_PROGRAM 2
+#define LP_ID 3
+#define LP_ARGS 4
+#define LP_ARGV 5
+#define LP_OUTDIR 6
+#define LP_CORES 7
+
+static const char *placeholders[] = {NULL,   "exe",  "program", "id",
+                                     "args", "argv", "outdir",  "cores"};
+
+/* Built-in launchers, one per program type */
+static const launch_def builtins[] = {
+    {"maple", 0, "maple",
+     "{exe} '-tc \"taskId:={id}\"' '-c \"taskArgs:=[{args}]\"' "
+     "'-c \"kernelopts(numcpus={cores})\"' {program}"},
+    {"c", 1, "./{program}", "{exe} {id} {argv}"},
+    {"python", 2, "python", "{exe} {program} {id} {argv}"},
+    {"pari", 3, "gp", "{exe} -f -s400G /dev/stdin"},
+    {"sage", 4, "sage",
+     "{exe} -c 'taskId={id}; taskArgs=[{args}]; load(\"{program}\")'"},
+    {"octave", 5, "octave", "{exe} -qf /dev/stdin"},
+    {"plugin", 6, "", ""}};
+#define N_BUILTINS (int)(sizeof(builtins) / sizeof(launch_def))
+
+/* Look for a launcher in a launchers file, 1 if found, -1 if error */
+static int launchFromFile(char *fname, char *name, launch_def *def) {
+    FILE *f;
+    char line[BUFFER_SIZE];
+    char lname[LAUNCH_NAME_SIZE], exe[FNAME_SIZE];
+    int n, len, lineno = 0, found = 0;
+
+    if ((f = fopen(fname, "r")) == NULL) {
+        fprintf(stderr, "%-20s - Cannot open launchers file %s\n", "[ERROR]",
+                fname);
+        return -1;
+    }
+    while (fgets(line, BUFFER_SIZE, f) != NULL) {
+        lineno++;
+        len = strlen(line);
+        while (len > 0 && isspace((unsigned char)line[len - 1]))
+            line[--len] = '\0';
+        if (sscanf(line, " %31s", lname) != 1 || lname[0] == '#')
+            continue;
+        if (sscanf(line, " %31s %149s %n", lname, exe, &n) != 2 ||
+            line[n] == '\0') {
+            fprintf(stderr,
+                    "%-20s - Wrong line %d in launchers file %s (must be "
+                    "\"name exe template\")\n",
+                    "[ERROR]", lineno, fname);
+            fclose(f);
+            return -1;
+        }
+        // the last definition wins
+        if (strcmp(lname, name) == 0) {
+            strcpy(def->exe, exe);
+            strcpy(def->tmpl, line + n);
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+int launchFind(char *flag, char *fname, launch_def *def) {
+    int i, type, n, found;
+
+    memset(def, 0, sizeof(launch_def));
+    def->task_type = -1;
+    if (sscanf(flag, "%d%n", &type, &n) == 1 && flag[n] == '\0') {
+        for (i = 0; i < N_BUILTINS; i++)
+            if (builtins[i].task_type == type)
+                *def = builtins[i];
+        if (def->task_type < 0)
+            return -1;
+    } else {
+        for (i = 0; i < N_BUILTINS; i++)
+            if (strcmp(builtins[i].name, flag) == 0)
+                *def = builtins[i];
+        if (def->task_type < 0) {
+            snprintf(def->name, LAUNCH_NAME_SIZE, "%s", flag);
+            def->task_type = LAUNCH_CUSTOM;
+        }
+    }
+    found = def->task_type != LAUNCH_CUSTOM;
+    if (fname != NULL) {
+        if ((i = launchFromFile(fname, def->name, def)) < 0)
+            return -1;
+        found = found || i;
+    }
+    return found ? 0 : -1;
+}
+
+/* Split a word into literal text and placeholders */
+static int compileWord(char *text, launch_word *w) {
+    char *p = text, *open, *close;
+    int k, len;
+
+    w->nParts = 0;
+    w->parts = (launch_part *)malloc((strlen(text) + 1) * sizeof(launch_part));
+    while (*p != '\0') {
+        open = strchr(p, '{');
+        close = open != NULL ? strchr(open, '}') : NULL;
+        // literal text up to the next placeholder
+        len = close != NULL ? open - p : (int)strlen(p);
+        if (len > 0) {
+            w->parts[w->nParts].kind = LP_TEXT;
+            w->parts[w->nParts++].text = strndup(p, len);
+        }
+        if (close == NULL)
+            break;
+        for (k = LP_EXE; k <= LP_CORES; k++)
+            if ((int)strlen(placeholders[k]) == close - open - 1 &&
+                strncmp(open + 1, placeholders[k], close - open - 1) == 0)
+                break;
+        if (k > LP_CORES) {
+            fprintf(stderr, "%-20s - Unknown placeholder %.*s in launcher\n",
+                    "[ERROR]", (int)(close - open + 1), open);
+            return -1;
+        }
+        w->parts[w->nParts].kind = k;
+        w->parts[w->nParts++].text = NULL;
+        p = close + 1;
+    }
+    for (k = 0; k < w->nParts; k++) {
+        if (w->parts[k].kind == LP_ARGV && w->nParts > 1) {
+            fprintf(stderr, "%-20s - {argv} must be a whole word in launcher\n",
+                    "[ERROR]");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int launchCompile(char *exe, char *tmpl, launch_tpl *t) {
+    char word[BUFFER_SIZE];
+    char *p = tmpl;
+    int k, len;
+
+    t->nWords = 0;
+    t->words = (launch_word *)malloc((strlen(tmpl) / 2 + 1) *
+                                     sizeof(launch_word));
+    if (compileWord(exe, &t->exe) != 0)
+        return -1;
+    for (k = 0; k < t->exe.nParts; k++) {
+        if (t->exe.parts[k].kind == LP_EXE || t->exe.parts[k].kind == LP_ARGV) {
+            fprintf(stderr, "%-20s - Wrong default executable %s in launcher\n",
+                    "[ERROR]", exe);
+            return -1;
+        }
+    }
+    while (1) {
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0')
+            break;
+        if (*p == '\'') {
+            char *end = strchr(p + 1, '\'');
+            if (end == NULL) {
+                fprintf(stderr, "%-20s - Unbalanced quote in launcher %s\n",
+                        "[ERROR]", tmpl);
+                return -1;
+            }
+            len = end - p - 1;
+            memcpy(word, p + 1, len);
+            p = end + 1;
+        } else {
+            for (len = 0; p[len] != '\0' && !isspace((unsigned char)p[len]);
+                 len++)
+                word[len] = p[len];
+            p += len;
+        }
+        word[len] = '\0';
+        if (compileWord(word, &t->words[t->nWords++]) != 0)
+            return -1;
+    }
+    if (t->nWords == 0) {
+        fprintf(stderr, "%-20s - Empty launcher\n", "[ERROR]");
+        return -1;
+    }
+    return 0;
+}
+
+/* Substitute the placeholders of a word into buf (of the given size) */
+static void expandWord(launch_word *w, launch_tpl *t, char *buf, int size,
+                       char *id, char *program, char *arguments, char *outdir,
+                       char *customPath, char *cores) {
+    int k, len = 0;
+    char *s;
+    buf[0] = '\0';
+    for (k = 0; k < w->nParts && len < size - 1; k++) {
+        switch (w->parts[k].kind) {
+        case LP_EXE:
+            if (customPath != NULL) {
+                s = customPath;
+            } else {
+                expandWord(&t->exe, t, buf + len, size - len, id, program,
+                           arguments, outdir, NULL, cores);
+                len += strlen(buf + len);
+                continue;
+            }
+            break;
+        case LP_PROGRAM:
+            s = program;
+            // ./{program} runs an absolute path (a cached copy) as it is
+            if (program[0] == '/' && len >= 2 &&
+                strcmp(buf + len - 2, "./") == 0)
+                len -= 2;
+            break;
+        case LP_ID:
+            s = id;
+            break;
+        case LP_ARGS:
+            s = arguments;
+            break;
+        case LP_OUTDIR:
+            s = outdir;
+            break;
+        case LP_CORES:
+            s = cores;
+            break;
+        default:
+            s = w->parts[k].text;
+        }
+        snprintf(buf + len, size - len, "%s", s);
+        len += strlen(buf + len);
+    }
+}
+
+char **launchArgv(launch_tpl *t, int taskNumber, char *program,
+                  char *arguments, char *outdir, char *customPath,
+                  int cores) {
+    char **args;
+    char buf[BUFFER_SIZE], id[16], ncores[16];
+    char *copy, *token, *save;
+    int i, n = 0, max = t->nWords + 1;
+
+    // every comma can start one more argument in each {argv}
+    for (token = arguments; *token; token++)
+        if (*token == ',')
+            max += t->nWords;
+    max += t->nWords;
+    args = (char **)malloc(max * sizeof(char *));
+    sprintf(id, "%d", taskNumber);
+    sprintf(ncores, "%d", cores);
+
+    for (i = 0; i < t->nWords; i++) {
+        if (t->words[i].nParts == 1 && t->words[i].parts[0].kind == LP_ARGV) {
+            copy = strdup(arguments);
+            for (token = strtok_r(copy, ",", &save); token != NULL;
+                 token = strtok_r(NULL, ",", &save))
+                args[n++] = strdup(token);
+            free(copy);
+            continue;
+        }
+        expandWord(&t->words[i], t, buf, BUFFER_SIZE, id, program, arguments,
+                   outdir, customPath, ncores);
+        args[n++] = strdup(buf);
+    }
+    args[n] = NULL;
+    return args;
+}
+
+static void freeWord(launch_word *w) {
+    int k;
+    for (k = 0; k < w->nParts; k++)
+        free(w->parts[k].text);
+    free(w->parts);
+}
+
+void launchFree(launch_tpl *t) {
+    int i;
+    freeWord(&t->exe);
+    for (i = 0; i < t->nWords; i++)
+        freeWord(&t->words[i]);
+    free(t->words);
+}
@@ -0,0 +1,115 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_LAUNCH_H
+#define PBALA_LAUNCH_H
+/*! \file PBala_launch.h
+ * \brief Registry of launchers, the command lines that run each program type
+ * \author Oscar Saleta Reig
+ *
+ * A launcher has a name, a default executable and a command line template,
+ * where these placeholders are replaced for every task:
+ *
+ * - `{exe}`: the custom path given with -c, or the default executable
+ * - `{program}`: the program file (a `./` right before it is dropped if
+ *   the path is absolute, as for the copies of --cache)
+ * - `{id}`: the task number
+ * - `{args}`: the task arguments as in the datafile ("arg1,arg2,...")
+ * - `{argv}`: one command line argument per task argument (only as a whole
+ *   word)
+ * - `{outdir}`: the directory of the output files of the task (a shard of
+ *   the output directory with --shard-output)
+ * - `{cores}`: the cores of each task (--task-cores, or the CPUs of the slave)
+ *
+ * Words are separated by blanks, and a word between single quotes can
+ * contain blanks. The master finds the launcher of the execution (built in
+ * or from a --launchers file) and sends it to the slaves, which compile it
+ * once so that starting a task is only a substitution.
+ */
+
+#include "PBala_lib.h"
+
+#define LAUNCH_NAME_SIZE 32 ///< Max length of a launcher name
+#define LAUNCH_CUSTOM 7     ///< Program type of launchers from a file
+
+typedef struct launch_def_ {
+    char name[LAUNCH_NAME_SIZE]; ///< name (can be used as programflag)
+    int task_type;               ///< program type
+    char exe[FNAME_SIZE];        ///< default executable
+    char tmpl[BUFFER_SIZE];      ///< command line template
+} launch_def;
+
+typedef struct launch_part_ {
+    int kind;   ///< LP_TEXT or one of the placeholders
+    char *text; ///< literal text (LP_TEXT)
+} launch_part;
+
+typedef struct launch_word_ {
+    int nParts;         ///< number of parts
+    launch_part *parts; ///< literal text and placeholders
+} launch_word;
+
+typedef struct launch_tpl_ {
+    launch_word exe;    ///< default executable
+    int nWords;         ///< words of the command line
+    launch_word *words; ///< command line
+} launch_tpl;
+
+/**
+ * Find the launcher of a programflag
+ *
+ * @param  flag  program type number or launcher name
+ * @param  fname launchers file (NULL for built-in launchers only), whose
+ *               lines "name exe template" add launchers or replace built-in
+ *               ones
+ * @param  def   where the launcher is stored
+ * @return       0 if found, -1 if unknown or the file cannot be read
+ */
+int launchFind(char *flag, char *fname, launch_def *def);
+/**
+ * Compile a launcher template
+ *
+ * @param  exe  default executable
+ * @param  tmpl command line template
+ * @param  t    compiled template
+ * @return      0 if successful, -1 if the template is wrong
+ */
+int launchCompile(char *exe, char *tmpl, launch_tpl *t);
+/**
+ * Build the command line of a task
+ *
+ * @param  t          compiled template
+ * @param  taskNumber task number
+ * @param  program    program file
+ * @param  arguments  task arguments
+ * @param  outdir     directory of the output files of the task
+ * @param  customPath custom executable (NULL for the default)
+ * @param  cores      cores of the task
+ * @return            NULL-terminated array of arguments (free with freeArgv)
+ */
+char **launchArgv(launch_tpl *t, int taskNumber, char *program,
+                  char *arguments, char *outdir, char *customPath,
+                  int cores);
+/**
+ * Free a compiled template
+ *
+ * @param t compiled template
+ */
+void launchFree(launch_tpl *t);
+
+#endif /* PBALA_LAUNCH_H */
@@ -17,25 +17,22 @@
  */
 
 #include "PBala_lib.h"
+#include "PBala_compress.h"
 #include "PBala_errcodes.h"
 
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <pvm3.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-int mapleSingleCPU(char *fname) {
-    char aux_str[BUFFER_SIZE];
-    sprintf(aux_str,
-            "grep -q -F 'kernelopts(numcpus=1)' %s || (sed "
-            "'1ikernelopts(numcpus=1);' %s > %s_tmp && mv %s "
-            "%s.bak && mv %s_tmp %s)",
-            fname, fname, fname, fname, fname, fname, fname);
-    if (system(aux_str) == -1)
-        return -1;
-    return 0;
-}
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 int getLineCount(char *fileName) {
     FILE *f_aux;
@@ -86,7 +83,7 @@ int parseNodeFile(char *nodefile, char ***nodes, int **nodeCores) {
     return nNodes;
 }
 
-int memcheck(int flag, long int max_task_size) {
+int memcheck(int flag, long int max_task_size, long int reserved) {
     FILE *f;
     char buffer[1024];
     char *token;
@@ -109,6 +106,7 @@ int memcheck(int flag, long int max_task_size) {
     if (sscanf(token, "%ld", &freemem) != 1)
         return -1;
     fclose(f);
+    freemem -= reserved;
     if (flag == 0) {
         if (freemem < 0.15 * maxmem)
             return 1;
@@ -147,7 +145,15 @@ int prtusage(int pid, int taskNumber, char *out_dir, struct rusage usage) {
     char memlogfilename[FNAME_SIZE];
 
     sprintf(memlogfilename, "%s/task%d_mem.txt", out_dir, taskNumber);
-    memlog = fopen(memlogfilename, "w");
+    if ((memlog = fopen(memlogfilename, "w")) == NULL)
+        return -1;
+    fprtusage(memlog, pid, taskNumber, usage);
+    fclose(memlog);
+
+    return 0;
+}
+
+void fprtusage(FILE *memlog, int pid, int taskNumber, struct rusage usage) {
     fprintf(memlog, "TASK %d RESOURCE USAGE (PID %d)\n", taskNumber, pid);
     fprintf(memlog, "----------------------\n");
     fprintf(memlog, "User CPU time used:               %20.10g\n",
@@ -182,77 +188,351 @@ int prtusage(int pid, int taskNumber, char *out_dir, struct rusage usage) {
             usage.ru_nvcsw);
     fprintf(memlog, "Involuntary context switches:     %20ld\n",
             usage.ru_nivcsw);
-    fclose(memlog);
+}
+
+int taskDir(char *dir, char *out_dir, int taskNumber, int shard, int create) {
+    int n;
 
+    if (!shard) {
+        snprintf(dir, FNAME_SIZE, "%s", out_dir);
+        return 0;
+    }
+    n = snprintf(dir, FNAME_SIZE, "%s/%02d", out_dir, taskNumber % 100);
+    if (create && mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+    snprintf(dir + n, FNAME_SIZE - n, "/%02d", taskNumber / 100 % 100);
+    if (create && mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return -1;
     return 0;
 }
 
-int parifile(int taskId, char *args, char *programfile, char *directory) {
-    FILE *f;
-    char aux[FNAME_SIZE];
+int taskScript(int task_type, int taskId, char *args, char *programfile,
+               int *fd) {
+    char script[2 * BUFFER_SIZE];
+    int fds[2], len;
+
+    *fd = -1;
+    if (task_type == 3)
+        len = snprintf(script, sizeof(script),
+                       "taskId=%d;\ntaskArgs=[%s];\n\\r %s\n\\q\n", taskId,
+                       args, programfile);
+    else if (task_type == 5)
+        len = snprintf(script, sizeof(script),
+                       "taskId = %d;\ntaskArgs = {%s};\nsource (\"%s\");\n",
+                       taskId, args, programfile);
+    else
+        return 0;
+    // the script is much smaller than a pipe, so it is written at once
+    if (len >= (int)sizeof(script) || pipe(fds) != 0)
+        return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    if (write(fds[1], script, len) != len) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    close(fds[1]);
+    *fd = fds[0];
+    return 0;
+}
 
-    sprintf(aux, "%s/auxprog-%d.gp", directory, taskId);
-    f = fopen(aux, "w");
-    if (f == NULL)
+int prterror(int pid, int taskNumber, char *out_dir, double time) {
+    FILE *memlog;
+    char memlogfname[FNAME_SIZE];
+
+    sprintf(memlogfname, "%s/task%d_killed.log", out_dir, taskNumber);
+    memlog = fopen(memlogfname, "w");
+    if (memlog == NULL)
         return -1;
-    fprintf(f, "taskId=%d;\n", taskId);
-    fprintf(f, "taskArgs=[%s];\n", args);
-    fprintf(f, "\\r %s\n", programfile);
-    fprintf(f, "\\q\n");
+    fprterror(memlog, pid, taskNumber, time);
 
-    fclose(f);
+    fclose(memlog);
     return 0;
 }
 
-int sagefile(int taskId, char *args, char *programfile, char *directory) {
+void fprterror(FILE *memlog, int pid, int taskNumber, double time) {
+    fprintf(memlog, "TASK %d (PID %d) ERROR REPORT\n", taskNumber, pid);
+    fprintf(memlog, "----------------------\n");
+    fprintf(memlog, "Task was killed or stopped after %10.5G seconds.\n", time);
+}
+
+char *readTaskOutput(char *out_dir, int taskNumber, size_t *len) {
     FILE *f;
-    char aux[FNAME_SIZE];
+    char fname[FNAME_SIZE];
+    char *data;
+    long size;
+
+    sprintf(fname, "%s/task%d_stdout.txt", out_dir, taskNumber);
+    if ((f = fopen(fname, "r")) == NULL)
+        return compressRead(out_dir, taskNumber, len);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = (char *)malloc(size + 1);
+    *len = fread(data, 1, size, f);
+    data[*len] = '\0';
+    fclose(f);
+    return data;
+}
 
-    sprintf(aux, "%s/auxprog-%d.sage", directory, taskId);
-    f = fopen(aux, "w");
-    if (f == NULL)
-        return -1;
-    fprintf(f, "taskId=%d;\n", taskId);
-    fprintf(f, "taskArgs=[%s];\n", args);
-    fprintf(f, "load('%s')\n", programfile);
+int waitChild(pid_t pid, siginfo_t *infop, struct rusage *usage, int master,
+              int taskNumber, void (*serve)(void *), void *arg) {
+    sigset_t sigchld;
+    struct timespec timeout;
+    int killed = 0, victim;
+
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    timeout.tv_sec = WAIT_POLL_MS / 1000;
+    timeout.tv_nsec = (WAIT_POLL_MS % 1000) * 1000000L;
+    while (1) {
+        infop->si_pid = 0;
+        // look first, then reap with wait4 to get the usage of this child
+        // alone (RUSAGE_CHILDREN adds up every child of the slave)
+        if (waitid(P_PID, pid, infop, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+            infop->si_pid == pid) {
+            int status;
+            memset(usage, 0, sizeof(struct rusage));
+            wait4(pid, &status, 0, usage);
+            return killed;
+        }
+        // only kill requests for this task count, older ones are stale
+        while (pvm_nrecv(master, MSG_KILL) > 0) {
+            pvm_upkint(&victim, 1, 1);
+            if ((victim == taskNumber || victim < 0) && !killed) {
+                kill(-pid, SIGKILL);
+                killed = 1;
+            }
+        }
+        if (serve != NULL)
+            serve(arg);
+        sigtimedwait(&sigchld, NULL, &timeout);
+    }
+}
 
-    fclose(f);
+int parseDeadline(char *str, double *deadline) {
+    int h, m, s, n;
+    struct tm tm;
+    time_t now = time(NULL), at;
+
+    if (str[0] == '@') {
+        if (sscanf(str + 1, "%d:%d%n", &h, &m, &n) != 2 || str[1 + n] != '\0' ||
+            h < 0 || h > 23 || m < 0 || m > 59)
+            return -1;
+        localtime_r(&now, &tm);
+        tm.tm_hour = h;
+        tm.tm_min = m;
+        tm.tm_sec = 0;
+        at = mktime(&tm);
+        if (at <= now) {
+            tm.tm_mday++;
+            at = mktime(&tm);
+        }
+        *deadline = (double)at;
+        return 0;
+    }
+    if (sscanf(str, "%d:%d:%d%n", &h, &m, &s, &n) == 3 && str[n] == '\0') {
+        s += 3600 * h + 60 * m;
+    } else if (sscanf(str, "%d:%d%n", &m, &s, &n) == 2 && str[n] == '\0') {
+        s += 60 * m;
+    } else if (sscanf(str, "%d%n", &s, &n) != 1 || str[n] != '\0') {
+        return -1;
+    }
+    if (s <= 0)
+        return -1;
+    *deadline = (double)now + s;
     return 0;
 }
 
-int octavefile(int taskId, char *args, char *programfile, char *directory) {
+static int cmpestimate(const void *a, const void *b) {
+    int x = ((const estimate *)a)->number, y = ((const estimate *)b)->number;
+    return (x > y) - (x < y);
+}
+
+int loadEstimates(char *fname, estimate **estimates) {
     FILE *f;
-    char aux[FNAME_SIZE];
+    char line[BUFFER_SIZE];
+    int n = 0, cap = 0, lineno = 0;
+    estimate e;
 
-    sprintf(aux, "%s/auxprog-%d.m", directory, taskId);
-    f = fopen(aux, "w");
-    if (f == NULL)
+    if ((f = fopen(fname, "r")) == NULL) {
+        fprintf(stderr, "%-20s - cannot open file %s\n", "[ERROR]", fname);
         return -1;
-    fprintf(f, "#! /usr/bin/octave -qf\n");
-    fprintf(f, "taskId = %d;\n", taskId);
-    fprintf(f, "taskArgs = {%s};\n", args);
-    fprintf(f, "source (\"%s\");\n", programfile);
-
+    }
+    *estimates = NULL;
+    while (fgets(line, BUFFER_SIZE, f) != NULL) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%d,%lf", &e.number, &e.seconds) != 2) {
+            fprintf(stderr, "%-20s - cannot read line %d in file %s\n",
+                    "[ERROR]", lineno, fname);
+            free(*estimates);
+            fclose(f);
+            return -1;
+        }
+        if (n == cap) {
+            cap = cap == 0 ? 1024 : 2 * cap;
+            *estimates =
+                (estimate *)realloc(*estimates, cap * sizeof(estimate));
+        }
+        (*estimates)[n++] = e;
+    }
     fclose(f);
-    return 0;
+    qsort(*estimates, n, sizeof(estimate), cmpestimate);
+    return n;
 }
 
-int prterror(int pid, int taskNumber, char *out_dir, double time) {
-    FILE *memlog;
-    char memlogfname[FNAME_SIZE];
+double findEstimate(estimate *estimates, int nEstimates, int number) {
+    estimate key, *e;
+    if (nEstimates == 0)
+        return -1;
+    key.number = number;
+    e = bsearch(&key, estimates, nEstimates, sizeof(estimate), cmpestimate);
+    return e == NULL ? -1 : e->seconds;
+}
 
-    sprintf(memlogfname, "%s/task%d_killed.log", out_dir, taskNumber);
-    memlog = fopen(memlogfname, "w");
-    if (memlog == NULL)
+int flushTasks(task_ptr *currentTask, char *fname) {
+    int n = 0;
+    while (*currentTask != NULL) {
+        addUnfinishedTask(fname, (*currentTask)->number, (*currentTask)->args);
+        removeTask(currentTask);
+        n++;
+    }
+    return n;
+}
+
+int createEmitDir(char *dir) {
+    snprintf(dir, FNAME_SIZE, "%s/PBala_emit_XXXXXX", P_tmpdir);
+    if (mkdtemp(dir) == NULL) {
+        dir[0] = '\0';
         return -1;
-    fprintf(memlog, "TASK %d (PID %d) ERROR REPORT\n", taskNumber, pid);
-    fprintf(memlog, "----------------------\n");
-    fprintf(memlog, "Task was killed or stopped after %10.5G seconds.\n", time);
+    }
+    return 0;
+}
 
-    fclose(memlog);
+void removeEmitDir(char *dir) {
+    char fname[2 * FNAME_SIZE];
+    struct dirent *ent;
+    DIR *d;
+
+    if (dir[0] == '\0' || (d = opendir(dir)) == NULL)
+        return;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        snprintf(fname, sizeof(fname), "%s/%s", dir, ent->d_name);
+        unlink(fname);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+int createEmitFile(char *fname, char *dir, int taskNumber) {
+    int fd;
+    if (dir[0] == '\0' ||
+        snprintf(fname, FNAME_SIZE, "%s/task%d.txt", dir, taskNumber) >=
+            FNAME_SIZE)
+        return -1;
+    fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+    if (fd < 0)
+        return -1;
+    close(fd);
     return 0;
 }
 
+int packEmittedTasks(char *fname) {
+    FILE *f;
+    char line[BUFFER_SIZE];
+    char **lines = NULL;
+    int i, n = 0;
+    size_t len;
+
+    if ((f = fopen(fname, "r")) != NULL) {
+        while (fgets(line, BUFFER_SIZE, f) != NULL) {
+            len = strlen(line);
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+                line[--len] = '\0';
+            if (len == 0)
+                continue;
+            lines = (char **)realloc(lines, (n + 1) * sizeof(char *));
+            lines[n++] = strdup(line);
+        }
+        fclose(f);
+    }
+    remove(fname);
+
+    pvm_pkint(&n, 1, 1);
+    for (i = 0; i < n; i++) {
+        pvm_pkstr(lines[i]);
+        free(lines[i]);
+    }
+    free(lines);
+    return n;
+}
+
+void packUsage(struct rusage *usage) {
+    double times[2];
+    long counters[7];
+
+    times[0] = usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+    times[1] = usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+    counters[0] = usage->ru_maxrss;
+    counters[1] = usage->ru_minflt;
+    counters[2] = usage->ru_majflt;
+    counters[3] = usage->ru_inblock;
+    counters[4] = usage->ru_oublock;
+    counters[5] = usage->ru_nvcsw;
+    counters[6] = usage->ru_nivcsw;
+    pvm_pkdouble(times, 2, 1);
+    pvm_pklong(counters, 7, 1);
+}
+
+void unpackUsage(struct rusage *usage) {
+    double times[2];
+    long counters[7];
+
+    pvm_upkdouble(times, 2, 1);
+    pvm_upklong(counters, 7, 1);
+    memset(usage, 0, sizeof(struct rusage));
+    usage->ru_utime.tv_sec = (long)times[0];
+    usage->ru_utime.tv_usec = (long)((times[0] - (long)times[0]) * 1e6);
+    usage->ru_stime.tv_sec = (long)times[1];
+    usage->ru_stime.tv_usec = (long)((times[1] - (long)times[1]) * 1e6);
+    usage->ru_maxrss = counters[0];
+    usage->ru_minflt = counters[1];
+    usage->ru_majflt = counters[2];
+    usage->ru_inblock = counters[3];
+    usage->ru_oublock = counters[4];
+    usage->ru_nvcsw = counters[5];
+    usage->ru_nivcsw = counters[6];
+}
+
+FILE *ledgerOpen(char *out_dir) {
+    FILE *ledger;
+    char fname[FNAME_SIZE];
+
+    sprintf(fname, "%s/%s", out_dir, LEDGER_FILE);
+    if ((ledger = fopen(fname, "w")) == NULL)
+        return NULL;
+    fprintf(ledger, "task,node,slot,try,state,exit_code,time,user_time,"
+                    "system_time,maxrss_kb,minflt,majflt,inblock,oublock,"
+                    "nvcsw,nivcsw\n");
+    return ledger;
+}
+
+void ledgerWrite(FILE *ledger, int taskNumber, char *node, int slot, int tries,
+                 int state, int exit_code, double time, struct rusage *usage) {
+    fprintf(ledger, "%d,%s,%d,%d,%d,%d,%.6f,%.6f,%.6f,%ld,%ld,%ld,%ld,%ld,%ld,"
+                    "%ld\n",
+            taskNumber, node, slot, tries, state, exit_code, time,
+            usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+            usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6,
+            usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt,
+            usage->ru_inblock, usage->ru_oublock, usage->ru_nvcsw,
+            usage->ru_nivcsw);
+}
+
 #define NNODES 8
 int killPBala(void) {
     char nodes[NNODES][4] = {"a01", "a02", "a03", "a04",
@@ -280,181 +560,106 @@ int killPBala(void) {
 }
 #undef NNODES
 
-int mapleProcess(int taskNumber, char *inputFile, char *arguments,
-                 char *customPath) {
-    int i; // for loops
-    // NULL-terminated array of strings for calling the Maple script
-    char **args;
-    // 0: maple, 1: taskid, 2: X, 3: input, 4: NULL
-    int nargs = 4;
-    args = (char **)malloc((nargs + 1) * sizeof(char *));
-    // Do not malloc for NULL
-    for (i = 0; i < nargs; i++)
-        args[i] = malloc(BUFFER_SIZE);
-    // Fill up the array with strings
-    if (customPath != NULL)
-        sprintf(args[0], "%s", customPath);
-    else
-        sprintf(args[0], "maple");
-    sprintf(args[1], "-tc \"taskId:=%d\"", taskNumber);
-    sprintf(args[2], "-c \"taskArgs:=[%s]\"", arguments);
-    sprintf(args[3], "%s", inputFile);
-    args[4] = NULL;
-
-    return execvp(args[0], args);
-}
-
-int cProcess(int taskNumber, char *inputFile, char *arguments,
-             char *customPath) {
-    int i; // for loops
-    // Preparations for C or Python execution
-    char *arguments_cpy;
-    arguments_cpy = malloc(strlen(arguments));
-    strcpy(arguments_cpy, arguments);
-    // This counts how many commas there are in arguments, giving
-    // the number
-    // of arguments passed to the program
-    for (i = 0; arguments_cpy[i];
-         arguments_cpy[i] == ',' ? i++ : *arguments_cpy++)
-        ;
-    int nargs = i + 1; // i = number of commas
-    int nargs_tot;     // will be the total number of arguments
-                       // (nargs+program name+etc)
-    char *token;       // used for tokenizing arguments
-    char **args;       // this is the NULL-terminated array of strings
-
-    /* In this case it's necessary to parse the arguments string
-     * breaking it into tokens and then arranging the args of the
-     * system call in a NULL-terminated array of strings which we
-     * pass to execvp
-     */
-    // Tokenizing breaks the original string so we make a copy
-    strcpy(arguments_cpy, arguments);
-    // Args in system call are (program tasknum arguments), so
-    // 2+nargs
-    nargs_tot = 2 + nargs;
-    args = (char **)malloc((nargs_tot + 1) * sizeof(char *));
-    args[nargs_tot] = NULL; // NULL-termination of args
-    for (i = 0; i < nargs_tot; i++)
-        args[i] = malloc(BUFFER_SIZE);
-    // Two first command line arguments
-    // strcpy(args[0],inp_programFile);
-    sprintf(args[0], "./%s", inputFile);
-    sprintf(args[1], "%d", taskNumber);
-    // Tokenize arguments_cpy
-    token = strtok(arguments_cpy, ",");
-    // Copy the token to its place in args
-    for (i = 2; i < nargs_tot; i++) {
-        strcpy(args[i], token);
-        token = strtok(NULL, ",");
-    }
-    return execvp(args[0], args);
-}
-
-int pythonProcess(int taskNumber, char *inputFile, char *arguments,
-                  char *customPath) {
-    int i; // for loops
-    /* Preparations for C or Python execution */
-    char *arguments_cpy;
-    arguments_cpy = malloc(strlen(arguments));
-    strcpy(arguments_cpy, arguments);
-    // This counts how many commas there are in arguments, giving
-    // the number
-    // of arguments passed to the program
-    for (i = 0; arguments_cpy[i];
-         arguments_cpy[i] == ',' ? i++ : *arguments_cpy++)
+extern char **environ;
+
+void freeArgv(char **args) {
+    int i;
+    if (args == NULL)
+        return;
+    for (i = 0; args[i] != NULL; i++)
+        free(args[i]);
+    free(args);
+}
+
+int launchParse(char *str) {
+    if (strcmp(str, "fork") == 0)
+        return LAUNCH_FORK;
+    if (strcmp(str, "spawn") == 0)
+        return LAUNCH_SPAWN;
+    return -1;
+}
+
+/* Copy of the environment of the slave with EMIT_ENV set in *var, NULL if
+ * there is no memory (the environment of the slave itself is left alone,
+ * since its sampler and stager threads may read it meanwhile) */
+static char **taskEnviron(char *emit_file, char **var) {
+    size_t len = strlen(EMIT_ENV);
+    char **envp;
+    int i, n;
+
+    for (n = 0; environ[n] != NULL; n++)
         ;
-    int nargs = i + 1; // i = number of commas
-    int nargs_tot;     // will be the total number of arguments
-                       // (nargs+program name+etc)
-    char *token;       // used for tokenizing arguments
-    char **args;       // this is the NULL-terminated array of strings
-
-    // Same as in C, but adding "python" as first argument
-    // Tokenizing breaks the original string so we make a copy
-    strcpy(arguments_cpy, arguments);
-    // args: (0)-python (1)-program (2)-tasknumber
-    // (3..nargs+3)-arguments
-    nargs_tot = 3 + nargs;
-    args = (char **)malloc((nargs_tot + 1) * sizeof(char *));
-    args[nargs_tot] = NULL; // NULL-termination of args
-    for (i = 0; i < nargs_tot; i++)
-        args[i] = malloc(BUFFER_SIZE);
-    // Two first command line arguments
-    strcpy(args[0], "python");
-    strcpy(args[1], inputFile);
-    sprintf(args[2], "%d", taskNumber);
-    // Tokenize arguments_cpy
-    token = strtok(arguments_cpy, ",");
-    // Copy the token to its place in args
-    for (i = 3; i < nargs_tot; i++) {
-        strcpy(args[i], token);
-        token = strtok(NULL, ",");
+    envp = (char **)malloc((n + 2) * sizeof(char *));
+    *var = (char *)malloc(len + strlen(emit_file) + 2);
+    if (envp == NULL || *var == NULL) {
+        free(envp);
+        free(*var);
+        *var = NULL;
+        return NULL;
     }
-    return execvp(args[0], args);
+    sprintf(*var, "%s=%s", EMIT_ENV, emit_file);
+    envp[0] = *var;
+    for (i = 0, n = 1; environ[i] != NULL; i++)
+        if (strncmp(environ[i], EMIT_ENV, len) != 0 || environ[i][len] != '=')
+            envp[n++] = environ[i];
+    envp[n] = NULL;
+    return envp;
 }
 
-int pariProcess(int taskNumber, char *outdir, char *customPath) {
-    int i;
-    // NULL-terminated array of strings
-    char **args;
-    char filename[FNAME_SIZE];
-    sprintf(filename, "%s/auxprog-%d.gp", outdir, taskNumber);
-    // 0: gp, 1: -f, 2: -s400G, 3: file, 4: NULL
-    int nargs = 4;
-    args = (char **)malloc((nargs + 1) * sizeof(char *));
-    // Do not malloc for NULL
-    for (i = 0; i < nargs; i++)
-        args[i] = malloc(BUFFER_SIZE);
-    // Fill up the array with strings
-    sprintf(args[0], "gp");
-    sprintf(args[1], "-f");
-    sprintf(args[2], "-s400G");
-    sprintf(args[3], "%s", filename);
-    args[4] = NULL;
-
-    return execvp(args[0], args);
-}
-
-int sageProcess(int taskNumber, char *outdir, char *customPath) {
-    int i;
-    // NULL-terminated array of strings
-    char **args;
-    char filename[FNAME_SIZE];
-    sprintf(filename, "%s/auxprog-%d.sage", outdir, taskNumber);
-    // 0: sage, 1: file, 2: NULL
-    int nargs = 2;
-    args = (char **)malloc((nargs + 1) * sizeof(char *));
-    // Do not malloc for NULL
-    for (i = 0; i < nargs; i++)
-        args[i] = malloc(BUFFER_SIZE);
-    // Fill up the array with strings
-    sprintf(args[0], "sage");
-    sprintf(args[1], "%s", filename);
-    args[2] = NULL;
-
-    return execvp(args[0], args);
-}
-
-int octaveProcess(int taskNumber, char *outdir, char *customPath) {
-    int i;
-    // NULL-terminated array of strings
-    char **args;
-    char filename[FNAME_SIZE];
-    sprintf(filename, "%s/auxprog-%d.m", outdir, taskNumber);
-    // 0: octave, 1: -qf, 2: file, 3: NULL
-    int nargs = 3;
-    args = (char **)malloc((nargs + 1) * sizeof(char *));
-    // Do not malloc for NULL
-    for (i = 0; i < nargs; i++)
-        args[i] = malloc(BUFFER_SIZE);
-    // Fill up the array with strings
-    sprintf(args[0], "octave");
-    sprintf(args[1], "-qf");
-    sprintf(args[2], "%s", filename);
-    args[3] = NULL;
-
-    return execvp(args[0], args);
+pid_t spawnProcess(char **args, char *out_dir, int taskNumber, int flag_err,
+                   char *emit_file, int script) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    char output_file[2 * FNAME_SIZE];
+    char **envp, *var = NULL;
+    pid_t pid;
+    int err;
+
+    // stdout (and stderr) go to the task files, the script to stdin
+    posix_spawn_file_actions_init(&actions);
+    if (script >= 0)
+        posix_spawn_file_actions_adddup2(&actions, script, 0);
+    sprintf(output_file, "%s/task%d_stdout.txt", out_dir, taskNumber);
+    posix_spawn_file_actions_addopen(&actions, 1, output_file,
+                                     O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (flag_err) {
+        sprintf(output_file, "%s/task%d_stderr.txt", out_dir, taskNumber);
+        posix_spawn_file_actions_addopen(&actions, 2, output_file,
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+
+    // own process group, so the slave can kill the whole program, and no
+    // signals blocked or ignored by the slave
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                                        POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF);
+
+    // the program inherits the environment of the slave, plus the emit file
+    if (emit_file[0] == '\0')
+        envp = environ;
+    else if ((envp = taskEnviron(emit_file, &var)) == NULL)
+        err = ENOMEM;
+    if (envp != NULL)
+        err = posix_spawnp(&pid, args[0], &actions, &attr, args, envp);
+    if (envp != environ) {
+        free(envp);
+        free(var);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
 }
 
 int getDataFromFile(char *filename, task_ptr *currentTask) {
@@ -495,6 +700,7 @@ task_ptr newTask(int number, char *args, int tries, task_ptr next) {
     new_task->number = number;
     new_task->next = next;
     new_task->tries = tries;
+    new_task->priority = 0;
     return new_task;
 }
 
@@ -503,6 +709,13 @@ void addTask(task_ptr *currentTask, int tasknumber, char *taskargs, int tries) {
     *currentTask = new_task;
 }
 
+void insertTask(task_ptr *currentTask, task_ptr t) {
+    while (*currentTask != NULL && (*currentTask)->priority >= t->priority)
+        currentTask = &(*currentTask)->next;
+    t->next = *currentTask;
+    *currentTask = t;
+}
+
 void removeTask(task_ptr *currentTask) {
     if (*currentTask == NULL)
         return;
@@ -24,8 +24,10 @@
  */
 
 #include "stdio.h"
+#include <signal.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/types.h>
 
 #define PVM_ENCODING PvmDataRaw ///< Little Endian encoding
 #define MAX_NODE_LENGTH 6       ///< Max length of node names (a0X)
@@ -40,21 +42,41 @@
  * Flag that indicates that message is a ready sign for master
  */
 #define MSG_READY 5
+#define MSG_KILL 6 ///< Flag for telling a task to kill its running program
+#define MSG_STEAL 7 ///< Flag for asking a slave for half of its queue
+#define MSG_LOOT 8  ///< Flag for the tasks given to a thief
+#define MSG_PEERS 9 ///< Flag for the PVM ids of every slave
+#define MSG_OUTPUT 10 ///< Flag for a piece of the output of a task
+#define STOP_NONE 0  ///< No stop predicate
+#define STOP_REGEX 1 ///< Stop when a task stdout matches a regex
+#define STOP_EXIT 2  ///< Stop when a task exits with a given code
+#define WAIT_POLL_MS 100 ///< How often a waiting slave listens to the master
+/**
+ * Near the deadline (less than this many mean task durations left), the
+ * shortest tasks that can still finish are sent first
+ */
+#define ENDGAME_FACTOR 3
+/**
+ * Environment variable that tells a task where it can write new tasks
+ */
+#define EMIT_ENV "PBALA_EMIT_FILE"
+#define LAUNCH_FORK 0  ///< Start programs with fork and exec
+#define LAUNCH_SPAWN 1 ///< Start programs with posix_spawn
+#define LEDGER_FILE "ledger.csv" ///< Resource ledger in the output directory
 
 typedef struct task_ {
     char args[BUFFER_SIZE];
     int number;
     int tries;
+    int priority; ///< higher priority tasks are sent first (see insertTask)
     struct task_ *next;
 } task, *task_ptr;
 
-/**
- * Prepare Maple scripts for single CPU executions
- *
- * @param fname name of input file
- * @return      0 if successful
- */
-int mapleSingleCPU(char *fname);
+typedef struct estimate_ {
+    int number;     ///< task number
+    double seconds; ///< predicted duration of the task
+} estimate;
+
 /**
  * Count how many lines a textfile has
  *
@@ -77,10 +99,12 @@ int parseNodeFile(char *nodefile, char ***nodes, int **nodeCores);
  *
  * @param flag          Tells the function if there is a guess by the user
  * @param max_task_size If flag!=0 use this as constraint to memory
+ * @param reserved      memory (KB) that tasks already started will still
+ *                      allocate, not counted as free
  * @return              0 if there is enough memory, 1 if there is not enough
  *                      memory, -1 if an error occurred
  */
-int memcheck(int flag, long int max_task_size);
+int memcheck(int flag, long int max_task_size, long int reserved);
 /**
  * Subtract the two timespec structs
  *
@@ -102,35 +126,48 @@ int timespec_subtract(struct timespec *result, struct timespec *x,
  */
 int prtusage(int pid, int taskNumber, char *out_dir, struct rusage usage);
 /**
- * Creates an auxiliary program for PARI execution
+ * Write the resource usage report of prtusage() to an open file
  *
- * @param taskId      Task number
- * @param args        Arguments string separated by commas
- * @param programfile path to PARI script
- * @param directory   path to results directory
- * @return            0 if successful, -1 if error occurred
+ * @param memlog     file where the report is written
+ * @param pid        Proccess identifier (within system)
+ * @param taskNumber Task identifier (within our program)
+ * @param usage      Struct that contains all the resource usage information
  */
-int parifile(int taskId, char *args, char *programfile, char *directory);
+void fprtusage(FILE *memlog, int pid, int taskNumber, struct rusage usage);
 /**
- * Creates an auxiliary program for Sage execution
- *
- * @param taskId      Task number
- * @param args        Arguments string separated by commas
- * @param programfile path to script
- * @param directory   path to results directory
- * @return            0 if successful
+ * Directory of the files of a task
+ *
+ * Without sharding this is out_dir itself. With --shard-output it is
+ * out_dir/xx/yy, where xx are the last two decimal digits of the task number
+ * and yy the two before them (task 12345 goes to out_dir/45/23), so a
+ * directory holds at most 100 subdirectories, or the files of one task in
+ * 10000.
+ *
+ * @param dir        where the directory is stored (FNAME_SIZE bytes)
+ * @param out_dir    output directory
+ * @param taskNumber task number
+ * @param shard      1 if the output is sharded
+ * @param create     1 to create the directories that do not exist yet
+ * @return           0 if successful, -1 if a directory cannot be created
  */
-int sagefile(int taskId, char *args, char *programfile, char *directory);
+int taskDir(char *dir, char *out_dir, int taskNumber, int shard, int create);
 /**
- * Creates an auxiliary program for Octave execution
- *
- * @param taskId      Task number
- * @param args        Arguments string separated by commas
- * @param programfile Path to script
- * @param directory   Path to the results directory
- * @return            0 if successful
+ * Script of a PARI or Octave task, which sets taskId and taskArgs and then
+ * reads the program, given to the program as its standard input
+ *
+ * The script is written to a pipe by the slave, so no file is created for
+ * the task (Sage and Maple tasks get the same code in their command line).
+ *
+ * @param  task_type   program type
+ * @param  taskId      task number
+ * @param  args        arguments string separated by commas
+ * @param  programfile path to the script of the program
+ * @param  fd          where the read end of the pipe is stored (close on
+ *                     exec), -1 if the program type needs no script
+ * @return             0 if successful, -1 if error
  */
-int octavefile(int taskId, char *args, char *programfile, char *directory);
+int taskScript(int task_type, int taskId, char *args, char *programfile,
+               int *fd);
 /**
  * Informs that a process has been killed or stopped
  * this function runs instead of prtusage()
@@ -142,76 +179,194 @@ int octavefile(int taskId, char *args, char *programfile, char *directory);
  */
 int prterror(int pid, int taskNumber, char *out_dir, double time);
 /**
- * Kill every PBala related process from every antz node
- * @return 0
+ * Write the report of prterror() to an open file
+ *
+ * @param memlog     file where the report is written
+ * @param pid        Proccess identifier (within system)
+ * @param taskNumber Task identifier (within our program)
+ * @param time       time the task ran
  */
-int killPBala(void);
+void fprterror(FILE *memlog, int pid, int taskNumber, double time);
 /**
- * Generate system command for Maple execution and run it
+ * Read the whole stdout file of a task into memory (decompressed, if it was
+ * written with --compress-output)
  *
+ * @param  out_dir    output directory
  * @param  taskNumber task number
- * @param  inputFile  name of input file
- * @param  arguments  string of comma separated arguments
- * @param  customPath custom path to executable (if applies)
- * @return            output of execvp of the generated string
+ * @param  len        where the number of bytes read is stored
+ * @return            malloc'd NUL-terminated buffer, NULL if error
  */
-int mapleProcess(int taskNumber, char *inputFile, char *arguments,
-                 char *customPath);
+char *readTaskOutput(char *out_dir, int taskNumber, size_t *len);
 /**
- * Generate system command for C execution and run it
- *
+ * Wait for a child process to end, while listening for kill requests
+ *
+ * The slave must have SIGCHLD blocked, so the end of the child wakes it up
+ * immediately. Every WAIT_POLL_MS milliseconds it checks for a MSG_KILL
+ * message from the master for this task (or for task -1, every task), and if
+ * there is one the whole process group of the child is killed.
+ *
+ * @param  pid        process identifier of the child (and its process group)
+ * @param  infop      where the child status is stored
+ * @param  usage      where the resources used by the child (and the
+ *                    descendants it waited for) are stored
+ * @param  master     PVM task identifier of the master
  * @param  taskNumber task number
- * @param  inputFile  name of input file
- * @param  arguments  string of comma separated arguments
- * @param  customPath custom path to executable (if applies)
- * @return            output of execvp of the generated string
+ * @param  serve      called with arg every WAIT_POLL_MS milliseconds, to
+ *                    answer other messages while waiting (NULL for none)
+ * @param  arg        argument of serve
+ * @return            1 if the child was killed at the request of the master,
+ *                    0 otherwise
  */
-int cProcess(int taskNumber, char *inputFile, char *arguments,
-             char *customPath);
+int waitChild(pid_t pid, siginfo_t *infop, struct rusage *usage, int master,
+              int taskNumber, void (*serve)(void *), void *arg);
 /**
- * Generate system command for Python execution and run it
+ * Parse a deadline
  *
- * @param  taskNumber task number
- * @param  inputFile  name of input file
- * @param  arguments  string of comma separated arguments
- * @param  customPath custom path to executable (if applies)
- * @return            output of execvp of the generated string
+ * The deadline is either a duration from now, [[HH:]MM:]SS, or a wall-clock
+ * time @HH:MM (the next time the clock shows it).
+ *
+ * @param  str      deadline string
+ * @param  deadline where the absolute deadline (seconds since the Epoch) is
+ *                  stored
+ * @return          0 if successful, -1 if the string is not valid
  */
-int pythonProcess(int taskNumber, char *inputFile, char *arguments,
-                  char *customPath);
+int parseDeadline(char *str, double *deadline);
 /**
- * Generate system command for PARI/GP execution and run it
+ * Read predicted task durations from a file
  *
- * It also creates the auxiliary PARI scripts
+ * Each line has the form "tasknumber,seconds". The array is returned sorted by
+ * task number, so it can be searched with findEstimate().
  *
- * @param  taskNumber task number
- * @param  outdir     output directory name
- * @param  customPath custom path to executable (if applies)
- * @return            output of execvp of the generated string
+ * @param  fname     name of the estimates file
+ * @param  estimates where the allocated array is stored
+ * @return           number of estimates read, -1 if error
+ */
+int loadEstimates(char *fname, estimate **estimates);
+/**
+ * Find the predicted duration of a task
+ *
+ * @param  estimates  sorted array of estimates
+ * @param  nEstimates size of the array
+ * @param  number     task number
+ * @return            predicted duration in seconds, -1 if unknown
+ */
+double findEstimate(estimate *estimates, int nEstimates, int number);
+/**
+ * Write every task of the linked list to the unfinished file and empty it
+ *
+ * @param  currentTask pointer to head of linked list
+ * @param  fname       input file name
+ * @return             number of tasks written
+ */
+int flushTasks(task_ptr *currentTask, char *fname);
+/**
+ * Create the private directory of the emit files of a slave
+ *
+ * The directory lives in the node's temporary directory, so emitting tasks
+ * does not touch the shared output directory, and only the user of the slave
+ * can open it, so nobody else can replace the emit files.
+ *
+ * @param  dir where the directory name is stored (FNAME_SIZE), "" if error
+ * @return     0 if successful, -1 if error
  */
-int pariProcess(int taskNumber, char *outdir, char *customPath);
+int createEmitDir(char *dir);
 /**
- * Generate system command for Sage execution and run it
+ * Remove the directory of the emit files and any file left in it
  *
- * It also creates the auxiliary Sage scripts
+ * @param dir directory name ("" if it was not created)
+ */
+void removeEmitDir(char *dir);
+/**
+ * Create the (empty) file where a task can emit new tasks
  *
+ * @param  fname      where the file name is stored (FNAME_SIZE)
+ * @param  dir        directory of the emit files of the slave
  * @param  taskNumber task number
- * @param  outdir     output directory name
- * @param  customPath custom path to executable (if applies)
- * @return            output of execvp of the generated string
+ * @return            0 if successful, -1 if error
  */
-int sageProcess(int taskNumber, char *outdir, char *customPath);
+int createEmitFile(char *fname, char *dir, int taskNumber);
 /**
- * Generate system command for Octave execution and run it
+ * Pack the tasks emitted by a task into the active PVM send buffer
+ *
+ * Every non-empty line of the emit file is the argument string of a new task
+ * (same format as a datafile line, without the task number). The number of
+ * emitted tasks is packed first, then each argument string. The file is
+ * removed afterwards.
  *
- * It also creates the auxiliary Octave scripts
+ * @param  fname name of the emit file
+ * @return       number of tasks packed
+ */
+int packEmittedTasks(char *fname);
+/**
+ * Pack the resources used by a task into the active PVM send buffer
  *
+ * @param usage resources used by the task
+ */
+void packUsage(struct rusage *usage);
+/**
+ * Unpack the resources used by a task (packed with packUsage)
+ *
+ * @param usage where the resources are stored (fields not sent are 0)
+ */
+void unpackUsage(struct rusage *usage);
+/**
+ * Create the resource ledger of an execution (LEDGER_FILE in the output
+ * directory) and write its header
+ *
+ * @param  out_dir output directory
+ * @return         ledger stream, NULL if error
+ */
+FILE *ledgerOpen(char *out_dir);
+/**
+ * Append the resources used by a task to the ledger
+ *
+ * @param ledger     ledger stream
+ * @param taskNumber task number
+ * @param node       node where the task ran
+ * @param slot       slot (slave) that ran the task
+ * @param tries      number of tries of the task
+ * @param state      0, ST_TASK_KILLED or ST_TASK_CANCELLED
+ * @param exit_code  exit code of the task
+ * @param time       wall time of the task (seconds)
+ * @param usage      resources used by the task
+ */
+void ledgerWrite(FILE *ledger, int taskNumber, char *node, int slot, int tries,
+                 int state, int exit_code, double time, struct rusage *usage);
+/**
+ * Kill every PBala related process from every antz node
+ * @return 0
+ */
+int killPBala(void);
+/**
+ * Free a command line built by launchArgv
+ *
+ * @param args NULL-terminated array of arguments
+ */
+void freeArgv(char **args);
+/**
+ * Parse the name of a launcher
+ *
+ * @param  str "fork" or "spawn"
+ * @return     LAUNCH_FORK or LAUNCH_SPAWN, -1 if unknown
+ */
+int launchParse(char *str);
+/**
+ * Start a task with posix_spawn
+ *
+ * The program gets its own process group and its stdout (and stderr, if
+ * flag_err) redirected to the task files, like a forked one. Since nothing
+ * runs in the child before exec, the slave does not copy its page tables.
+ *
+ * @param  args       command line (see launchArgv)
+ * @param  out_dir    output directory
  * @param  taskNumber task number
- * @param  outdir     output directory name
- * @param  customPath custom path to executable (if applies)
- * @return            output of execvp of the generated string
+ * @param  flag_err   1 if stderr files are created
+ * @param  emit_file  file where the task can emit new tasks ("" if none)
+ * @param  script     standard input of the program (-1 to inherit it)
+ * @return            pid of the program, -1 if it could not be started
  */
-int octaveProcess(int taskNumber, char *outdir, char *customPath);
+pid_t spawnProcess(char **args, char *out_dir, int taskNumber, int flag_err,
+                   char *emit_file, int script);
 /**
  * Get tasks from file and create a linked list
  *
@@ -239,6 +394,16 @@ void printAbort(void);
  * @param tries       number of tries done for this task
  */
 void addTask(task_ptr *currentTask, int tasknumber, char *taskargs, int tries);
+/**
+ * Insert an existing task in the linked list, sorted by priority
+ *
+ * The task is placed after every task with greater or equal priority, so tasks
+ * with the same priority keep their insertion order
+ *
+ * @param currentTask pointer to head of linked list
+ * @param t           task to insert
+ */
+void insertTask(task_ptr *currentTask, task_ptr t);
 /**
  * Pop a task from the linked list
  *
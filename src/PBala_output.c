@@ -0,0 +1,366 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // pipe2
+
+#include "PBala_output.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pvm3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *streamName[OUTPUT_STREAMS] = {NULL, "stdout", "stderr",
+                                                  "mem", "killed"};
+
+const char *outputStreamName(int stream) {
+    if (stream < 1 || stream >= OUTPUT_STREAMS)
+        return NULL;
+    return streamName[stream];
+}
+
+int outputStream(const char *name) {
+    int s;
+    for (s = 1; s < OUTPUT_STREAMS; s++)
+        if (strcmp(name, streamName[s]) == 0)
+            return s;
+    return -1;
+}
+
+int outputPipes(output_pipe *p, int master, int taskNumber, int tries,
+                int flag_err, int keep) {
+    int fds[2];
+    int s;
+
+    memset(p, 0, sizeof(output_pipe));
+    p->master = master;
+    p->taskNumber = taskNumber;
+    p->tries = tries;
+    p->keep = keep;
+    for (s = 0; s < 3; s++)
+        p->fd[s] = p->child[s] = -1;
+    for (s = 1; s <= (flag_err ? 2 : 1); s++) {
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            outputFinish(p);
+            return -1;
+        }
+        p->fd[s] = fds[0];
+        p->child[s] = fds[1];
+        p->buf[s] = (char *)malloc(OUTPUT_CHUNK);
+    }
+    return 0;
+}
+
+void outputChild(output_pipe *p) {
+    int s;
+    for (s = 1; s < 3; s++)
+        if (p->child[s] >= 0)
+            dup2(p->child[s], s); // dup2 clears close-on-exec
+}
+
+void outputStarted(output_pipe *p) {
+    int s;
+    for (s = 1; s < 3; s++) {
+        if (p->child[s] >= 0) {
+            close(p->child[s]);
+            p->child[s] = -1;
+        }
+        if (p->fd[s] >= 0)
+            fcntl(p->fd[s], F_SETFL, fcntl(p->fd[s], F_GETFL) | O_NONBLOCK);
+    }
+}
+
+/* Send what is buffered for a stream */
+static void sendChunk(output_pipe *p, int s) {
+    int len = (int)p->len[s];
+    if (len == 0)
+        return;
+    pvm_initsend(PVM_ENCODING);
+    pvm_pkint(&p->taskNumber, 1, 1);
+    pvm_pkint(&p->tries, 1, 1);
+    pvm_pkint(&s, 1, 1);
+    pvm_pkint(&len, 1, 1);
+    pvm_pkbyte(p->buf[s], len, 1);
+    pvm_send(p->master, MSG_OUTPUT);
+    p->len[s] = 0;
+}
+
+/* Read what a pipe has, return 0 at the end of the stream */
+static int readPipe(output_pipe *p, int s) {
+    ssize_t n;
+    while ((n = read(p->fd[s], p->buf[s] + p->len[s],
+                     OUTPUT_CHUNK - p->len[s])) > 0) {
+        if (p->keep && s == 1) {
+            if (p->keptLen + n + 1 > p->keptSize) {
+                p->keptSize = 2 * (p->keptLen + n + 1);
+                p->kept = (char *)realloc(p->kept, p->keptSize);
+            }
+            memcpy(p->kept + p->keptLen, p->buf[s] + p->len[s], n);
+            p->keptLen += n;
+        }
+        p->len[s] += n;
+        if (p->len[s] == OUTPUT_CHUNK)
+            sendChunk(p, s);
+    }
+    if (n == 0) {
+        close(p->fd[s]);
+        p->fd[s] = -1;
+        return 0;
+    }
+    return 1;
+}
+
+void outputServe(void *arg) {
+    output_pipe *p = (output_pipe *)arg;
+    struct pollfd fds[2];
+    struct timespec start, now;
+    int nFds, s, left, ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    left = WAIT_POLL_MS;
+    while (left > 0) {
+        nFds = 0;
+        for (s = 1; s < 3; s++) {
+            if (p->fd[s] < 0)
+                continue;
+            fds[nFds].fd = p->fd[s];
+            fds[nFds++].events = POLLIN;
+        }
+        // once both pipes are closed only the end of the program is left
+        if (nFds == 0 || poll(fds, nFds, left) <= 0)
+            return;
+        for (s = 1; s < 3; s++)
+            if (p->fd[s] >= 0)
+                readPipe(p, s);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (now.tv_sec - start.tv_sec) * 1000 +
+             (now.tv_nsec - start.tv_nsec) / 1000000;
+        left = WAIT_POLL_MS - ms;
+    }
+}
+
+void outputFinish(output_pipe *p) {
+    int s;
+    // what is left in the pipes (children of the program that are still
+    // alive may keep them open, so do not wait for them)
+    for (s = 1; s < 3; s++) {
+        if (p->fd[s] >= 0) {
+            readPipe(p, s);
+            if (p->fd[s] >= 0)
+                close(p->fd[s]);
+            p->fd[s] = -1;
+        }
+        if (p->child[s] >= 0)
+            close(p->child[s]);
+        p->child[s] = -1;
+        if (p->buf[s] != NULL) {
+            sendChunk(p, s);
+            free(p->buf[s]);
+            p->buf[s] = NULL;
+        }
+    }
+}
+
+char *outputKept(output_pipe *p, size_t *len) {
+    if (!p->keep)
+        return NULL;
+    if (p->kept == NULL)
+        p->kept = (char *)calloc(1, 1);
+    p->kept[p->keptLen] = '\0';
+    *len = p->keptLen;
+    return p->kept;
+}
+
+void outputReport(output_pipe *p, int stream, const char *data, size_t len) {
+    int n;
+    while (len > 0) {
+        n = len > OUTPUT_CHUNK ? OUTPUT_CHUNK : (int)len;
+        pvm_initsend(PVM_ENCODING);
+        pvm_pkint(&p->taskNumber, 1, 1);
+        pvm_pkint(&p->tries, 1, 1);
+        pvm_pkint(&stream, 1, 1);
+        pvm_pkint(&n, 1, 1);
+        pvm_pkbyte((char *)data, n, 1);
+        pvm_send(p->master, MSG_OUTPUT);
+        data += n;
+        len -= n;
+    }
+}
+
+void outputFree(output_pipe *p) {
+    free(p->kept);
+    p->kept = NULL;
+    p->keptLen = p->keptSize = 0;
+}
+
+/* Open segment w->segment of the archive and its index */
+static int openSegment(output_writer *w) {
+    char fname[2 * FNAME_SIZE];
+
+    w->idx = NULL;
+    snprintf(fname, sizeof(fname), ARCHIVE_SEG, w->out_dir, w->segment);
+    if ((w->f = fopen(fname, "w")) == NULL)
+        return -1;
+    snprintf(fname, sizeof(fname), ARCHIVE_IDX, w->out_dir, w->segment);
+    if ((w->idx = fopen(fname, "w")) == NULL) {
+        fclose(w->f);
+        w->f = NULL;
+        return -1;
+    }
+    w->offset = 0;
+    return 0;
+}
+
+int outputOpen(output_writer *w, int mode, char *out_dir, int keep) {
+    char fname[2 * FNAME_SIZE];
+
+    w->mode = mode;
+    w->keep = keep;
+    w->tasks = NULL;
+    w->idx = NULL;
+    snprintf(w->out_dir, FNAME_SIZE, "%s", out_dir);
+    if (mode == OUTPUT_STREAM) {
+        snprintf(fname, sizeof(fname), "%s/%s", out_dir, OUTPUT_FILE);
+        if ((w->f = fopen(fname, "a")) == NULL)
+            return -1;
+        return 0;
+    }
+    // the segments of previous executions are kept
+    for (w->segment = 0;; w->segment++) {
+        snprintf(fname, sizeof(fname), ARCHIVE_SEG, out_dir, w->segment);
+        if (access(fname, F_OK) != 0)
+            break;
+    }
+    w->execution = w->segment;
+    return openSegment(w);
+}
+
+/* Append a record to the archive */
+static int archiveRecord(output_writer *w, int taskNumber, int tries, int s,
+                         char *data, int len) {
+    if (w->offset > 0 && w->offset + len > ARCHIVE_SEGMENT) {
+        fclose(w->f);
+        fclose(w->idx);
+        w->segment++;
+        if (openSegment(w) != 0)
+            return -1;
+    }
+    if (fwrite(data, 1, len, w->f) != (size_t)len ||
+        fprintf(w->idx, "%d %s %ld %d %d %d\n", taskNumber, streamName[s],
+                w->offset, len, w->execution, tries) < 0)
+        return -1;
+    w->offset += len;
+    return 0;
+}
+
+/* Stdout kept of a task, created if asked for */
+static output_task **findTask(output_writer *w, int taskNumber,
+                              int create) {
+    output_task **t;
+    for (t = &w->tasks; *t != NULL; t = &(*t)->next)
+        if ((*t)->taskNumber == taskNumber)
+            return t;
+    if (!create)
+        return NULL;
+    *t = (output_task *)calloc(1, sizeof(output_task));
+    (*t)->taskNumber = taskNumber;
+    return t;
+}
+
+/* Add a chunk of stdout to the copy kept for a task */
+static void keepChunk(output_writer *w, int taskNumber, int tries,
+                      char *data, int len) {
+    output_task *t = *findTask(w, taskNumber, 1);
+    // the output of an earlier try that was killed is of no use
+    if (t->tries != tries)
+        t->len = 0;
+    t->tries = tries;
+    if (t->len + len + 1 > t->size) {
+        t->size = 2 * (t->len + len + 1);
+        t->data = (char *)realloc(t->data, t->size);
+    }
+    memcpy(t->data + t->len, data, len);
+    t->len += len;
+    t->data[t->len] = '\0';
+}
+
+int outputReceive(output_writer *w, int *taskNumber) {
+    char data[OUTPUT_CHUNK];
+    int tries, s, len;
+
+    pvm_upkint(taskNumber, 1, 1);
+    pvm_upkint(&tries, 1, 1);
+    pvm_upkint(&s, 1, 1);
+    pvm_upkint(&len, 1, 1);
+    if (s < 1 || s >= OUTPUT_STREAMS || len <= 0 || len > OUTPUT_CHUNK)
+        return 0;
+    pvm_upkbyte(data, len, 1);
+    if (w->keep && s == OUTPUT_STDOUT)
+        keepChunk(w, *taskNumber, tries, data, len);
+    if (w->f == NULL)
+        return -1;
+    if (w->mode == OUTPUT_ARCHIVE)
+        return archiveRecord(w, *taskNumber, tries, s, data, len);
+    if (fprintf(w->f, "==> task %d %s (%d bytes) <==\n", *taskNumber,
+                streamName[s], len) < 0 ||
+        fwrite(data, 1, len, w->f) != (size_t)len || fputc('\n', w->f) == EOF)
+        return -1;
+    return 0;
+}
+
+const char *outputData(output_writer *w, int taskNumber, size_t *len) {
+    output_task **t = findTask(w, taskNumber, 0);
+    *len = 0;
+    if (t == NULL || (*t)->data == NULL)
+        return "";
+    *len = (*t)->len;
+    return (*t)->data;
+}
+
+int outputFlush(output_writer *w, int taskNumber) {
+    output_task **link = findTask(w, taskNumber, 0);
+
+    if (link != NULL) {
+        output_task *t = *link;
+        *link = t->next;
+        free(t->data);
+        free(t);
+    }
+    // the output (and the index) is readable while the execution runs
+    if (w->f != NULL && (fflush(w->f) != 0 ||
+                         (w->idx != NULL && fflush(w->idx) != 0)))
+        return -1;
+    return 0;
+}
+
+void outputClose(output_writer *w) {
+    while (w->tasks != NULL) {
+        output_task *t = w->tasks;
+        w->tasks = t->next;
+        free(t->data);
+        free(t);
+    }
+    if (w->f != NULL)
+        fclose(w->f);
+    if (w->idx != NULL)
+        fclose(w->idx);
+    w->f = w->idx = NULL;
+}
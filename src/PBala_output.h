@@ -0,0 +1,226 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_OUTPUT_H
+#define PBALA_OUTPUT_H
+/*! \file PBala_output.h
+ * \brief Output of the tasks streamed to the master
+ * \author Oscar Saleta Reig
+ *
+ * With --output-mode=stream or archive the programs write their stdout (and
+ * stderr, with -e) to pipes instead of taskN_stdout.txt and
+ * taskN_stderr.txt. The slave reads the pipes while it waits for the program
+ * and forwards what it reads to the master in MSG_OUTPUT messages of at most
+ * OUTPUT_CHUNK bytes:
+ *
+ *     task number, try, stream, length, bytes
+ *
+ * all of them sent before the MSG_RESULT of the task. The memory and error
+ * reports of the task (taskN_mem.txt and taskN_killed.log) are sent the same
+ * way, as streams of their own. The master writes each chunk as soon as it
+ * arrives, so it only keeps in memory the stdout of the running tasks that a
+ * reducer needs.
+ *
+ * With stream, each chunk is appended to out_dir/output.txt as a record:
+ *
+ *     ==> task N stdout (LEN bytes) <==
+ *     LEN bytes of output, and a newline
+ *
+ * With archive, the chunks are appended without headers to segment files
+ * out_dir/output-K.seg, a new one every ARCHIVE_SEGMENT bytes, and each
+ * segment has an index out_dir/output-K.idx with one line per record:
+ *
+ *     task stream offset length execution try
+ *
+ * where execution is the first segment written by the execution and try the
+ * try of the task, so that the records of one run of a task can be told
+ * apart from those of its other runs. PBala_cat reads the archive back.
+ */
+
+#include "PBala_lib.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define OUTPUT_FILES 0   ///< Output of each task in its own files
+#define OUTPUT_STREAM 1  ///< Output of the tasks sent to the master
+#define OUTPUT_ARCHIVE 2 ///< Output sent to the master and archived
+
+#define OUTPUT_STDOUT 1  ///< Stream of the stdout of a task
+#define OUTPUT_STDERR 2  ///< Stream of the stderr of a task
+#define OUTPUT_MEM 3     ///< Stream of the memory report of a task
+#define OUTPUT_KILLED 4  ///< Stream of the error report of a killed task
+#define OUTPUT_STREAMS 5 ///< Size of the arrays indexed by stream
+
+#define OUTPUT_CHUNK 65536 ///< Max bytes of a MSG_OUTPUT
+#define OUTPUT_FILE "output.txt" ///< File of the master with the output
+#define ARCHIVE_SEGMENT (1L << 30) ///< Bytes after which a segment is closed
+#define ARCHIVE_SEG "%s/output-%d.seg" ///< Segment K of out_dir
+#define ARCHIVE_IDX "%s/output-%d.idx" ///< Index of segment K of out_dir
+
+/** Name of a stream (NULL if there is no such stream) */
+const char *outputStreamName(int stream);
+/** Stream of a name (-1 if there is no such stream) */
+int outputStream(const char *name);
+
+/* Slave side */
+
+typedef struct output_pipe_ {
+    int master;             ///< PVM id of the master
+    int taskNumber;         ///< task whose output is read
+    int tries;              ///< try of the task
+    int fd[3];              ///< read ends (index 1 stdout, 2 stderr, or -1)
+    int child[3];           ///< write ends, given to the program
+    char *buf[3];           ///< output not sent yet (OUTPUT_CHUNK bytes)
+    size_t len[3];          ///< bytes in buf
+    int keep;               ///< 1 to keep a copy of stdout
+    char *kept;             ///< copy of stdout (for the stop predicate)
+    size_t keptLen, keptSize;
+} output_pipe;
+
+/**
+ * Create the pipes of a task
+ *
+ * @param  p          pipes to fill
+ * @param  master     PVM id of the master
+ * @param  taskNumber task number
+ * @param  tries      try of the task
+ * @param  flag_err   1 if stderr is streamed too
+ * @param  keep       1 to keep a copy of stdout (see outputKept)
+ * @return            0 if successful, -1 if error
+ */
+int outputPipes(output_pipe *p, int master, int taskNumber, int tries,
+                int flag_err, int keep);
+/**
+ * Move stdout and stderr of the program to the pipes (in the child)
+ *
+ * @param p pipes
+ */
+void outputChild(output_pipe *p);
+/**
+ * Close the ends of the program (in the slave, once it started)
+ *
+ * @param p pipes
+ */
+void outputStarted(output_pipe *p);
+/**
+ * Forward what the program wrote, waiting up to WAIT_POLL_MS for more (to
+ * be given to waitChild)
+ *
+ * @param arg pipes (an output_pipe)
+ */
+void outputServe(void *arg);
+/**
+ * Forward the rest of the output once the program ended, and close the pipes
+ *
+ * @param p pipes
+ */
+void outputFinish(output_pipe *p);
+/**
+ * Copy of the stdout of the task, kept if asked for in outputPipes
+ *
+ * @param  p   pipes
+ * @param  len where the length is stored
+ * @return     output (NUL-terminated), or NULL if none was kept
+ */
+char *outputKept(output_pipe *p, size_t *len);
+/**
+ * Send a report of the task (a whole stream) to the master
+ *
+ * @param p      pipes of the task
+ * @param stream OUTPUT_MEM or OUTPUT_KILLED
+ * @param data   report
+ * @param len    length of the report
+ */
+void outputReport(output_pipe *p, int stream, const char *data, size_t len);
+/**
+ * Free the copy of stdout
+ *
+ * @param p pipes
+ */
+void outputFree(output_pipe *p);
+
+/* Master side */
+
+typedef struct output_task_ {
+    int taskNumber;
+    int tries;   ///< try whose stdout is kept
+    char *data;  ///< stdout received so far
+    size_t len;  ///< bytes of stdout
+    size_t size; ///< allocated bytes
+    struct output_task_ *next;
+} output_task;
+
+typedef struct output_writer_ {
+    int mode;                 ///< OUTPUT_STREAM or OUTPUT_ARCHIVE
+    char out_dir[FNAME_SIZE]; ///< output directory
+    FILE *f;                  ///< output.txt, or the current segment
+    FILE *idx;                ///< index of the current segment
+    int segment;              ///< number of the current segment
+    int execution;            ///< first segment of this execution
+    long offset;              ///< bytes in the current segment
+    int keep;                 ///< 1 to keep the stdout of each task
+    output_task *tasks;       ///< stdout of the tasks still running
+} output_writer;
+
+/**
+ * Open the output file of the master (or the first segment of the archive,
+ * after the ones of previous executions)
+ *
+ * @param  w       writer to fill
+ * @param  mode    OUTPUT_STREAM or OUTPUT_ARCHIVE
+ * @param  out_dir output directory
+ * @param  keep    1 to keep the stdout of each task until its result (see
+ *                 outputData)
+ * @return         0 if successful, -1 if error
+ */
+int outputOpen(output_writer *w, int mode, char *out_dir, int keep);
+/**
+ * Write the output of a MSG_OUTPUT (already received)
+ *
+ * @param  w          writer
+ * @param  taskNumber where the task number of the output is stored
+ * @return            0 if successful, -1 if error
+ */
+int outputReceive(output_writer *w, int *taskNumber);
+/**
+ * Stdout of a task received so far, kept if asked for in outputOpen
+ *
+ * @param  w          writer
+ * @param  taskNumber task number
+ * @param  len        where the length is stored
+ * @return            output (NUL-terminated, "" if none)
+ */
+const char *outputData(output_writer *w, int taskNumber, size_t *len);
+/**
+ * Forget the stdout of a task whose result arrived, and flush the output
+ * written so far
+ *
+ * @param  w          writer
+ * @param  taskNumber task number
+ * @return            0 if successful, -1 if error
+ */
+int outputFlush(output_writer *w, int taskNumber);
+/**
+ * Close the output file
+ *
+ * @param w writer
+ */
+void outputClose(output_writer *w);
+
+#endif /* PBALA_OUTPUT_H */
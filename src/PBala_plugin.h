@@ -0,0 +1,116 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_PLUGIN_H
+#define PBALA_PLUGIN_H
+/*! \file PBala_plugin.h
+ * \brief Interface for C programs loaded as shared objects (programflag 6)
+ * \author Oscar Saleta Reig
+ *
+ * A plugin is a shared object (built with `-shared -fPIC`) that exports
+ *
+ *     int pbala_task(int id, int argc, char **argv);
+ *
+ * Each slave loads the plugin once and calls this function for every task,
+ * with the same argv that a C program gets with programflag 1 (argv[0] is the
+ * plugin, argv[1] the task number and the rest are the task arguments). The
+ * return value is the exit code of the task.
+ *
+ * Several tasks can run at the same time in different threads of the same
+ * process, so the function must be thread-safe, and it must write its results
+ * through the streams returned by pbala_output() and pbala_error() instead of
+ * stdout and stderr. These functions are provided by PBala_task when it loads
+ * the plugin, so the plugin does not link against anything.
+ *
+ * A plugin for numeric sweeps can also (or instead) export
+ *
+ *     int pbala_batch(int n, const int *ids, const double *const *columns,
+ *                     int ncols, FILE *const *outs, int *status);
+ *
+ * which receives up to --batch-size tasks at once, with their arguments
+ * converted to doubles and stored by columns, so that the kernel can
+ * vectorise across tasks.
+ */
+
+#include <stdio.h>
+
+#define PLUGIN_TASK "pbala_task"   ///< name of the task function
+#define PLUGIN_BATCH "pbala_batch" ///< name of the batch function
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Task function exported by the plugin
+ *
+ * @param  id   task number
+ * @param  argc number of arguments
+ * @param  argv arguments (plugin, task number, task arguments)
+ * @return      exit code of the task
+ */
+int pbala_task(int id, int argc, char **argv);
+/**
+ * Batch function exported by the plugin (optional)
+ *
+ * Task i of the batch has number ids[i] and arguments columns[0][i], ...,
+ * columns[ncols-1][i]. Each column is aligned to 64 bytes. Tasks whose
+ * arguments are not numbers, or have a different number of arguments than
+ * the first task of the batch, are passed to pbala_task instead (or fail if
+ * the plugin has no pbala_task).
+ *
+ * @param  n       number of tasks
+ * @param  ids     task numbers
+ * @param  columns arguments of the tasks, by columns
+ * @param  ncols   number of arguments of each task
+ * @param  outs    output stream of each task (its taskN_stdout.txt file)
+ * @param  status  exit code of each task (initially 0)
+ * @return         0 if successful, otherwise every task of the batch gets
+ *                 this value as exit code
+ */
+int pbala_batch(int n, const int *ids, const double *const *columns,
+                int ncols, FILE *const *outs, int *status);
+
+/**
+ * Output stream of the current task (its taskN_stdout.txt file)
+ *
+ * @return stream, only valid during the current call to pbala_task
+ */
+FILE *pbala_output(void);
+/**
+ * Error stream of the current task (its taskN_stderr.txt file, or the slave
+ * stderr if stderr files are not created or in pbala_batch)
+ *
+ * @return stream, only valid during the current call to pbala_task
+ */
+FILE *pbala_error(void);
+/**
+ * Add a new task to the execution (see Dynamic tasks in the README)
+ *
+ * @param  args arguments of the new task, in datafile format without the
+ *              task number ("arg1,arg2,..."). In pbala_batch, new tasks
+ *              are reported with the first task of the batch
+ * @return      0 if successful, -1 if error
+ */
+int pbala_emit(const char *args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PBALA_PLUGIN_H */
@@ -0,0 +1,449 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE // RUSAGE_THREAD
+
+#include "PBala_pool.h"
+#include "PBala_errcodes.h"
+#include "PBala_plugin.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+/* Streams and emit file of the task running in the current thread */
+static __thread FILE *task_out = NULL;
+static __thread FILE *task_err = NULL;
+static __thread const char *task_emit = NULL;
+
+FILE *pbala_output(void) { return task_out != NULL ? task_out : stdout; }
+
+FILE *pbala_error(void) { return task_err != NULL ? task_err : stderr; }
+
+int pbala_emit(const char *args) {
+    FILE *f;
+    if (task_emit == NULL || task_emit[0] == '\0' ||
+        (f = fopen(task_emit, "a")) == NULL)
+        return -1;
+    fprintf(f, "%s\n", args);
+    fclose(f);
+    return 0;
+}
+
+/* Write or read exactly len bytes, -1 on error or end of file */
+static int writeAll(int fd, const void *data, size_t len) {
+    const char *p = data;
+    ssize_t n;
+    while (len > 0) {
+        if ((n = write(fd, p, len)) <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int readAll(int fd, void *data, size_t len) {
+    char *p = data;
+    ssize_t n;
+    while (len > 0) {
+        if ((n = read(fd, p, len)) <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* a -= b */
+static void timevalSub(struct timeval *a, struct timeval *b) {
+    a->tv_sec -= b->tv_sec;
+    a->tv_usec -= b->tv_usec;
+    if (a->tv_usec < 0) {
+        a->tv_sec--;
+        a->tv_usec += 1000000;
+    }
+}
+
+/* a /= n */
+static void timevalDiv(struct timeval *a, int n) {
+    long long us = (a->tv_sec * 1000000LL + a->tv_usec) / n;
+    a->tv_sec = us / 1000000;
+    a->tv_usec = us % 1000000;
+}
+
+/* Run one job in the calling thread */
+static void runJob(pool_ptr p, pool_job *job, pool_result *r) {
+    char fname[2 * FNAME_SIZE];
+    char args[BUFFER_SIZE];
+    char id[16];
+    char *argv[BUFFER_SIZE / 2 + 3];
+    char *token, *save;
+    int argc = 0;
+    struct rusage before;
+
+    memset(r, 0, sizeof(pool_result));
+    snprintf(fname, sizeof(fname), "%s/task%d_stdout.txt", job->out_dir,
+             job->taskNumber);
+    if ((task_out = fopen(fname, "w")) == NULL) {
+        r->state = ST_FORK_ERR;
+        return;
+    }
+    if (job->flag_err) {
+        snprintf(fname, sizeof(fname), "%s/task%d_stderr.txt", job->out_dir,
+                 job->taskNumber);
+        task_err = fopen(fname, "w");
+    }
+    task_emit = job->emit_file;
+
+    // same arguments that a C program gets (program tasknum arguments)
+    sprintf(id, "%d", job->taskNumber);
+    argv[argc++] = p->program;
+    argv[argc++] = id;
+    strcpy(args, job->args);
+    for (token = strtok_r(args, ",", &save); token != NULL;
+         token = strtok_r(NULL, ",", &save))
+        argv[argc++] = token;
+    argv[argc] = NULL;
+
+    getrusage(RUSAGE_THREAD, &before);
+    if (p->task != NULL) {
+        r->exit_code = p->task(job->taskNumber, argc, argv);
+    } else {
+        fprintf(task_err != NULL ? task_err : stderr,
+                "ERROR - arguments of task %d do not fit in its batch, and "
+                "the plugin has no %s\n",
+                job->taskNumber, PLUGIN_TASK);
+        r->exit_code = -1;
+    }
+    getrusage(RUSAGE_THREAD, &r->usage);
+    timevalSub(&r->usage.ru_utime, &before.ru_utime);
+    timevalSub(&r->usage.ru_stime, &before.ru_stime);
+
+    fclose(task_out);
+    if (task_err != NULL)
+        fclose(task_err);
+    task_out = task_err = NULL;
+    task_emit = NULL;
+}
+
+/* Parse the arguments of a job as numbers, return how many there are or -1
+ * if one is not a number (values has room for BUFFER_SIZE / 2) */
+static int parseNumbers(char *args, double *values) {
+    char buf[BUFFER_SIZE];
+    char *token, *save, *end;
+    int n = 0;
+
+    strcpy(buf, args);
+    for (token = strtok_r(buf, ",", &save); token != NULL;
+         token = strtok_r(NULL, ",", &save)) {
+        errno = 0;
+        values[n] = strtod(token, &end);
+        while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')
+            end++;
+        if (end == token || *end != '\0' || errno == ERANGE)
+            return -1;
+        n++;
+    }
+    return n;
+}
+
+/* Run a batch of jobs in the calling thread, with a single call to
+ * pbala_batch for the tasks that have as many numeric arguments as the first
+ * one */
+static void runBatch(pool_ptr p, pool_job *jobs, int n, pool_result *r) {
+    char fname[2 * FNAME_SIZE];
+    double values[BUFFER_SIZE / 2];
+    double **columns;
+    int *ids, *status, *which;
+    FILE **outs;
+    int ncols = -1, m = 0, c, i, j, ret;
+    size_t colsize;
+    struct rusage before, after;
+
+    if (p->batch == NULL) {
+        for (i = 0; i < n; i++)
+            runJob(p, &jobs[i], &r[i]);
+        return;
+    }
+
+    // columns are aligned and padded to 64 bytes for vector loads
+    colsize = ((n * sizeof(double) + 63) / 64) * 64;
+    columns = (double **)calloc(BUFFER_SIZE / 2, sizeof(double *));
+    ids = (int *)malloc(n * sizeof(int));
+    status = (int *)calloc(n, sizeof(int));
+    which = (int *)malloc(n * sizeof(int));
+    outs = (FILE **)malloc(n * sizeof(FILE *));
+    for (i = 0; i < n; i++) {
+        memset(&r[i], 0, sizeof(pool_result));
+        r[i].state = -1; // not run yet
+        if ((c = parseNumbers(jobs[i].args, values)) < 0 ||
+            (ncols >= 0 && c != ncols))
+            continue;
+        snprintf(fname, sizeof(fname), "%s/task%d_stdout.txt",
+                 jobs[i].out_dir, jobs[i].taskNumber);
+        if ((outs[m] = fopen(fname, "w")) == NULL) {
+            r[i].state = ST_FORK_ERR;
+            continue;
+        }
+        if (ncols < 0) {
+            ncols = c;
+            for (c = 0; c < ncols; c++)
+                if (posix_memalign((void **)&columns[c], 64, colsize) != 0)
+                    columns[c] = NULL;
+        }
+        for (c = 0; c < ncols; c++)
+            if (columns[c] != NULL)
+                columns[c][m] = values[c];
+        ids[m] = jobs[i].taskNumber;
+        which[m++] = i;
+    }
+
+    if (m > 0) {
+        // new tasks of the batch go to the emit file of its first task
+        task_emit = jobs[which[0]].emit_file;
+        getrusage(RUSAGE_THREAD, &before);
+        ret = p->batch(m, ids, (const double *const *)columns, ncols,
+                       (FILE *const *)outs, status);
+        getrusage(RUSAGE_THREAD, &after);
+        task_emit = NULL;
+        timevalSub(&after.ru_utime, &before.ru_utime);
+        timevalSub(&after.ru_stime, &before.ru_stime);
+        timevalDiv(&after.ru_utime, m);
+        timevalDiv(&after.ru_stime, m);
+        for (j = 0; j < m; j++) {
+            i = which[j];
+            fclose(outs[j]);
+            r[i].state = 0;
+            r[i].exit_code = ret != 0 ? ret : status[j];
+            r[i].usage = after;
+        }
+    }
+    // the rest go one by one
+    for (i = 0; i < n; i++)
+        if (r[i].state < 0)
+            runJob(p, &jobs[i], &r[i]);
+
+    for (c = 0; c < ncols; c++)
+        free(columns[c]);
+    free(columns);
+    free(ids);
+    free(status);
+    free(which);
+    free(outs);
+}
+
+/* Main loop of a slot: run batches until the job pipe is closed */
+static void slotLoop(pool_slot *s) {
+    pool_job *jobs = NULL;
+    pool_result *r = NULL;
+    int n, size = 0;
+    while (readAll(s->job_rd, &n, sizeof(int)) == 0) {
+        if (n > size) {
+            jobs = (pool_job *)realloc(jobs, n * sizeof(pool_job));
+            r = (pool_result *)realloc(r, n * sizeof(pool_result));
+            size = n;
+        }
+        if (readAll(s->job_rd, jobs, n * sizeof(pool_job)) != 0)
+            break;
+        runBatch(s->owner, jobs, n, r);
+        if (writeAll(s->done_wr, r, n * sizeof(pool_result)) != 0)
+            break;
+    }
+    free(jobs);
+    free(r);
+}
+
+static void *slotThread(void *arg) {
+    slotLoop((pool_slot *)arg);
+    return NULL;
+}
+
+/* Create the pipes of a slot and start its thread or process */
+static int slotStart(pool_ptr p, int k) {
+    pool_slot *s = &p->slots[k];
+    int job[2], done[2], i;
+
+    if (pipe(job) != 0)
+        return -1;
+    if (pipe(done) != 0) {
+        close(job[0]);
+        close(job[1]);
+        return -1;
+    }
+    s->owner = p;
+    s->job_fd = job[1];
+    s->job_rd = job[0];
+    s->done_fd = done[0];
+    s->done_wr = done[1];
+    s->killed = 0;
+    s->pid = -1;
+    // programs started by the tasks do not inherit the pipes
+    for (i = 0; i < 2; i++) {
+        fcntl(job[i], F_SETFD, FD_CLOEXEC);
+        fcntl(done[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (!p->isolate) {
+        if (pthread_create(&s->thread, NULL, slotThread, s) != 0)
+            goto error;
+        return 0;
+    }
+
+    if ((s->pid = fork()) < 0)
+        goto error;
+    if (s->pid == 0) {
+        // only keep the ends of this slot
+        for (i = 0; i < p->nSlots; i++) {
+            if (i == k || p->slots[i].pid == -1)
+                continue;
+            close(p->slots[i].job_fd);
+            close(p->slots[i].done_fd);
+        }
+        close(s->job_fd);
+        close(s->done_fd);
+        signal(SIGPIPE, SIG_DFL);
+        slotLoop(s);
+        _exit(0);
+    }
+    close(s->job_rd);
+    close(s->done_wr);
+    return 0;
+
+error:
+    close(job[0]);
+    close(job[1]);
+    close(done[0]);
+    close(done[1]);
+    return -1;
+}
+
+int poolOpen(pool_ptr p, char *program, int nSlots, int isolate) {
+    char path[FNAME_SIZE + 2];
+    int k;
+
+    memset(p, 0, sizeof(pool));
+    // a plain name would be searched in the library path, not here
+    snprintf(path, sizeof(path), "%s%s", strchr(program, '/') ? "" : "./",
+             program);
+    if ((p->handle = dlopen(path, RTLD_NOW)) == NULL) {
+        fprintf(stderr, "%-20s - Cannot load plugin %s: %s\n", "[ERROR]",
+                program, dlerror());
+        return -1;
+    }
+    *(void **)(&p->task) = dlsym(p->handle, PLUGIN_TASK);
+    *(void **)(&p->batch) = dlsym(p->handle, PLUGIN_BATCH);
+    if (p->task == NULL && p->batch == NULL) {
+        fprintf(stderr, "%-20s - Plugin %s has no function %s or %s\n",
+                "[ERROR]", program, PLUGIN_TASK, PLUGIN_BATCH);
+        dlclose(p->handle);
+        return -1;
+    }
+    strcpy(p->program, program);
+    p->isolate = isolate;
+    p->slots = (pool_slot *)malloc(nSlots * sizeof(pool_slot));
+    for (k = 0; k < nSlots; k++)
+        p->slots[k].pid = -1;
+    // a dead slot process must not kill the slave when it is written to
+    signal(SIGPIPE, SIG_IGN);
+    for (k = 0; k < nSlots; k++) {
+        if (slotStart(p, k) != 0) {
+            fprintf(stderr, "%-20s - Cannot start plugin slot %d\n",
+                    "[ERROR]", k);
+            p->nSlots = k;
+            poolClose(p);
+            return -1;
+        }
+        p->nSlots = k + 1;
+    }
+    return 0;
+}
+
+int poolSubmit(pool_ptr p, int slot, pool_job *jobs, int n) {
+    if (writeAll(p->slots[slot].job_fd, &n, sizeof(int)) != 0)
+        return -1;
+    return writeAll(p->slots[slot].job_fd, jobs, n * sizeof(pool_job));
+}
+
+int poolCollect(pool_ptr p, int slot, pool_result *r, int n) {
+    pool_slot *s = &p->slots[slot];
+    struct rusage usage;
+    int status, state, i;
+
+    if (readAll(s->done_fd, r, n * sizeof(pool_result)) == 0)
+        return 0;
+
+    // the slot died with the batch: report it and start a new one
+    memset(&usage, 0, sizeof(usage));
+    state = ST_TASK_KILLED;
+    if (p->isolate) {
+        wait4(s->pid, &status, 0, &usage);
+        if (s->killed)
+            state = ST_TASK_CANCELLED;
+    }
+    for (i = 0; i < n; i++) {
+        memset(&r[i], 0, sizeof(pool_result));
+        r[i].state = state;
+        r[i].usage = usage;
+    }
+    if (!p->isolate)
+        return state;
+    close(s->job_fd);
+    close(s->done_fd);
+    s->pid = -1;
+    if (slotStart(p, slot) != 0)
+        fprintf(stderr, "%-20s - Cannot restart plugin slot %d\n",
+                "[ERROR]", slot);
+    return state;
+}
+
+int poolKill(pool_ptr p, int slot) {
+    if (!p->isolate)
+        return -1;
+    p->slots[slot].killed = 1;
+    kill(p->slots[slot].pid, SIGKILL);
+    return 0;
+}
+
+void poolClose(pool_ptr p) {
+    int k;
+    // a closed job pipe makes the slots finish
+    for (k = 0; k < p->nSlots; k++)
+        close(p->slots[k].job_fd);
+    for (k = 0; k < p->nSlots; k++) {
+        if (p->isolate)
+            waitpid(p->slots[k].pid, NULL, 0);
+        else
+            pthread_join(p->slots[k].thread, NULL);
+        close(p->slots[k].done_fd);
+    }
+    if (!p->isolate) {
+        for (k = 0; k < p->nSlots; k++) {
+            close(p->slots[k].job_rd);
+            close(p->slots[k].done_wr);
+        }
+    }
+    free(p->slots);
+    dlclose(p->handle);
+}
@@ -0,0 +1,129 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_POOL_H
+#define PBALA_POOL_H
+/*! \file PBala_pool.h
+ * \brief Pool of slots that run plugin tasks inside a slave
+ * \author Oscar Saleta Reig
+ *
+ * A slot is a thread of the slave or, in isolation mode, a child process
+ * forked by the slave. Either way it receives jobs and sends back results
+ * through a pair of pipes, so the slave can wait for results and for PVM
+ * messages at the same time with poll().
+ *
+ * Jobs are sent in batches of one or more tasks. If the plugin defines
+ * pbala_batch, the numeric arguments of a batch are passed to it as columns
+ * in a single call, otherwise pbala_task is called for each task.
+ */
+
+#include "PBala_lib.h"
+
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+typedef struct pool_job_ {
+    int taskNumber;                ///< task number
+    int flag_err;                  ///< 1 if a stderr file is created
+    char out_dir[FNAME_SIZE];      ///< output directory
+    char emit_file[FNAME_SIZE];    ///< where emitted tasks are written
+    char args[BUFFER_SIZE];        ///< task arguments
+} pool_job;
+
+typedef struct pool_result_ {
+    int state;           ///< 0, ST_FORK_ERR if the task could not start,
+                         ///< ST_TASK_KILLED or ST_TASK_CANCELLED
+    int exit_code;       ///< exit code of the task
+    struct rusage usage; ///< CPU time of the task and peak size of the slot
+} pool_result;
+
+typedef struct pool_slot_ {
+    struct pool_ *owner; ///< pool of the slot
+    int job_fd;          ///< pipe where the slave writes jobs
+    int done_fd;         ///< pipe where the slave reads results
+    int job_rd;          ///< slot end of the job pipe
+    int done_wr;         ///< slot end of the result pipe
+    pid_t pid;           ///< slot process (isolation mode)
+    pthread_t thread;    ///< slot thread (in-process mode)
+    int killed;          ///< 1 if the slot process was killed on request
+} pool_slot;
+
+typedef struct pool_ {
+    void *handle;                         ///< dlopen handle of the plugin
+    int (*task)(int, int, char **);       ///< pbala_task (may be NULL)
+    int (*batch)(int, const int *, const double *const *, int, FILE *const *,
+                 int *);                  ///< pbala_batch (may be NULL)
+    char program[FNAME_SIZE];             ///< plugin path (argv[0])
+    int nSlots;                           ///< number of slots
+    int isolate;                          ///< 1 if slots are processes
+    pool_slot *slots;                     ///< slots
+} pool, *pool_ptr;
+
+/**
+ * Load a plugin and start its slots
+ *
+ * @param  p       pool to fill
+ * @param  program path to the plugin
+ * @param  nSlots  number of slots
+ * @param  isolate 1 to run each slot in its own process
+ * @return         0 if successful, -1 if error
+ */
+int poolOpen(pool_ptr p, char *program, int nSlots, int isolate);
+/**
+ * Send a batch of jobs to an idle slot
+ *
+ * @param  p    pool
+ * @param  slot slot index
+ * @param  jobs jobs
+ * @param  n    number of jobs
+ * @return      0 if successful, -1 if error
+ */
+int poolSubmit(pool_ptr p, int slot, pool_job *jobs, int n);
+/**
+ * Read the results of the batch of a slot (call when its done_fd is
+ * readable)
+ *
+ * If the slot process died, every task of the batch gets state
+ * ST_TASK_CANCELLED (if it was killed with poolKill) or ST_TASK_KILLED, and
+ * the slot is restarted.
+ *
+ * @param  p    pool
+ * @param  slot slot index
+ * @param  r    where the n results are stored
+ * @param  n    number of jobs of the batch
+ * @return      0 if the slot finished the batch, the state of its tasks if it
+ *              died
+ */
+int poolCollect(pool_ptr p, int slot, pool_result *r, int n);
+/**
+ * Kill the task running in a slot (isolation mode only)
+ *
+ * @param  p    pool
+ * @param  slot slot index
+ * @return      0 if successful, -1 if tasks run in threads
+ */
+int poolKill(pool_ptr p, int slot);
+/**
+ * Stop all the slots and unload the plugin
+ *
+ * @param p pool
+ */
+void poolClose(pool_ptr p);
+
+#endif /* PBALA_POOL_H */
@@ -0,0 +1,307 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PBala_reducer.h"
+#include "PBala_lib.h"
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * BUILT-IN REDUCERS
+ *
+ * Only one reducer is active during an execution, so the built-ins keep their
+ * state in static variables, just like a shared object would.
+ */
+
+static FILE *red_out = NULL;           // output file
+static char red_fname[FNAME_SIZE];     // output file name
+static char red_spoolname[FNAME_SIZE]; // concat: spool file name
+
+/* Open the output file, named after arg if given */
+static int openOutput(const char *out_dir, const char *arg, char *deflt,
+                      char *mode) {
+    sprintf(red_fname, "%s/%s", out_dir, arg != NULL ? arg : deflt);
+    if ((red_out = fopen(red_fname, mode)) == NULL) {
+        fprintf(stderr, "%-20s - cannot create reducer output file %s\n",
+                "[ERROR]", red_fname);
+        return -1;
+    }
+    return 0;
+}
+
+/* concat: outputs are spooled in arrival order and written in task order
+ * when the execution finishes */
+typedef struct spool_entry_ {
+    int task;
+    long offset;
+    size_t len;
+} spool_entry;
+static FILE *spool = NULL;
+static spool_entry *spool_idx = NULL;
+static int spool_n = 0, spool_cap = 0;
+
+static int cmpspool(const void *a, const void *b) {
+    const spool_entry *x = (const spool_entry *)a, *y = (const spool_entry *)b;
+    return (x->task > y->task) - (x->task < y->task);
+}
+
+static int concatInit(const char *out_dir, const char *arg) {
+    sprintf(red_fname, "%s/%s", out_dir, arg != NULL ? arg : "reduced.txt");
+    sprintf(red_spoolname, "%s/reduced.spool", out_dir);
+    if ((spool = fopen(red_spoolname, "w+")) == NULL) {
+        fprintf(stderr, "%-20s - cannot create reducer spool file %s\n",
+                "[ERROR]", red_spoolname);
+        return -1;
+    }
+    return 0;
+}
+
+static int concatAccumulate(int task, const char *data, size_t len) {
+    if (spool_n == spool_cap) {
+        spool_cap = spool_cap == 0 ? 1024 : 2 * spool_cap;
+        spool_idx = realloc(spool_idx, spool_cap * sizeof(spool_entry));
+    }
+    spool_idx[spool_n].task = task;
+    spool_idx[spool_n].offset = ftell(spool);
+    spool_idx[spool_n].len = len;
+    spool_n++;
+    return fwrite(data, 1, len, spool) == len ? 0 : -1;
+}
+
+static int concatFinalize(void) {
+    int i, err = 0;
+    size_t n, left;
+    char buffer[BUFFER_SIZE];
+
+    if ((red_out = fopen(red_fname, "w")) == NULL) {
+        fprintf(stderr, "%-20s - cannot create reducer output file %s\n",
+                "[ERROR]", red_fname);
+        err = -1;
+    } else {
+        qsort(spool_idx, spool_n, sizeof(spool_entry), cmpspool);
+        for (i = 0; i < spool_n; i++) {
+            fseek(spool, spool_idx[i].offset, SEEK_SET);
+            for (left = spool_idx[i].len; left > 0; left -= n) {
+                n = left < BUFFER_SIZE ? left : BUFFER_SIZE;
+                if (fread(buffer, 1, n, spool) != n) {
+                    err = -1;
+                    break;
+                }
+                fwrite(buffer, 1, n, red_out);
+            }
+        }
+        fclose(red_out);
+    }
+    fclose(spool);
+    remove(red_spoolname);
+    free(spool_idx);
+    spool_idx = NULL;
+    spool_n = spool_cap = 0;
+    return err;
+}
+
+/* sum, min, max: element-wise over the numbers printed by each task */
+#define RED_SUM 0
+#define RED_MIN 1
+#define RED_MAX 2
+static int num_op;
+static double *num_acc = NULL;
+static int num_n = 0, num_tasks = 0;
+
+static int numericInit(const char *out_dir, const char *arg) {
+    num_n = num_tasks = 0;
+    return openOutput(out_dir, arg, "reduced.txt", "w");
+}
+
+static int numericAccumulate(int task, const char *data, size_t len) {
+    char *copy, *p, *end;
+    double value;
+    int i = 0;
+
+    copy = malloc(len + 1);
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    p = copy;
+    while (*p != '\0') {
+        // skip separators
+        while (*p != '\0' && strchr(" \t\r\n,;", *p) != NULL)
+            p++;
+        if (*p == '\0')
+            break;
+        value = strtod(p, &end);
+        if (end == p || (*end != '\0' && strchr(" \t\r\n,;", *end) == NULL)) {
+            // not a number, skip token
+            while (*p != '\0' && strchr(" \t\r\n,;", *p) == NULL)
+                p++;
+            continue;
+        }
+        p = end;
+        if (i == num_n) {
+            num_acc = realloc(num_acc, (num_n + 1) * sizeof(double));
+            num_acc[num_n++] = value;
+        } else if (num_op == RED_SUM) {
+            num_acc[i] += value;
+        } else if (num_op == RED_MIN) {
+            if (value < num_acc[i])
+                num_acc[i] = value;
+        } else {
+            if (value > num_acc[i])
+                num_acc[i] = value;
+        }
+        i++;
+    }
+    free(copy);
+    num_tasks++;
+    return 0;
+}
+
+static int numericFinalize(void) {
+    int i;
+    for (i = 0; i < num_n; i++)
+        fprintf(red_out, i == 0 ? "%.17g" : " %.17g", num_acc[i]);
+    fprintf(red_out, "\n");
+    fclose(red_out);
+    printf("%-20s - Reduced %d task outputs (%d values) into %s\n",
+           "[REDUCER]", num_tasks, num_n, red_fname);
+    free(num_acc);
+    num_acc = NULL;
+    return 0;
+}
+
+static int sumInit(const char *out_dir, const char *arg) {
+    num_op = RED_SUM;
+    return numericInit(out_dir, arg);
+}
+
+static int minInit(const char *out_dir, const char *arg) {
+    num_op = RED_MIN;
+    return numericInit(out_dir, arg);
+}
+
+static int maxInit(const char *out_dir, const char *arg) {
+    num_op = RED_MAX;
+    return numericInit(out_dir, arg);
+}
+
+/* csv: every non-empty output line is appended as "task,line" */
+static int csvInit(const char *out_dir, const char *arg) {
+    return openOutput(out_dir, arg, "reduced.csv", "w");
+}
+
+static int csvAccumulate(int task, const char *data, size_t len) {
+    size_t i = 0, j;
+    while (i < len) {
+        for (j = i; j < len && data[j] != '\n'; j++)
+            ;
+        if (j > i && !(j == i + 1 && data[i] == '\r'))
+            fprintf(red_out, "%d,%.*s\n", task, (int)(j - i), data + i);
+        i = j + 1;
+    }
+    return 0;
+}
+
+static int csvFinalize(void) { return fclose(red_out) == 0 ? 0 : -1; }
+
+/*
+ * REDUCER LOADING
+ */
+
+int reducerLoad(char *spec, char *out_dir, reducer_ptr r) {
+    char *arg;
+
+    memset(r, 0, sizeof(reducer));
+    snprintf(r->name, sizeof(r->name), "%s", spec);
+    if ((arg = strchr(r->name, ':')) != NULL)
+        *arg++ = '\0';
+
+    if (strcmp(r->name, "concat") == 0) {
+        r->init = concatInit;
+        r->accumulate = concatAccumulate;
+        r->finalize = concatFinalize;
+    } else if (strcmp(r->name, "sum") == 0 || strcmp(r->name, "min") == 0 ||
+               strcmp(r->name, "max") == 0) {
+        r->init = r->name[1] == 'u' ? sumInit
+                                    : (r->name[1] == 'i' ? minInit : maxInit);
+        r->accumulate = numericAccumulate;
+        r->finalize = numericFinalize;
+    } else if (strcmp(r->name, "csv") == 0) {
+        r->init = csvInit;
+        r->accumulate = csvAccumulate;
+        r->finalize = csvFinalize;
+    } else if (strchr(r->name, '/') != NULL) {
+        if ((r->handle = dlopen(r->name, RTLD_NOW)) == NULL) {
+            fprintf(stderr, "%-20s - cannot load reducer: %s\n", "[ERROR]",
+                    dlerror());
+            return -1;
+        }
+        *(void **)(&r->init) = dlsym(r->handle, REDUCER_INIT);
+        *(void **)(&r->accumulate) = dlsym(r->handle, REDUCER_ACCUMULATE);
+        *(void **)(&r->finalize) = dlsym(r->handle, REDUCER_FINALIZE);
+        if (r->init == NULL || r->accumulate == NULL || r->finalize == NULL) {
+            fprintf(stderr,
+                    "%-20s - reducer %s must export %s, %s and %s\n",
+                    "[ERROR]", r->name, REDUCER_INIT, REDUCER_ACCUMULATE,
+                    REDUCER_FINALIZE);
+            dlclose(r->handle);
+            return -1;
+        }
+    } else {
+        fprintf(stderr,
+                "%-20s - unknown reducer %s (use concat, sum, min, max, csv "
+                "or a path to a shared object)\n",
+                "[ERROR]", r->name);
+        return -1;
+    }
+
+    if (r->init(out_dir, arg) != 0) {
+        fprintf(stderr, "%-20s - reducer %s failed to initialise\n",
+                "[ERROR]", r->name);
+        if (r->handle != NULL)
+            dlclose(r->handle);
+        return -1;
+    }
+    return 0;
+}
+
+int reducerAccumulate(reducer_ptr r, char *out_dir, int taskNumber) {
+    char *data;
+    size_t len;
+    int err;
+
+    if ((data = readTaskOutput(out_dir, taskNumber, &len)) == NULL) {
+        fprintf(stderr, "%-20s - cannot read output of task %d for reducer\n",
+                "[ERROR]", taskNumber);
+        return -1;
+    }
+    err = r->accumulate(taskNumber, data, len);
+    free(data);
+    return err;
+}
+
+int reducerFeed(reducer_ptr r, int taskNumber, const char *data, size_t len) {
+    return r->accumulate(taskNumber, data, len);
+}
+
+int reducerFinalize(reducer_ptr r) {
+    int err = r->finalize();
+    if (r->handle != NULL)
+        dlclose(r->handle);
+    return err;
+}
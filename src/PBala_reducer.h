@@ -0,0 +1,92 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_REDUCER_H
+#define PBALA_REDUCER_H
+/*! \file PBala_reducer.h
+ * \brief Online reduction of task results in the master
+ * \author Oscar Saleta Reig
+ *
+ * A reducer is called by PBala every time a task completes, with the
+ * contents of its stdout file, so results are aggregated while the execution
+ * runs. Besides the built-in reducers, a reducer can be a shared object that
+ * exports these three functions:
+ *
+ *     int pbala_reducer_init(const char *out_dir, const char *arg);
+ *     int pbala_reducer_accumulate(int task, const char *data, size_t len);
+ *     int pbala_reducer_finalize(void);
+ *
+ * All of them return 0 if successful. `arg` is the text after the first ':'
+ * in the --reducer option (or NULL), and `out_dir` is the output directory.
+ */
+
+#include <stddef.h>
+
+#define REDUCER_INIT "pbala_reducer_init"             ///< init symbol
+#define REDUCER_ACCUMULATE "pbala_reducer_accumulate" ///< accumulate symbol
+#define REDUCER_FINALIZE "pbala_reducer_finalize"     ///< finalize symbol
+
+typedef struct reducer_ {
+    char name[256]; ///< built-in name or path to shared object
+    void *handle;   ///< dlopen handle (NULL for built-in reducers)
+    int (*init)(const char *out_dir, const char *arg);
+    int (*accumulate)(int task, const char *data, size_t len);
+    int (*finalize)(void);
+} reducer, *reducer_ptr;
+
+/**
+ * Load and initialise a reducer
+ *
+ * The spec has the form NAME[:ARG]. NAME is one of the built-in reducers
+ * (concat, sum, min, max, csv) or the path to a shared object (anything
+ * containing a '/').
+ *
+ * @param  spec    reducer specification
+ * @param  out_dir output directory
+ * @param  r       reducer to fill
+ * @return         0 if successful, -1 if error
+ */
+int reducerLoad(char *spec, char *out_dir, reducer_ptr r);
+/**
+ * Feed the stdout of a completed task to the reducer
+ *
+ * @param  r          reducer
+ * @param  out_dir    output directory
+ * @param  taskNumber task number
+ * @return            0 if successful, -1 if error
+ */
+int reducerAccumulate(reducer_ptr r, char *out_dir, int taskNumber);
+/**
+ * Feed the stdout of a completed task, already in memory, to the reducer
+ *
+ * @param  r          reducer
+ * @param  taskNumber task number
+ * @param  data       stdout of the task
+ * @param  len        length of data
+ * @return            0 if successful, -1 if error
+ */
+int reducerFeed(reducer_ptr r, int taskNumber, const char *data, size_t len);
+/**
+ * Finalize the reducer and unload it
+ *
+ * @param  r reducer
+ * @return   0 if successful, -1 if error
+ */
+int reducerFinalize(reducer_ptr r);
+
+#endif /* PBALA_REDUCER_H */
@@ -0,0 +1,246 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PBala_sampler.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Totals of one sample */
+typedef struct sample_ {
+    int processes;
+    long rss;                // KB
+    unsigned long long cpu;  // ticks
+    long threads;
+    long long rbytes, wbytes;
+} sample;
+
+/* Add the CPU ticks (utime+stime+cutime+cstime) and threads of a process to
+ * a sample, -1 if it is gone (the command name can contain blanks and
+ * parens) */
+static int readStat(pid_t pid, sample *smp) {
+    FILE *f;
+    char fname[64], buf[BUFFER_SIZE];
+    char *s;
+    unsigned long long ut, st;
+    long long cut, cst;
+    long threads;
+
+    snprintf(fname, 64, "/proc/%d/stat", (int)pid);
+    if ((f = fopen(fname, "r")) == NULL)
+        return -1;
+    s = fgets(buf, BUFFER_SIZE, f);
+    fclose(f);
+    if (s == NULL || (s = strrchr(buf, ')')) == NULL)
+        return -1;
+    // fields 14-17 (times) and 20 (threads)
+    if (sscanf(s + 2,
+               "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %lld "
+               "%lld %*d %*d %ld",
+               &ut, &st, &cut, &cst, &threads) != 5)
+        return -1;
+    smp->processes++;
+    smp->cpu += ut + st + cut + cst;
+    smp->threads += threads;
+    return 0;
+}
+
+/* Add the resident size and I/O of a process to a sample */
+static void readUsage(pid_t pid, sample *smp) {
+    FILE *f;
+    char fname[64], line[256];
+    long long value;
+
+    snprintf(fname, 64, "/proc/%d/status", (int)pid);
+    if ((f = fopen(fname, "r")) != NULL) {
+        while (fgets(line, 256, f) != NULL)
+            if (sscanf(line, "VmRSS: %lld", &value) == 1)
+                smp->rss += value;
+        fclose(f);
+    }
+    // only readable for processes of the same user
+    snprintf(fname, 64, "/proc/%d/io", (int)pid);
+    if ((f = fopen(fname, "r")) != NULL) {
+        while (fgets(line, 256, f) != NULL) {
+            if (sscanf(line, "read_bytes: %lld", &value) == 1)
+                smp->rbytes += value;
+            else if (sscanf(line, "write_bytes: %lld", &value) == 1)
+                smp->wbytes += value;
+        }
+        fclose(f);
+    }
+}
+
+/* Add the resources of one process of the task to a sample */
+static void addProcess(pid_t pid, sample *smp) {
+    if (readStat(pid, smp) == 0)
+        readUsage(pid, smp);
+}
+
+/* Append the children of every thread of a process to the list of pids */
+static void addChildren(pid_t pid, pid_t **pids, int *n, int *size) {
+    DIR *d;
+    struct dirent *e;
+    FILE *f;
+    char fname[64];
+    int child;
+
+    snprintf(fname, 64, "/proc/%d/task", (int)pid);
+    if ((d = opendir(fname)) == NULL)
+        return;
+    while ((e = readdir(d)) != NULL) {
+        if (!isdigit((unsigned char)e->d_name[0]))
+            continue;
+        snprintf(fname, 64, "/proc/%d/task/%.16s/children", (int)pid,
+                 e->d_name);
+        if ((f = fopen(fname, "r")) == NULL)
+            continue;
+        while (fscanf(f, "%d", &child) == 1) {
+            if (*n == *size) {
+                *size = *size ? 2 * *size : 64;
+                *pids = (pid_t *)realloc(*pids, *size * sizeof(pid_t));
+            }
+            (*pids)[(*n)++] = child;
+        }
+        fclose(f);
+    }
+    closedir(d);
+}
+
+/* Find the processes of the task and add up their resources */
+static void takeSample(sampler_ptr s, sample *smp) {
+    FILE *f;
+    pid_t *pids = NULL;
+    int i, pid, n = 0, size = 0;
+
+    memset(smp, 0, sizeof(sample));
+    // every process of the cgroup, wherever it was reparented
+    if (s->procs[0] != '\0') {
+        if ((f = fopen(s->procs, "r")) == NULL)
+            return;
+        while (fscanf(f, "%d", &pid) == 1)
+            addProcess(pid, smp);
+        fclose(f);
+        return;
+    }
+    // the program and its descendants, breadth first
+    addProcess(s->pid, smp);
+    addChildren(s->pid, &pids, &n, &size);
+    for (i = 0; i < n; i++) {
+        addProcess(pids[i], smp);
+        addChildren(pids[i], &pids, &n, &size);
+    }
+    free(pids);
+}
+
+/* Seconds since the start of the task */
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static void writeSample(sampler_ptr s) {
+    sample smp;
+    double t, cpu = 0;
+    long ticks = sysconf(_SC_CLK_TCK);
+
+    takeSample(s, &smp);
+    if (smp.processes == 0)
+        return;
+    t = elapsed(&s->start);
+    // processes that end take their ticks with them
+    if (t > s->last && smp.cpu > s->cpu)
+        cpu = 100.0 * (smp.cpu - s->cpu) / ticks / (t - s->last);
+    fprintf(s->out, "%.3f,%d,%ld,%.1f,%ld,%lld,%lld\n", t, smp.processes,
+            smp.rss, cpu, smp.threads, smp.rbytes, smp.wbytes);
+    fflush(s->out);
+    s->cpu = smp.cpu;
+    s->last = t;
+}
+
+static void *samplerThread(void *arg) {
+    sampler_ptr s = (sampler_ptr)arg;
+    struct timespec deadline;
+
+    // the first sample is one interval after the one of samplerStart
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += s->interval / 1000;
+        deadline.tv_nsec += (s->interval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!s->stop &&
+               pthread_cond_timedwait(&s->wake, &s->lock, &deadline) !=
+                   ETIMEDOUT)
+            ;
+        if (s->stop)
+            break;
+        pthread_mutex_unlock(&s->lock);
+        writeSample(s);
+        pthread_mutex_lock(&s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+int samplerStart(sampler_ptr s, pid_t pid, int interval, int taskNumber,
+                 char *out_dir, char *procs) {
+    char fname[FNAME_SIZE];
+    sample smp;
+
+    sprintf(fname, "%s/task%d_samples.csv", out_dir, taskNumber);
+    if ((s->out = fopen(fname, "w")) == NULL)
+        return -1;
+    fprintf(s->out, "time,processes,rss_kb,cpu_percent,threads,read_bytes,"
+                    "write_bytes\n");
+    s->pid = pid;
+    snprintf(s->procs, BUFFER_SIZE, "%s", procs != NULL ? procs : "");
+    s->interval = interval;
+    s->stop = 0;
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    // the CPU usage of the first line is measured from here
+    takeSample(s, &smp);
+    s->cpu = smp.cpu;
+    s->last = elapsed(&s->start);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    if (pthread_create(&s->thread, NULL, samplerThread, s) != 0) {
+        fclose(s->out);
+        return -1;
+    }
+    return 0;
+}
+
+void samplerStop(sampler_ptr s) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->wake);
+    fclose(s->out);
+}
@@ -0,0 +1,83 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_SAMPLER_H
+#define PBALA_SAMPLER_H
+/*! \file PBala_sampler.h
+ * \brief Time series of the resources used by the process tree of a task
+ * \author Oscar Saleta Reig
+ *
+ * While a task runs, a thread of the slave wakes up every few milliseconds,
+ * finds the processes of the task and writes one line to taskN_samples.csv
+ * with
+ *
+ *     time,processes,rss_kb,cpu_percent,threads,read_bytes,write_bytes
+ *
+ * where the resident size, threads and I/O bytes are the sums over the live
+ * processes and the CPU usage is measured since the previous sample (100 is
+ * one busy core).
+ *
+ * The processes are those listed in the cgroup of the task when it has one,
+ * and otherwise the program and its descendants, found by following the
+ * /proc/PID/task/TID/children lists from the program. Only the processes of
+ * the task are read, not the whole /proc.
+ */
+
+#include "PBala_lib.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+typedef struct sampler_ {
+    pthread_t thread;        ///< sampling thread
+    pthread_mutex_t lock;    ///< protects stop
+    pthread_cond_t wake;     ///< signalled to stop the thread
+    int stop;                ///< 1 when the task has ended
+    pid_t pid;               ///< program of the task
+    char procs[BUFFER_SIZE]; ///< cgroup.procs of the task ("" if none)
+    int interval;            ///< milliseconds between samples
+    FILE *out;               ///< taskN_samples.csv
+    struct timespec start;   ///< start of the task
+    unsigned long long cpu;  ///< CPU ticks of the tree at the last sample
+    double last;             ///< time of the last sample (seconds)
+} sampler, *sampler_ptr;
+
+/**
+ * Start sampling the process tree of a task
+ *
+ * @param  s          sampler to fill
+ * @param  pid        program of the task
+ * @param  interval   milliseconds between samples
+ * @param  taskNumber task number
+ * @param  out_dir    output directory
+ * @param  procs      cgroup.procs file of the task (NULL if it has no
+ *                    cgroup)
+ * @return            0 if successful, -1 if error
+ */
+int samplerStart(sampler_ptr s, pid_t pid, int interval, int taskNumber,
+                 char *out_dir, char *procs);
+/**
+ * Stop sampling (call when the task has ended)
+ *
+ * @param s sampler
+ */
+void samplerStop(sampler_ptr s);
+
+#endif /* PBALA_SAMPLER_H */
@@ -0,0 +1,219 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PBala_stage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pvm3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define COPY_SIZE 65536 ///< Bytes copied at once between filesystems
+
+/* Copy a file to another filesystem and remove it, -1 if error */
+static int copyFile(char *src, char *dst) {
+    char *buf;
+    ssize_t n = 0, w;
+    int in, out, off;
+
+    if ((in = open(src, O_RDONLY)) < 0)
+        return -1;
+    if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(in);
+        return -1;
+    }
+    buf = (char *)malloc(COPY_SIZE);
+    while ((n = read(in, buf, COPY_SIZE)) > 0) {
+        for (off = 0; off < n; off += w)
+            if ((w = write(out, buf + off, n - off)) < 0)
+                break;
+        if (off < n)
+            break;
+    }
+    free(buf);
+    close(in);
+    if (close(out) != 0 || n != 0)
+        return -1;
+    return unlink(src);
+}
+
+/* Move the contents of a directory to another one, -1 if anything is left */
+static int moveTree(char *src, char *dst) {
+    char from[2 * FNAME_SIZE], to[2 * FNAME_SIZE];
+    struct dirent *ent;
+    struct stat st;
+    DIR *dir;
+    int err = 0;
+
+    if ((dir = opendir(src)) == NULL)
+        return -1;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        snprintf(from, sizeof(from), "%s/%s", src, ent->d_name);
+        snprintf(to, sizeof(to), "%s/%s", dst, ent->d_name);
+        // the same filesystem only needs a rename
+        if (rename(from, to) == 0)
+            continue;
+        if (errno != EXDEV || lstat(from, &st) != 0) {
+            err = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            if ((mkdir(to, 0755) != 0 && errno != EEXIST) ||
+                moveTree(from, to) != 0 || rmdir(from) != 0)
+                err = -1;
+        } else if (!S_ISREG(st.st_mode) || copyFile(from, to) != 0) {
+            err = -1;
+        }
+    }
+    closedir(dir);
+    return err;
+}
+
+/* Move the files of the tasks handed to the stager */
+static void *stageThread(void *arg) {
+    stager *s = (stager *)arg;
+    stage_job *batch[STAGE_BATCH];
+    int i, n;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (!s->stop && s->next == NULL)
+            pthread_cond_wait(&s->work, &s->lock);
+        if (s->next == NULL)
+            break;
+        for (n = 0; n < STAGE_BATCH && s->next != NULL; n++) {
+            batch[n] = s->next;
+            s->next = s->next->next;
+        }
+        pthread_mutex_unlock(&s->lock);
+        for (i = 0; i < n; i++) {
+            // whatever cannot be moved stays in the scratch directory
+            if (moveTree(batch[i]->src, batch[i]->dst) != 0 ||
+                rmdir(batch[i]->src) != 0)
+                fprintf(stderr,
+                        "%-20s - Some files of %s could not be moved to "
+                        "%s\n",
+                        "[WARNING]", batch[i]->src, batch[i]->dst);
+        }
+        pthread_mutex_lock(&s->lock);
+        for (i = 0; i < n; i++)
+            batch[i]->done = 1;
+        pthread_cond_broadcast(&s->moved);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+int stageInit(stager *s, char *scratch) {
+    int i;
+
+    memset(s, 0, sizeof(stager));
+    snprintf(s->root, FNAME_SIZE, "%s/PBala-%d", scratch, (int)getpid());
+    if (mkdir(s->root, 0755) != 0 && errno != EEXIST)
+        return -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->moved, NULL);
+    for (i = 0; i < STAGE_TRANSFERS; i++) {
+        if (pthread_create(&s->threads[i], NULL, stageThread, s) != 0) {
+            // the threads that started are enough
+            if (i > 0)
+                break;
+            rmdir(s->root);
+            return -1;
+        }
+    }
+    for (; i < STAGE_TRANSFERS; i++)
+        s->threads[i] = 0;
+    return 0;
+}
+
+int stageTaskDir(stager *s, char *dir, int taskNumber) {
+    if (snprintf(dir, FNAME_SIZE, "%s/task%d", s->root, taskNumber) >=
+            FNAME_SIZE ||
+        (mkdir(dir, 0755) != 0 && errno != EEXIST))
+        return -1;
+    return 0;
+}
+
+void stageSubmit(stager *s, char *src, char *dst) {
+    stage_job *j = (stage_job *)calloc(1, sizeof(stage_job));
+
+    snprintf(j->src, FNAME_SIZE, "%s", src);
+    snprintf(j->dst, FNAME_SIZE, "%s", dst);
+    j->bufid = pvm_setsbuf(0);
+    pthread_mutex_lock(&s->lock);
+    if (s->tail != NULL)
+        s->tail->next = j;
+    else
+        s->head = j;
+    s->tail = j;
+    if (s->next == NULL)
+        s->next = j;
+    s->pending++;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void stageFlush(stager *s, int master, int wait) {
+    stage_job *j;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (s->head != NULL && s->head->done) {
+            j = s->head;
+            if ((s->head = j->next) == NULL)
+                s->tail = NULL;
+            s->pending--;
+            pthread_mutex_unlock(&s->lock);
+            pvm_setsbuf(j->bufid);
+            pvm_send(master, MSG_RESULT);
+            pvm_setsbuf(0);
+            pvm_freebuf(j->bufid);
+            free(j);
+            pthread_mutex_lock(&s->lock);
+        }
+        if ((wait == 1 && s->pending < STAGE_BACKLOG) ||
+            (wait == 2 && s->pending == 0) || wait == 0)
+            break;
+        pthread_cond_wait(&s->moved, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void stageStop(stager *s) {
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < STAGE_TRANSFERS; i++)
+        if (s->threads[i] != 0)
+            pthread_join(s->threads[i], NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->work);
+    pthread_cond_destroy(&s->moved);
+    rmdir(s->root);
+}
@@ -0,0 +1,113 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_STAGE_H
+#define PBALA_STAGE_H
+/*! \file PBala_stage.h
+ * \brief Node-local scratch directories staged to the output directory
+ * \author Oscar Saleta Reig
+ *
+ * With --scratch=DIR each slave creates DIR/PBala-PID, and every task writes
+ * its files (stdout, stderr, reports and whatever the program writes to
+ * $PBALA_SCRATCH) to a directory taskN inside it. When the task ends its
+ * result is packed but not sent: the directory is handed to the stager,
+ * whose STAGE_TRANSFERS threads move the files to the directory of the task
+ * in out_dir (a rename, or a copy if the scratch is another filesystem),
+ * taking up to STAGE_BATCH tasks at a time. Meanwhile the slave asks for
+ * its next task. The results are sent to the master in task order once
+ * their files are in out_dir, so the master and the reducers always find
+ * them. If STAGE_BACKLOG tasks are waiting, the slave waits before starting
+ * another one.
+ *
+ * PVM is only used by the thread of the slave (see stageFlush).
+ */
+
+#include "PBala_lib.h"
+
+#include <pthread.h>
+
+#define STAGE_TRANSFERS 2 ///< Threads moving files to out_dir at once
+#define STAGE_BATCH 8     ///< Max tasks taken at once by a thread
+#define STAGE_BACKLOG 32  ///< Max tasks waiting to be moved
+#define SCRATCH_ENV "PBALA_SCRATCH" ///< Scratch directory of a task
+
+typedef struct stage_job_ {
+    char src[FNAME_SIZE];    ///< scratch directory of the task
+    char dst[FNAME_SIZE];    ///< directory of the task in out_dir
+    int bufid;               ///< packed result of the task
+    int done;                ///< 1 once the files are moved
+    struct stage_job_ *next; ///< next job, in task order
+} stage_job;
+
+typedef struct stager_ {
+    pthread_t threads[STAGE_TRANSFERS];
+    pthread_mutex_t lock;
+    pthread_cond_t work;   ///< signalled when jobs arrive or on stop
+    pthread_cond_t moved;  ///< signalled when jobs are done
+    stage_job *head;       ///< first job whose result was not sent
+    stage_job *tail;       ///< last job
+    stage_job *next;       ///< first job not taken by a thread
+    int pending;           ///< jobs whose result was not sent
+    int stop;              ///< 1 when the threads must end
+    char root[FNAME_SIZE]; ///< scratch directory of the slave
+} stager;
+
+/**
+ * Create the scratch directory of the slave and start the stager
+ *
+ * @param  s       stager to fill
+ * @param  scratch node-local directory given with --scratch
+ * @return         0 if successful, -1 if error
+ */
+int stageInit(stager *s, char *scratch);
+/**
+ * Create the scratch directory of a task
+ *
+ * @param  s          stager
+ * @param  dir        where the directory is stored (FNAME_SIZE bytes)
+ * @param  taskNumber task number
+ * @return            0 if successful, -1 if error
+ */
+int stageTaskDir(stager *s, char *dir, int taskNumber);
+/**
+ * Hand the files of a task to the stager, along with its result (packed in
+ * the active send buffer, which is detached)
+ *
+ * @param s   stager
+ * @param src scratch directory of the task
+ * @param dst directory of the task in out_dir
+ */
+void stageSubmit(stager *s, char *src, char *dst);
+/**
+ * Send the results of the tasks whose files were moved, in task order
+ *
+ * @param s      stager
+ * @param master PVM id of the master
+ * @param wait   0 to only send what is ready, 1 to wait until less than
+ *               STAGE_BACKLOG tasks are waiting, 2 to wait for every task
+ */
+void stageFlush(stager *s, int master, int wait);
+/**
+ * Stop the stager (after stageFlush(s, master, 2)) and remove the scratch
+ * directory of the slave
+ *
+ * @param s stager
+ */
+void stageStop(stager *s);
+
+#endif /* PBALA_STAGE_H */
@@ -0,0 +1,205 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PBala_steal.h"
+
+#include <pvm3.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Add a task at the end of the queue */
+static void append(steal_queue *q, int number, int tries, char *args) {
+    task_ptr t = newTask(number, args, tries, NULL);
+    if (q->tail == NULL)
+        q->head = t;
+    else
+        q->tail->next = t;
+    q->tail = t;
+    q->n++;
+}
+
+/* Queue the tasks of a MSG_LOOT */
+static void unpackLoot(steal_queue *q) {
+    char args[BUFFER_SIZE];
+    int n, number, tries;
+
+    pvm_upkint(&n, 1, 1);
+    while (n-- > 0) {
+        pvm_upkint(&number, 1, 1);
+        pvm_upkint(&tries, 1, 1);
+        pvm_upkstr(args);
+        append(q, number, tries, args);
+    }
+}
+
+/* Queue the tasks of a MSG_WORK of the master (same layout as a batch),
+ * return 0 if it tells us to stop */
+static int unpackWork(steal_queue *q) {
+    char args[BUFFER_SIZE];
+    int work_code, number, tries, slot, more;
+
+    pvm_upkint(&work_code, 1, 1);
+    if (work_code == MSG_STOP)
+        return 0;
+    pvm_upkint(&number, 1, 1);
+    pvm_upkint(&tries, 1, 1);
+    pvm_upkstr(q->program);
+    pvm_upkstr(q->out_dir);
+    pvm_upkstr(args);
+    pvm_upkint(&slot, 1, 1);
+    append(q, number, tries, args);
+    // each further task of the chunk is preceded by a nonzero int
+    while (pvm_upkint(&more, 1, 1) >= 0 && more) {
+        pvm_upkint(&number, 1, 1);
+        pvm_upkint(&tries, 1, 1);
+        pvm_upkstr(args);
+        append(q, number, tries, args);
+    }
+    return 1;
+}
+
+/* Send the last half of the queue to a thief (nothing once cancelled) */
+static void giveLoot(steal_queue *q, int thief) {
+    task_ptr *link = &q->head;
+    task_ptr t;
+    int n = q->cancelled ? 0 : (q->n + 1) / 2;
+    int i;
+
+    for (i = 0; i < q->n - n; i++)
+        link = &(*link)->next;
+    pvm_initsend(PVM_ENCODING);
+    pvm_pkint(&n, 1, 1);
+    while (*link != NULL) {
+        t = *link;
+        pvm_pkint(&t->number, 1, 1);
+        pvm_pkint(&t->tries, 1, 1);
+        pvm_pkstr(t->args);
+        removeTask(link);
+    }
+    pvm_send(thief, MSG_LOOT);
+    q->n -= n;
+    q->tail = NULL;
+    for (t = q->head; t != NULL; t = t->next)
+        q->tail = t;
+}
+
+/* Take the messages of the master that cancel every task */
+static void checkCancel(steal_queue *q) {
+    int victim;
+    while (pvm_nrecv(q->master, MSG_KILL) > 0) {
+        pvm_upkint(&victim, 1, 1);
+        if (victim < 0)
+            q->cancelled = 1;
+    }
+}
+
+int stealInit(steal_queue *q, int master, int slot) {
+    memset(q, 0, sizeof(steal_queue));
+    q->master = master;
+    q->slot = slot;
+    q->mytid = pvm_mytid();
+    if (pvm_recv(master, MSG_PEERS) < 0)
+        return -1;
+    pvm_upkint(&q->nPeers, 1, 1);
+    q->peers = (int *)malloc(q->nPeers * sizeof(int));
+    pvm_upkint(q->peers, q->nPeers, 1);
+    // start with the next slave, so that thieves spread over their peers
+    for (q->victim = 0; q->victim < q->nPeers; q->victim++)
+        if (q->peers[q->victim] == q->mytid)
+            break;
+    q->victim = (q->victim + 1) % q->nPeers;
+    return 0;
+}
+
+void stealServe(void *arg) {
+    steal_queue *q = (steal_queue *)arg;
+    int bufid, bytes, tag, tid;
+
+    while ((bufid = pvm_nrecv(-1, MSG_STEAL)) > 0) {
+        pvm_bufinfo(bufid, &bytes, &tag, &tid);
+        giveLoot(q, tid);
+    }
+}
+
+int stealNext(steal_queue *q, int *taskNumber, int *tries, char *args) {
+    int bufid, bytes, tag, tid, victim, from, i;
+    int one = 1;
+
+    stealServe(q);
+    checkCancel(q);
+    // ask every other slave once, then the master
+    for (i = 0; q->head == NULL && i <= q->nPeers; i++) {
+        if (i < q->nPeers) {
+            from = q->peers[(q->victim + i) % q->nPeers];
+            if (from == q->mytid)
+                continue;
+            pvm_initsend(PVM_ENCODING);
+            pvm_send(from, MSG_STEAL);
+        } else {
+            from = q->master;
+            pvm_initsend(PVM_ENCODING);
+            pvm_pkint(&one, 1, 1);
+            pvm_pkint(&q->slot, 1, 1);
+            pvm_send(q->master, MSG_READY);
+        }
+        // answer the other thieves while we wait for ours
+        while (1) {
+            if ((bufid = pvm_recv(-1, -1)) < 0)
+                return 0;
+            pvm_bufinfo(bufid, &bytes, &tag, &tid);
+            if (tag == MSG_STEAL) {
+                giveLoot(q, tid);
+            } else if (tag == MSG_KILL) {
+                pvm_upkint(&victim, 1, 1);
+                if (victim < 0)
+                    q->cancelled = 1;
+            } else if (tag == MSG_LOOT) {
+                unpackLoot(q);
+                if (tid == from)
+                    break;
+            } else if (tag == MSG_WORK) {
+                if (!unpackWork(q))
+                    return 0;
+                if (tid == from)
+                    break;
+            } else if (tag == MSG_STOP) {
+                return 0;
+            }
+        }
+    }
+    if (q->head == NULL)
+        return 0;
+    q->victim = (q->victim + 1) % q->nPeers;
+
+    *taskNumber = q->head->number;
+    *tries = q->head->tries;
+    strcpy(args, q->head->args);
+    removeTask(&q->head);
+    if (q->head == NULL)
+        q->tail = NULL;
+    q->n--;
+    return 1;
+}
+
+void stealCancel(steal_queue *q) { q->cancelled = 1; }
+
+void stealFree(steal_queue *q) {
+    while (q->head != NULL)
+        removeTask(&q->head);
+    free(q->peers);
+}
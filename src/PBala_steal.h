@@ -0,0 +1,104 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_STEAL_H
+#define PBALA_STEAL_H
+/*! \file PBala_steal.h
+ * \brief Local task queues of the slaves and work stealing between them
+ * \author Oscar Saleta Reig
+ *
+ * With work stealing the master deals chunks of tasks to the slaves, which
+ * keep them in a local queue and run them one after another. A slave whose
+ * queue runs dry asks its peers in turn for half of their queues, and only
+ * asks the master for work when none of them has any left. The master still
+ * receives every result, and deals the tasks it gets later (retries, emitted
+ * tasks and tasks released by their dependencies) to the slaves that ask.
+ *
+ * Slaves talk to each other with two messages:
+ *
+ *     MSG_STEAL  (empty)                          thief -> victim
+ *     MSG_LOOT   n, n times (number, tries, args) victim -> thief
+ *
+ * and learn the PVM ids of their peers from a MSG_PEERS message of the
+ * master (n, n ids).
+ */
+
+#include "PBala_lib.h"
+
+typedef struct steal_queue_ {
+    task_ptr head;            ///< next task to run
+    task_ptr tail;            ///< last task (thieves take from this end)
+    int n;                    ///< tasks in the queue
+    int master;               ///< PVM id of the master
+    int slot;                 ///< slot of this slave
+    int mytid;                ///< PVM id of this slave
+    int *peers;               ///< PVM ids of every slave
+    int nPeers;               ///< number of slaves
+    int victim;               ///< peer asked first by the next steal
+    int cancelled;            ///< 1 if the master cancelled every task
+    char program[FNAME_SIZE]; ///< program file of the tasks
+    char out_dir[FNAME_SIZE]; ///< output directory of the tasks
+} steal_queue;
+
+/**
+ * Prepare the queue of a slave, waiting for the list of its peers
+ *
+ * @param  q      queue to fill
+ * @param  master PVM id of the master
+ * @param  slot   slot of this slave
+ * @return        0 if successful, -1 if error
+ */
+int stealInit(steal_queue *q, int master, int slot);
+/**
+ * Give half of the queue to every peer that asked for it (call it often, a
+ * thief waits for the answer)
+ *
+ * @param arg queue (a steal_queue, so it can be given to waitChild)
+ */
+void stealServe(void *arg);
+/**
+ * Take the next task of the queue, stealing from the peers or asking the
+ * master for work if it is empty
+ *
+ * While it waits, it keeps answering the peers. If the master cancelled
+ * every task (see stealCancel) the tasks are still returned, so that the
+ * slave reports them as cancelled without running them.
+ *
+ * @param  q          queue
+ * @param  taskNumber where the task number is stored
+ * @param  tries      where the tries of the task are stored
+ * @param  args       where the task arguments are stored (BUFFER_SIZE)
+ * @return            1 if a task was taken, 0 if the master stopped the
+ *                    slave
+ */
+int stealNext(steal_queue *q, int *taskNumber, int *tries, char *args);
+/**
+ * Mark every task queued or received from now on as cancelled (the master
+ * sends a MSG_KILL for task -1 when the execution stops)
+ *
+ * @param q queue
+ */
+void stealCancel(steal_queue *q);
+/**
+ * Free the queue
+ *
+ * @param q queue
+ */
+void stealFree(steal_queue *q);
+
+#endif /* PBALA_STEAL_H */
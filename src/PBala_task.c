@@ -23,21 +23,848 @@
  */
 #include "PBala_config.h"
 #include "PBala_errcodes.h"
+#include "PBala_affinity.h"
+#include "PBala_cache.h"
+#include "PBala_cgroup.h"
+#include "PBala_compress.h"
+#include "PBala_launch.h"
 #include "PBala_lib.h"
+#include "PBala_output.h"
+#include "PBala_pool.h"
+#include "PBala_sampler.h"
+#include "PBala_stage.h"
+#include "PBala_steal.h"
+#include "PBala_worker.h"
 
 #include <fcntl.h>
+#include <poll.h>
 #include <pvm3.h>
+#include <regex.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+/**
+ * Check if the result of a task satisfies the stop predicate
+ *
+ * \param[in] stop_mode  STOP_NONE, STOP_REGEX or STOP_EXIT
+ * \param[in] stop_code  exit code that stops the execution
+ * \param[in] stop_re    regular expression that stops the execution
+ * \param[in] state      state of the task
+ * \param[in] exit_code  exit code of the task
+ * \param[in] out_dir    output directory
+ * \param[in] taskNumber task number
+ * \param[in] streamed   stdout of the task, if it was streamed to the
+ *                       master (NULL to read its stdout file)
+ *
+ * \return 1 if the execution has to stop, 0 otherwise
+ */
+static int stopMatch(int stop_mode, int stop_code, regex_t *stop_re,
+                     int state, int exit_code, char *out_dir, int taskNumber,
+                     const char *streamed) {
+    int match = 0;
+    if (state == 0 && stop_mode == STOP_EXIT) {
+        match = exit_code == stop_code;
+    } else if (state == 0 && stop_mode == STOP_REGEX && streamed != NULL) {
+        match = regexec(stop_re, streamed, 0, NULL, 0) == 0;
+    } else if (state == 0 && stop_mode == STOP_REGEX) {
+        size_t len;
+        char *output = readTaskOutput(out_dir, taskNumber, &len);
+        if (output != NULL) {
+            match = regexec(stop_re, output, 0, NULL, 0) == 0;
+            free(output);
+        }
+    }
+    return match;
+}
+
+/* What a slave does while it waits for its program */
+typedef struct slave_wait_ {
+    steal_queue *sq;  // queue to serve to thieves (NULL if not stealing)
+    output_pipe *out; // output to forward (NULL if written to files)
+    stager *stg;      // results to send once staged (NULL without scratch)
+    int master;       // PVM id of the master
+} slave_wait;
+
+/* Serve the thieves, forward the output of the program and send the staged
+ * results (for waitChild) */
+static void serveWait(void *arg) {
+    slave_wait *sw = (slave_wait *)arg;
+    if (sw->sq != NULL)
+        stealServe(sw->sq);
+    if (sw->out != NULL)
+        outputServe(sw->out);
+    if (sw->stg != NULL)
+        stageFlush(sw->stg, sw->master, 0);
+}
+
+/**
+ * Pack the result of a task in a new send buffer (see sendResult)
+ *
+ * \param[in] me         slave (or plugin slot) number
+ * \param[in] taskNumber task number
+ * \param[in] tries      tries performed for this task
+ * \param[in] state      state of the task
+ * \param[in] arguments  task arguments
+ * \param[in] difft      execution time of the task
+ * \param[in] totalt     execution time of all the tasks of this slave
+ * \param[in] exit_code  exit code of the task
+ * \param[in] stop_match 1 if the task satisfies the stop predicate
+ * \param[in] emit_file  file where the task emitted new tasks
+ * \param[in] usage      resources used by the task, for the ledger of the
+ *                       master (NULL if it keeps no ledger)
+ */
+static void packResult(int me, int taskNumber, int tries, int state,
+                       char *arguments, double difft, double totalt,
+                       int exit_code, int stop_match, char *emit_file,
+                       struct rusage *usage) {
+    pvm_initsend(PVM_ENCODING);
+    pvm_pkint(&me, 1, 1);
+    pvm_pkint(&taskNumber, 1, 1);
+    pvm_pkint(&tries, 1, 1);
+    pvm_pkint(&state, 1, 1);
+    pvm_pkstr(arguments);
+    if (state == ST_FORK_ERR) {
+        remove(emit_file);
+        pvm_pkdouble(&totalt, 1, 1);
+        return;
+    }
+    pvm_pkdouble(&difft, 1, 1);
+    pvm_pkdouble(&totalt, 1, 1);
+    pvm_pkint(&exit_code, 1, 1);
+    pvm_pkint(&stop_match, 1, 1);
+    // new tasks are only accepted from tasks that were not killed
+    if (state == 0 && emit_file[0] != '\0') {
+        packEmittedTasks(emit_file);
+    } else {
+        int no_tasks = 0;
+        pvm_pkint(&no_tasks, 1, 1);
+        remove(emit_file);
+    }
+    if (usage != NULL)
+        packUsage(usage);
+}
+
+/**
+ * Send the result of a task to the master
+ *
+ * Tasks that could not be started (ST_FORK_ERR) only report their state, the
+ * others also report their times, exit code and the tasks they emitted.
+ *
+ * \param[in] master     PVM id of the master
+ * \param[in] me         slave (or plugin slot) number
+ * \param[in] taskNumber task number
+ * \param[in] tries      tries performed for this task
+ * \param[in] state      state of the task
+ * \param[in] arguments  task arguments
+ * \param[in] difft      execution time of the task
+ * \param[in] totalt     execution time of all the tasks of this slave
+ * \param[in] exit_code  exit code of the task
+ * \param[in] stop_match 1 if the task satisfies the stop predicate
+ * \param[in] emit_file  file where the task emitted new tasks
+ * \param[in] usage      resources used by the task, for the ledger of the
+ *                       master (NULL if it keeps no ledger)
+ */
+static void sendResult(int master, int me, int taskNumber, int tries,
+                       int state, char *arguments, double difft, double totalt,
+                       int exit_code, int stop_match, char *emit_file,
+                       struct rusage *usage) {
+    packResult(me, taskNumber, tries, state, arguments, difft, totalt,
+               exit_code, stop_match, emit_file, usage);
+    pvm_send(master, MSG_RESULT);
+}
+
+/**
+ * Run the program of a task in a forked child (never returns)
+ *
+ * \param[in] task_argv  command line of the program
+ * \param[in] out_dir    output directory
+ * \param[in] taskNumber task number
+ * \param[in] flag_err   1 if stderr files are created
+ * \param[in] emit_file  file where the task can emit new tasks
+ * \param[in] out        pipes to the slave, if the output is streamed (NULL
+ *                       to write it to the task files)
+ * \param[in] cz         compressors of the task files (NULL to write them
+ *                       directly)
+ * \param[in] script     standard input of the program (-1 to inherit it)
+ */
+static void execTask(char **task_argv, char *out_dir, int taskNumber,
+                     int flag_err, char *emit_file, output_pipe *out,
+                     compressor *cz, int script) {
+    char output_file[BUFFER_SIZE];
+    sigset_t sigchld;
+    int fd;
+
+    // Own process group, so the master can kill the whole program
+    setpgid(0, 0);
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
+
+    // PARI and Octave read the script of the task from stdin
+    if (script >= 0)
+        dup2(script, 0); // dup2 clears close-on-exec
+
+    if (out != NULL) {
+        outputChild(out);
+        flag_err = 0; // stderr already goes to its pipe, if it is kept
+    } else if (cz != NULL) {
+        compressChild(cz);
+        flag_err = 0; // same for the compressor of stderr
+    } else {
+        // Move stdout to taskNumber_out.txt
+        sprintf(output_file, "%s/task%d_stdout.txt", out_dir, taskNumber);
+        fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        dup2(fd, 1);
+        close(fd);
+    }
+
+    // Move stderr to taskNumber_err.txt
+    if (flag_err) {
+        sprintf(output_file, "%s/task%d_stderr.txt", out_dir, taskNumber);
+        fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        dup2(fd, 2);
+        close(fd);
+    }
+
+    // Tell the program where it can emit new tasks
+    if (emit_file[0] != '\0')
+        setenv(EMIT_ENV, emit_file, 1);
+
+    execvp(task_argv[0], task_argv);
+    perror("ERROR:: child process");
+    _exit(127);
+}
+
+/**
+ * Directory of the files of a task, created if the output is sharded
+ *
+ * \param[out] task_dir   where the directory is stored
+ * \param[in]  out_dir    output directory
+ * \param[in]  taskNumber task number
+ * \param[in]  shard      1 if the output is sharded
+ */
+static void openTaskDir(char *task_dir, char *out_dir, int taskNumber,
+                        int shard) {
+    if (taskDir(task_dir, out_dir, taskNumber, shard, 1) != 0)
+        fprintf(stderr, "%-20s - Cannot create %s for task %d\n",
+                "[WARNING]", task_dir, taskNumber);
+}
+
+/**
+ * Offer idle slots to the master, all of them in one message
+ *
+ * \param[in] master PVM id of the master
+ * \param[in] slots  slot numbers
+ * \param[in] n      number of slots (nothing is sent if 0)
+ */
+static void sendReady(int master, int *slots, int n) {
+    if (n == 0)
+        return;
+    pvm_initsend(PVM_ENCODING);
+    pvm_pkint(&n, 1, 1);
+    pvm_pkint(slots, n, 1);
+    pvm_send(master, MSG_READY);
+}
+
+/**
+ * Run tasks in a C plugin (program type 6) until the master stops us
+ *
+ * The slave offers nSlots slots to the master, numbered firstSlot+k, and
+ * runs the batches of tasks it receives in a pool of threads (or of
+ * processes, if isolate). The plugin is loaded when the first task arrives,
+ * since the master only sends the program name along with the tasks.
+ *
+ * \param[in] master        PVM id of the master
+ * \param[in] firstSlot     number of the first slot of this slave
+ * \param[in] nSlots        number of slots of this slave
+ * \param[in] isolate       1 to run the tasks in separate processes
+ * \param[in] batchSize     max number of tasks sent at once to a slot
+ * \param[in] max_task_size max size of a task in KB (0 for generic check)
+ * \param[in] flag_err      1 if stderr files are created
+ * \param[in] flag_mem      1 if memory files are created
+ * \param[in] stop_mode     STOP_NONE, STOP_REGEX or STOP_EXIT
+ * \param[in] stop_code     exit code that stops the execution
+ * \param[in] stop_re       regular expression that stops the execution
+ * \param[in] flag_ledger   1 if the master keeps a resource ledger
+ * \param[in] shard         1 if the output is sharded
+ * \param[in] fc            node-local copies of the files
+ * \param[in] emit_dir      directory of the emit files
+ */
+static void pluginLoop(int master, int firstSlot, int nSlots, int isolate,
+                       int batchSize, long int max_task_size, int flag_err,
+                       int flag_mem, int stop_mode, int stop_code,
+                       regex_t *stop_re, int flag_ledger, int shard,
+                       file_cache *fc, char *emit_dir) {
+    pool pl;
+    int loaded = 0; // 1 if loaded, -1 if the plugin cannot be loaded
+    int slotN[nSlots], offered[nSlots];  // tasks running in each slot
+    pool_job *slotJobs[nSlots];          // batch running in each slot
+    int *slotTries[nSlots];              // tries of each task of the batch
+    struct timespec slotStart[nSlots];
+    pool_result *res;
+    char program[FNAME_SIZE];
+    int *pvmFds, nPvmFds, nFds, nRunning = 0;
+    struct pollfd fds[nSlots + 8];
+    int fdSlot[nSlots + 8];
+    int bufid, msgbytes, msgtag, msgtid;
+    int work_code, more, slot, victim, state, stop_match, nOffers;
+    int offers[nSlots];
+    int i, j, k, n, timeout, stop = 0;
+    struct timespec now, diff;
+    double difft, totalt = 0;
+    pool_job *job, first;
+    int firstTries;
+
+    res = (pool_result *)malloc(batchSize * sizeof(pool_result));
+    for (k = 0; k < nSlots; k++) {
+        slotN[k] = 0;
+        offered[k] = 0;
+        slotJobs[k] = (pool_job *)malloc(batchSize * sizeof(pool_job));
+        slotTries[k] = (int *)malloc(batchSize * sizeof(int));
+    }
+    while (!stop) {
+        // Offer the idle slots to the master while there is memory
+        timeout = -1;
+        nOffers = 0;
+        for (k = 0; k < nSlots; k++) {
+            if (offered[k] || slotN[k] > 0)
+                continue;
+            if (memcheck(max_task_size > 0, max_task_size, 0) != 0) {
+                timeout = 1000;
+                break;
+            }
+            offers[nOffers++] = firstSlot + k;
+            offered[k] = 1;
+        }
+        sendReady(master, offers, nOffers);
+
+        // Handle every message that already arrived
+        while (!stop && (bufid = pvm_nrecv(master, -1)) > 0) {
+            pvm_bufinfo(bufid, &msgbytes, &msgtag, &msgtid);
+            if (msgtag == MSG_STOP) {
+                stop = 1;
+            } else if (msgtag == MSG_KILL) {
+                pvm_upkint(&victim, 1, 1);
+                for (k = 0; k < nSlots; k++) {
+                    for (i = 0; i < slotN[k]; i++)
+                        if (slotJobs[k][i].taskNumber == victim)
+                            break;
+                    if (i == slotN[k])
+                        continue;
+                    if (poolKill(&pl, k) != 0)
+                        fprintf(stderr,
+                                "%-20s - Task %d runs in a thread and cannot "
+                                "be killed (use --plugin-isolation)\n",
+                                "[WARNING]", victim);
+                }
+            } else if (msgtag == MSG_WORK) {
+                pvm_upkint(&work_code, 1, 1);
+                if (work_code == MSG_STOP) {
+                    stop = 1;
+                    continue;
+                }
+                // first task, slot, and the rest of the batch
+                pvm_upkint(&first.taskNumber, 1, 1);
+                pvm_upkint(&firstTries, 1, 1);
+                pvm_upkstr(program);
+                pvm_upkstr(first.out_dir);
+                pvm_upkstr(first.args);
+                pvm_upkint(&slot, 1, 1);
+                k = slot - firstSlot;
+                slotJobs[k][0] = first;
+                slotTries[k][0] = firstTries;
+                // each further task of the batch is preceded by a nonzero int
+                for (n = 1; n < batchSize; n++) {
+                    pvm_upkint(&more, 1, 1);
+                    if (!more)
+                        break;
+                    pvm_upkint(&slotJobs[k][n].taskNumber, 1, 1);
+                    pvm_upkint(&slotTries[k][n], 1, 1);
+                    pvm_upkstr(slotJobs[k][n].args);
+                }
+                offered[k] = 0;
+                cacheLookup(fc, program);
+                if (loaded == 0)
+                    loaded = poolOpen(&pl, program, nSlots, isolate) == 0
+                                 ? 1
+                                 : -1;
+                for (i = 0; i < n; i++) {
+                    job = &slotJobs[k][i];
+                    slotTries[k][i]++;
+                    job->flag_err = flag_err;
+                    openTaskDir(job->out_dir, first.out_dir, job->taskNumber,
+                                shard);
+                    if (createEmitFile(job->emit_file, emit_dir,
+                                       job->taskNumber) != 0)
+                        job->emit_file[0] = '\0';
+                }
+                clock_gettime(CLOCK_REALTIME, &slotStart[k]);
+                if (loaded < 0 || poolSubmit(&pl, k, slotJobs[k], n) != 0) {
+                    for (i = 0; i < n; i++) {
+                        job = &slotJobs[k][i];
+                        fprintf(stderr,
+                                "ERROR - task %d could not be run in the "
+                                "plugin\n",
+                                job->taskNumber);
+                        sendResult(master, slot, job->taskNumber,
+                                   slotTries[k][i], ST_FORK_ERR, job->args, 0,
+                                   totalt, 0, 0, job->emit_file, NULL);
+                    }
+                    continue;
+                }
+                slotN[k] = n;
+                nRunning++;
+            }
+        }
+        if (stop)
+            break;
+
+        // Wait for the master or for a slot to finish
+        nFds = 0;
+        nPvmFds = pvm_getfds(&pvmFds);
+        for (i = 0; i < nPvmFds && i < 8; i++) {
+            fds[nFds].fd = pvmFds[i];
+            fds[nFds].events = POLLIN;
+            fdSlot[nFds++] = -1;
+        }
+        for (k = 0; k < nSlots && nRunning > 0; k++) {
+            if (slotN[k] == 0)
+                continue;
+            fds[nFds].fd = pl.slots[k].done_fd;
+            fds[nFds].events = POLLIN;
+            fdSlot[nFds++] = k;
+        }
+        if (poll(fds, nFds, timeout) <= 0)
+            continue;
+
+        for (j = 0; j < nFds; j++) {
+            if (fdSlot[j] < 0 || fds[j].revents == 0)
+                continue;
+            k = fdSlot[j];
+            n = slotN[k];
+            poolCollect(&pl, k, res, n);
+            slotN[k] = 0;
+            nRunning--;
+
+            // the tasks of a batch share its time
+            clock_gettime(CLOCK_REALTIME, &now);
+            timespec_subtract(&diff, &now, &slotStart[k]);
+            difft = (diff.tv_sec + diff.tv_nsec * 1e-9) / n;
+            for (i = 0; i < n; i++) {
+                job = &slotJobs[k][i];
+                state = res[i].state;
+                if (state == ST_FORK_ERR) {
+                    fprintf(stderr,
+                            "ERROR - task %d could not open its output "
+                            "files\n",
+                            job->taskNumber);
+                    sendResult(master, firstSlot + k, job->taskNumber,
+                               slotTries[k][i], state, job->args, 0, totalt,
+                               0, 0, job->emit_file, NULL);
+                    continue;
+                }
+                totalt += difft;
+                if (state == ST_TASK_KILLED)
+                    prterror(getpid(), job->taskNumber, job->out_dir, difft);
+                else if (state == 0 && flag_mem)
+                    prtusage(isolate ? pl.slots[k].pid : getpid(),
+                             job->taskNumber, job->out_dir, res[i].usage);
+                stop_match = stopMatch(stop_mode, stop_code, stop_re, state,
+                                       res[i].exit_code, job->out_dir,
+                                       job->taskNumber, NULL);
+                sendResult(master, firstSlot + k, job->taskNumber,
+                           slotTries[k][i], state, job->args, difft, totalt,
+                           res[i].exit_code, stop_match, job->emit_file,
+                           flag_ledger ? &res[i].usage : NULL);
+            }
+        }
+    }
+    if (loaded > 0)
+        poolClose(&pl);
+    for (k = 0; k < nSlots; k++) {
+        free(slotJobs[k]);
+        free(slotTries[k]);
+    }
+    free(res);
+}
+
+/* A task slot of a node agent */
+typedef struct agent_slot_ {
+    int taskNumber;             // task running in the slot (-1 if idle)
+    int tries;                  // tries of the task, this one included
+    int offered;                // 1 if offered to the master
+    int cancelled;              // 1 if the master asked us to kill the task
+    char args[BUFFER_SIZE];     // arguments of the task
+    char emit_file[FNAME_SIZE]; // where the task can emit new tasks
+    char dir[FNAME_SIZE];       // directory of the files of the task
+    pid_t pid;                  // program of the task
+    int pidfd;                  // pidfd of the program (-1 to use SIGCHLD)
+    struct timespec start;      // start of the task
+    int in_cgroup;              // 1 if the task runs in its own cgroup
+    cgroup cg;                  // cgroups of the slot
+    int sampling;               // 1 if the task is sampled
+    sampler smp;
+    int compressing;            // 1 if the task files are compressed
+    compressor cz;
+} agent_slot;
+
+/* pidfd of a child, readable when it ends (-1 if the kernel has none) */
+static int pidfdOpen(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+/* Resident size of a process (KB, 0 if it is gone) */
+static long processRss(pid_t pid) {
+    FILE *f;
+    char fname[64];
+    long pages = 0;
+
+    snprintf(fname, 64, "/proc/%d/statm", (int)pid);
+    if ((f = fopen(fname, "r")) == NULL)
+        return 0;
+    if (fscanf(f, "%*d %ld", &pages) != 1)
+        pages = 0;
+    fclose(f);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Run every task slot of the node in this slave until the master stops us
+ *
+ * The slots are offered to the master, numbered firstSlot+k, while the node
+ * has memory for another task. The memory check counts what the tasks
+ * already started will still allocate (up to max_task_size, or the largest
+ * task seen so far), so tasks started at the same time cannot all see the
+ * same free memory. Programs run as children of this slave, and their ends
+ * are noticed through pidfds (or SIGCHLD, with older kernels) in the same
+ * epoll set as the connection to the master.
+ *
+ * \param[in] master        PVM id of the master
+ * \param[in] firstSlot     number of the first slot of this slave
+ * \param[in] nSlots        number of slots of this slave
+ * \param[in] tpl           launcher of the programs
+ * \param[in] launcher      LAUNCH_FORK or LAUNCH_SPAWN
+ * \param[in] custom_path   custom path of the program (NULL for default)
+ * \param[in] cores         threads each program may start
+ * \param[in] pin_mode      PIN_NONE, or how each program is pinned to the
+ *                          CPUs of its slot
+ * \param[in] max_task_size max size of a task in KB (0 for generic check)
+ * \param[in] flag_err      1 if stderr files are created
+ * \param[in] flag_mem      1 if memory files are created
+ * \param[in] stop_mode     STOP_NONE, STOP_REGEX or STOP_EXIT
+ * \param[in] stop_code     exit code that stops the execution
+ * \param[in] stop_re       regular expression that stops the execution
+ * \param[in] flag_ledger   1 if the master keeps a resource ledger
+ * \param[in] cg            cgroups of the slave (NULL to run without them)
+ * \param[in] cgroup_cores  CPU limit of each task cgroup (0 for none)
+ * \param[in] sample_interval ms between samples of each task (0 for none)
+ * \param[in] task_type     program type
+ * \param[in] shard         1 if the output is sharded
+ * \param[in] compress_mode COMPRESS_NONE, or how the task files are
+ *                          compressed
+ * \param[in] compress_level compression level (0 for the default)
+ * \param[in] fc            node-local copies of the files
+ * \param[in] emit_dir      directory of the emit files
+ */
+static void agentLoop(int master, int firstSlot, int nSlots, launch_tpl *tpl,
+                      int launcher, char *custom_path, int cores, int pin_mode,
+                      long int max_task_size, int flag_err, int flag_mem,
+                      int stop_mode, int stop_code, regex_t *stop_re,
+                      int flag_ledger, cgroup_ptr cg, int cgroup_cores,
+                      int sample_interval, int task_type, int shard,
+                      int compress_mode, int compress_level,
+                      file_cache *fc, char *emit_dir) {
+    agent_slot *slots;
+    agent_slot *sl;
+    char program[FNAME_SIZE], out_dir[FNAME_SIZE];
+    char arguments[BUFFER_SIZE];
+    char placement[BUFFER_SIZE];
+    char **task_argv;
+    int offers[nSlots];
+    char ended[nSlots];
+    struct epoll_event ev, events[nSlots + 8];
+    struct signalfd_siginfo si;
+    struct timespec now, diff;
+    struct rusage usage;
+    cgroup_usage cgu;
+    sigset_t sigchld;
+    int *pvmFds, nPvmFds, epfd, sigfd;
+    int bufid, msgbytes, msgtag, msgtid;
+    int work_code, taskNumber, tries, slot, victim, state, exit_code;
+    int stop_match, status, nOffers, nEvents, scan;
+    int i, k, script, timeout, stop = 0;
+    long peak = 0, estimate, reserved, rss;
+    double difft, totalt = 0, compress_cpu = 0;
+    pid_t pid;
+
+    // the slave already blocks SIGCHLD, so it can be read from a signalfd
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (sigfd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "%-20s - Node agent cannot wait for its tasks\n",
+                "[ERROR]");
+        return;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = nSlots;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+    nPvmFds = pvm_getfds(&pvmFds);
+    for (i = 0; i < nPvmFds; i++) {
+        ev.data.u32 = nSlots + 1;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, pvmFds[i], &ev);
+    }
+
+    slots = (agent_slot *)calloc(nSlots, sizeof(agent_slot));
+    for (k = 0; k < nSlots; k++) {
+        slots[k].taskNumber = -1;
+        slots[k].pidfd = -1;
+        if (cg != NULL)
+            slots[k].cg = *cg;
+    }
+
+    while (!stop) {
+        // Memory that the tasks offered or started will still allocate
+        estimate = max_task_size > 0 ? max_task_size : peak;
+        reserved = 0;
+        for (k = 0; k < nSlots; k++) {
+            if (slots[k].offered) {
+                reserved += estimate;
+            } else if (slots[k].taskNumber >= 0 && slots[k].pid > 0) {
+                rss = processRss(slots[k].pid);
+                if (rss < estimate)
+                    reserved += estimate - rss;
+            }
+        }
+
+        // Offer the idle slots to the master while there is memory
+        timeout = -1;
+        nOffers = 0;
+        for (k = 0; k < nSlots; k++) {
+            if (slots[k].offered || slots[k].taskNumber >= 0)
+                continue;
+            if (memcheck(max_task_size > 0, max_task_size, reserved) != 0) {
+                timeout = 1000;
+                break;
+            }
+            offers[nOffers++] = firstSlot + k;
+            slots[k].offered = 1;
+            reserved += estimate;
+        }
+        sendReady(master, offers, nOffers);
+
+        // Handle every message that already arrived
+        while (!stop && (bufid = pvm_nrecv(master, -1)) > 0) {
+            pvm_bufinfo(bufid, &msgbytes, &msgtag, &msgtid);
+            if (msgtag == MSG_STOP) {
+                stop = 1;
+            } else if (msgtag == MSG_KILL) {
+                pvm_upkint(&victim, 1, 1);
+                for (k = 0; k < nSlots; k++) {
+                    sl = &slots[k];
+                    if (sl->taskNumber == victim && sl->pid > 0 &&
+                        !sl->cancelled) {
+                        kill(-sl->pid, SIGKILL);
+                        sl->cancelled = 1;
+                    }
+                }
+            } else if (msgtag == MSG_WORK) {
+                pvm_upkint(&work_code, 1, 1);
+                if (work_code == MSG_STOP) {
+                    stop = 1;
+                    continue;
+                }
+                pvm_upkint(&taskNumber, 1, 1);
+                pvm_upkint(&tries, 1, 1);
+                pvm_upkstr(program);
+                pvm_upkstr(out_dir);
+                pvm_upkstr(arguments);
+                pvm_upkint(&slot, 1, 1);
+                sl = &slots[k = slot - firstSlot];
+                sl->offered = 0;
+                sl->cancelled = 0;
+                sl->taskNumber = taskNumber;
+                sl->tries = tries + 1;
+                strcpy(sl->args, arguments);
+                // the program runs with the local copies of the files
+                cacheLookup(fc, program);
+                cacheArgs(fc, sl->args, arguments);
+                if (createEmitFile(sl->emit_file, emit_dir, taskNumber) != 0)
+                    sl->emit_file[0] = '\0';
+                openTaskDir(sl->dir, out_dir, taskNumber, shard);
+                clock_gettime(CLOCK_REALTIME, &sl->start);
+
+                task_argv = launchArgv(tpl, taskNumber, program, arguments,
+                                       sl->dir, custom_path, cores);
+                sl->compressing = compress_mode != COMPRESS_NONE &&
+                                  compressStart(&sl->cz, compress_mode,
+                                                compress_level, sl->dir,
+                                                taskNumber, flag_err) == 0;
+                // the child moves itself to the cgroup before exec
+                sl->in_cgroup = cg != NULL &&
+                                cgroupCreate(&sl->cg, taskNumber,
+                                             max_task_size,
+                                             cgroup_cores) == 0;
+                // a script that cannot be written fails like a fork
+                if (taskScript(task_type, taskNumber, arguments, program,
+                               &script) != 0)
+                    pid = -1;
+                else
+                    pid = launcher == LAUNCH_SPAWN
+                              ? spawnProcess(task_argv, sl->dir, taskNumber,
+                                             flag_err, sl->emit_file, script)
+                              : fork();
+                if (pid == 0) {
+                    if (sl->in_cgroup)
+                        cgroupJoin(&sl->cg);
+                    // each program gets the CPUs of its own slot
+                    if (pin_mode != PIN_NONE &&
+                        pinSlot(pin_mode, k, nSlots, placement) != 0)
+                        fprintf(stderr,
+                                "%-20s - Task %d could not be pinned to "
+                                "its CPUs\n",
+                                "[WARNING]", taskNumber);
+                    execTask(task_argv, sl->dir, taskNumber, flag_err,
+                             sl->emit_file, NULL,
+                             sl->compressing ? &sl->cz : NULL, script);
+                }
+                // also done by the parent, so a kill never misses the group
+                if (pid > 0)
+                    setpgid(pid, pid);
+                if (script >= 0)
+                    close(script);
+                if (sl->compressing)
+                    compressStarted(&sl->cz);
+                freeArgv(task_argv);
+                if (pid < 0) {
+                    if (cg != NULL)
+                        cgroupFinish(&sl->cg, &cgu);
+                    if (sl->compressing)
+                        compressFinish(&sl->cz, 0);
+                    fprintf(stderr,
+                            "ERROR - task %d could not spawn execution "
+                            "process\n",
+                            taskNumber);
+                    sendResult(master, slot, taskNumber, sl->tries,
+                               ST_FORK_ERR, sl->args, 0, totalt, 0, 0,
+                               sl->emit_file, NULL);
+                    sl->taskNumber = -1;
+                    continue;
+                }
+                sl->pid = pid;
+                if ((sl->pidfd = pidfdOpen(pid)) >= 0) {
+                    ev.data.u32 = k;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, sl->pidfd, &ev);
+                }
+                sl->sampling = sample_interval > 0 &&
+                               samplerStart(&sl->smp, pid, sample_interval,
+                                            taskNumber, sl->dir,
+                                            sl->in_cgroup ? sl->cg.procs
+                                                          : NULL) == 0;
+            }
+        }
+        if (stop)
+            break;
+
+        // Wait for the master, for a program to end or for memory
+        nEvents = epoll_wait(epfd, events, nSlots + 8, timeout);
+        memset(ended, 0, nSlots);
+        scan = 0;
+        for (i = 0; i < nEvents; i++) {
+            if (events[i].data.u32 < (unsigned)nSlots) {
+                ended[events[i].data.u32] = 1;
+            } else if (events[i].data.u32 == (unsigned)nSlots) {
+                while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+                    ;
+                scan = 1;
+            }
+        }
+
+        for (k = 0; k < nSlots; k++) {
+            sl = &slots[k];
+            if (sl->pid <= 0 || !(ended[k] || (scan && sl->pidfd < 0)))
+                continue;
+            memset(&usage, 0, sizeof(struct rusage));
+            if (wait4(sl->pid, &status, WNOHANG, &usage) != sl->pid)
+                continue;
+            if (sl->sampling)
+                samplerStop(&sl->smp);
+            // the compressors end once they wrote what the program printed
+            if (sl->compressing) {
+                compressFinish(&sl->cz, sl->pid);
+                compress_cpu += compressCpu(&sl->cz);
+            }
+            if (sl->pidfd >= 0) {
+                close(sl->pidfd); // also leaves the epoll set
+                sl->pidfd = -1;
+            }
+            // the counters of the cgroup include the whole process tree
+            if (cg != NULL) {
+                if (cgroupFinish(&sl->cg, &cgu) == 0 && sl->in_cgroup)
+                    cgroupUsage(&cgu, &usage);
+                else
+                    sl->in_cgroup = 0;
+            }
+            exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+            if (sl->cancelled)
+                state = ST_TASK_CANCELLED;
+            else if (WIFSIGNALED(status))
+                state = ST_TASK_KILLED;
+            else
+                state = 0;
+
+            clock_gettime(CLOCK_REALTIME, &now);
+            timespec_subtract(&diff, &now, &sl->start);
+            difft = diff.tv_sec + diff.tv_nsec * 1e-9;
+            totalt += difft;
+            if (usage.ru_maxrss > peak)
+                peak = usage.ru_maxrss;
+            if (state == ST_TASK_KILLED) {
+                prterror(sl->pid, sl->taskNumber, sl->dir, difft);
+            } else if (state == 0 && flag_mem) {
+                prtusage(sl->pid, sl->taskNumber, sl->dir, usage);
+                if (sl->in_cgroup)
+                    cgroupPrint(&cgu, sl->taskNumber, sl->dir);
+                if (sl->compressing)
+                    compressPrint(&sl->cz, sl->taskNumber, sl->dir);
+            }
+            stop_match = stopMatch(stop_mode, stop_code, stop_re, state,
+                                   exit_code, sl->dir, sl->taskNumber, NULL);
+            sendResult(master, firstSlot + k, sl->taskNumber, sl->tries,
+                       state, sl->args, difft, totalt, exit_code, stop_match,
+                       sl->emit_file, flag_ledger ? &usage : NULL);
+            sl->taskNumber = -1;
+            sl->pid = 0;
+        }
+    }
+
+    if (compress_mode != COMPRESS_NONE)
+        fprintf(stderr,
+                "%-20s - Node agent spent %.3f s of CPU compressing the "
+                "output of its tasks\n",
+                "[INFO]", compress_cpu);
+    close(sigfd);
+    close(epfd);
+    free(slots);
+}
+
 /**
  * Main task function.
  *
@@ -49,7 +876,10 @@ int main(int argc, char *argv[]) {
     int work_code; // work_code is a flag that tells the child what to do
     char inp_programFile[FNAME_SIZE]; // name of the program
     char out_dir[FNAME_SIZE];         // name of output directory
+    char task_dir[FNAME_SIZE];        // directory of the files of the task
+    char work_dir[FNAME_SIZE];        // where the task writes them
     char arguments[BUFFER_SIZE]; // string of arguments as read from data file
+    char task_args[BUFFER_SIZE]; // the same with the cached input files
     int task_type;               // 0:maple, 1:C, 2:python
     long int max_task_size; // if given, max size in KB of a spawned process
     int flag_err;           // 0=no err files, 1=yes err files
@@ -61,7 +891,67 @@ int main(int argc, char *argv[]) {
     double difft, totalt = 0;
     long int sec, nsec;
     int state;
-    int mcheck; // error status of memory file check
+    int exit_code; // exit status of the program (0 if killed)
+    int script;    // stdin of PARI and Octave programs (-1 for others)
+    int mcheck;    // error status of memory file check
+    char emit_dir[FNAME_SIZE];  // private directory of the emit files
+    char emit_file[FNAME_SIZE]; // where the task can write new tasks
+    int stop_mode;              // STOP_NONE, STOP_REGEX or STOP_EXIT
+    int stop_code;              // exit code that stops the execution
+    char stop_regex[BUFFER_SIZE];
+    regex_t stop_re;
+    int stop_match;     // 1 if the task satisfies the stop predicate
+    int cancelled;      // 1 if the master asked us to kill the task
+    sigset_t sigchld;
+    int worker_mode;    // WORKER_FORK, WORKER_PERSISTENT or WORKER_ZYGOTE
+    int worker_recycle; // tasks per persistent interpreter
+    int slots;          // tasks run at once by this slave
+    int plugin_isolate; // 1 if plugin tasks run in their own process
+    int batch_size;     // max plugin tasks received at once by a slot
+    int launcher;       // LAUNCH_FORK or LAUNCH_SPAWN
+    char launch_exe[FNAME_SIZE];   // default executable of the launcher
+    char launch_tmpl[BUFFER_SIZE]; // command line template of the launcher
+    launch_tpl tpl;
+    char **task_argv = NULL;
+    int cgroup_cores;   // -1 without cgroups, else CPU limit (0 for none)
+    int in_cgroup = 0;  // 1 if the current task runs in its own cgroup
+    cgroup cg;
+    cgroup_usage cgu;
+    int sample_interval; // ms between samples of the task (0 for none)
+    int flag_ledger;     // 1 if the master keeps a resource ledger
+    int pin_mode;        // PIN_NONE, PIN_THREADS or PIN_CORES
+    int node_slave, node_slaves; // this slave and the slaves of its node
+    int task_cores;      // cores of a task slot (0 for all of the slave's)
+    int cores;           // threads each program may start
+    int node_agent;      // 1 if this slave runs every slot of its node
+    int first_slot;      // number of the first slot of this slave
+    int work_stealing;   // 1 if tasks come from a local queue
+    steal_queue sq;
+    int output_mode;     // OUTPUT_FILES, OUTPUT_STREAM or OUTPUT_ARCHIVE
+    int shard_output;    // 1 if the files of each task go to its shard
+    int compress_mode;   // COMPRESS_NONE, COMPRESS_GZIP or COMPRESS_ZSTD
+    int compress_level;  // compression level (0 for the default)
+    compressor cz;
+    int compressing = 0; // 1 if the files of this task are compressed
+    double compress_cpu = 0; // CPU time of the compressors of every task
+    char scratch[FNAME_SIZE]; // node-local directory (empty for none)
+    char cache_dir[FNAME_SIZE]; // node-local cache (empty for none)
+    long int cache_size;        // max size of the cache in bytes
+    file_cache fc = {0, NULL};
+    stager stg;
+    int staging = 0;     // 1 if the tasks write to the scratch directory
+    int in_scratch = 0;  // 1 if this task writes to the scratch directory
+    struct timeval tmout;
+    output_pipe out;
+    int streaming = 0;   // 1 if the output of this task is streamed
+    size_t kept;         // length of the stdout kept for the stop predicate
+    slave_wait sw;
+    struct rusage no_usage; // ledger entry of tasks that never ran
+    char placement[BUFFER_SIZE];
+    sampler smp;
+    worker wk;
+    pid_t pid = -1;
+    struct rusage usage;
 
     myparent = pvm_parent();
 
@@ -77,6 +967,93 @@ int main(int argc, char *argv[]) {
         pvm_upkstr(custom_path);
         custom_path_ptr = &custom_path[0];
     }
+    pvm_upkint(&stop_mode, 1, 1);
+    if (stop_mode == STOP_REGEX) {
+        pvm_upkstr(stop_regex);
+        if (regcomp(&stop_re, stop_regex,
+                    REG_EXTENDED | REG_NEWLINE | REG_NOSUB) != 0)
+            stop_mode = STOP_NONE; // the master already checked it
+    } else if (stop_mode == STOP_EXIT) {
+        pvm_upkint(&stop_code, 1, 1);
+    }
+    pvm_upkint(&worker_mode, 1, 1);
+    pvm_upkint(&worker_recycle, 1, 1);
+    pvm_upkint(&slots, 1, 1);
+    pvm_upkint(&plugin_isolate, 1, 1);
+    pvm_upkint(&batch_size, 1, 1);
+    pvm_upkint(&launcher, 1, 1);
+    pvm_upkstr(launch_exe);
+    pvm_upkstr(launch_tmpl);
+    if (task_type != 6 && worker_mode == WORKER_FORK &&
+        launchCompile(launch_exe, launch_tmpl, &tpl) != 0)
+        tpl.nWords = 0; // the master already checked it
+    pvm_upkint(&cgroup_cores, 1, 1);
+    pvm_upkint(&sample_interval, 1, 1);
+    pvm_upkint(&flag_ledger, 1, 1);
+    pvm_upkint(&pin_mode, 1, 1);
+    pvm_upkint(&node_slave, 1, 1);
+    pvm_upkint(&node_slaves, 1, 1);
+    pvm_upkint(&task_cores, 1, 1);
+    pvm_upkint(&node_agent, 1, 1);
+    pvm_upkint(&first_slot, 1, 1);
+    pvm_upkint(&work_stealing, 1, 1);
+    pvm_upkint(&output_mode, 1, 1);
+    pvm_upkint(&shard_output, 1, 1);
+    pvm_upkint(&compress_mode, 1, 1);
+    pvm_upkint(&compress_level, 1, 1);
+    pvm_upkstr(scratch);
+    if (scratch[0] != '\0' && !(staging = stageInit(&stg, scratch) == 0))
+        fprintf(stderr,
+                "%-20s - Slave %d cannot use the scratch directory %s, its "
+                "tasks write to the output directory\n",
+                "[WARNING]", me, scratch);
+    pvm_upkstr(cache_dir);
+    if (cache_dir[0] != '\0') {
+        pvm_upklong(&cache_size, 1, 1);
+        // copies of Python programs still import the modules next to them
+        cacheUnpack(&fc, cache_dir, cache_size,
+                    task_type == 2 ? "PYTHONPATH" : NULL);
+    }
+    if (work_stealing && stealInit(&sq, myparent, me) != 0) {
+        fprintf(stderr, "%-20s - Slave %d did not get the list of its peers\n",
+                "[ERROR]", me);
+        pvm_exit();
+        exit(E_PVM_PARENT);
+    }
+    memset(&no_usage, 0, sizeof(struct rusage));
+    if (createEmitDir(emit_dir) != 0)
+        fprintf(stderr,
+                "%-20s - Slave %d cannot create a directory in %s, its tasks "
+                "cannot emit new tasks\n",
+                "[WARNING]", me, P_tmpdir);
+    // programs inherit the CPUs and memory policy of the slave (a node agent
+    // pins each program to its slot instead)
+    if (pin_mode != PIN_NONE && !node_agent &&
+        pinSlot(pin_mode, node_slave, node_slaves, placement) != 0)
+        fprintf(stderr, "%-20s - Slave %d could not be pinned to its CPUs\n",
+                "[WARNING]", me);
+    // thread pools of the programs are sized to their slot
+    cores = task_cores > 0 ? task_cores
+                           : pinCpus() / (node_agent ? slots : 1);
+    if (cores < 1)
+        cores = 1;
+    if (task_cores > 0)
+        pinThreadEnv(task_cores);
+    if (cgroup_cores >= 0 && cgroupInit(&cg) != 0) {
+        fprintf(stderr,
+                "%-20s - Cannot create cgroups under %s, tasks run without "
+                "them\n",
+                "[WARNING]", CGROUP_ROOT);
+        cgroup_cores = -1;
+    }
+    if (worker_mode != WORKER_FORK)
+        workerInit(&wk, worker_mode, task_type, custom_path_ptr, emit_file,
+                   cores);
+
+    // SIGCHLD wakes us up when a child ends (see waitChild)
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
 
     /* Perform generic check or use specific size info?
      *  memcheck_flag = 0 means generic check
@@ -84,6 +1061,36 @@ int main(int argc, char *argv[]) {
      */
     int memcheck_flag = max_task_size > 0 ? 1 : 0;
 
+    // C plugins run inside this process
+    if (task_type == 6) {
+        pluginLoop(myparent, first_slot, slots, plugin_isolate, batch_size,
+                   max_task_size, flag_err, flag_mem, stop_mode, stop_code,
+                   &stop_re, flag_ledger, shard_output, &fc, emit_dir);
+        removeEmitDir(emit_dir);
+        if (stop_mode == STOP_REGEX)
+            regfree(&stop_re);
+        pvm_exit();
+        exit(0);
+    }
+
+    // One slave runs every slot of the node
+    if (node_agent) {
+        agentLoop(myparent, first_slot, slots, &tpl, launcher,
+                  custom_path_ptr, cores, pin_mode, max_task_size, flag_err,
+                  flag_mem, stop_mode, stop_code, &stop_re, flag_ledger,
+                  cgroup_cores >= 0 ? &cg : NULL, cgroup_cores,
+                  sample_interval, task_type, shard_output, compress_mode,
+                  compress_level, &fc, emit_dir);
+        removeEmitDir(emit_dir);
+        launchFree(&tpl);
+        if (cgroup_cores >= 0)
+            cgroupStop(&cg);
+        if (stop_mode == STOP_REGEX)
+            regfree(&stop_re);
+        pvm_exit();
+        exit(0);
+    }
+
     // Work work work work work
     while (1) {
         /* Race condition. Mitigated by executing few CPUs on each node
@@ -91,119 +1098,199 @@ int main(int argc, char *argv[]) {
          *  both conclude that there is enough because they see the same
          *  output, but maybe there is not enough memory for 2 tasks.
          */
-        if ((mcheck = memcheck(memcheck_flag, max_task_size)) != 0) {
+        if ((mcheck = memcheck(memcheck_flag, max_task_size, 0)) != 0) {
             /* if memcheck fails, return to master to try another node */
+            if (work_stealing)
+                stealServe(&sq);
+            if (staging)
+                stageFlush(&stg, myparent, 0);
             sleep(1);
             continue;
         }
 
-        // send ready message
-        pvm_initsend(PVM_ENCODING);
-        pvm_pkint(&me, 1, 1);
-        pvm_send(myparent, MSG_READY);
+        if (work_stealing) {
+            // every result is sent before the slave asks its peers for work
+            if (staging)
+                stageFlush(&stg, myparent, sq.head == NULL ? 2 : 1);
+            // next task of the local queue, or of a peer
+            if (!stealNext(&sq, &taskNumber, &tries, arguments))
+                break;
+            strcpy(inp_programFile, sq.program);
+            strcpy(out_dir, sq.out_dir);
+            if (sq.cancelled) {
+                emit_file[0] = '\0';
+                sendResult(myparent, me, taskNumber, tries + 1,
+                           ST_TASK_CANCELLED, arguments, 0, totalt, 0, 0,
+                           emit_file, flag_ledger ? &no_usage : NULL);
+                continue;
+            }
+        } else {
+            // send ready message
+            if (staging)
+                stageFlush(&stg, myparent, 1);
+            sendReady(myparent, &me, 1);
 
-        // Receive inputs
-        pvm_recv(myparent, MSG_WORK);
-        pvm_upkint(&work_code, 1, 1);
-        if (work_code == MSG_STOP) // if master tells task to shutdown
-            break;
-        pvm_upkint(&taskNumber, 1, 1);
-        pvm_upkint(&tries, 1, 1);
-        pvm_upkstr(inp_programFile);
-        pvm_upkstr(out_dir);
-        pvm_upkstr(arguments); // string of comma-separated arguments read from
-                               // datafile
+            // Receive inputs, sending the results staged meanwhile
+            if (staging) {
+                tmout.tv_sec = WAIT_POLL_MS / 1000;
+                tmout.tv_usec = (WAIT_POLL_MS % 1000) * 1000;
+                while (pvm_trecv(myparent, MSG_WORK, &tmout) == 0)
+                    stageFlush(&stg, myparent, 0);
+            } else {
+                pvm_recv(myparent, MSG_WORK);
+            }
+            pvm_upkint(&work_code, 1, 1);
+            if (work_code == MSG_STOP) // if master tells task to shutdown
+                break;
+            pvm_upkint(&taskNumber, 1, 1);
+            pvm_upkint(&tries, 1, 1);
+            pvm_upkstr(inp_programFile);
+            pvm_upkstr(out_dir);
+            pvm_upkstr(arguments); // string of comma-separated arguments read
+                                   // from datafile
+        }
         tries++;
+        // the program runs with the local copies of the files
+        cacheLookup(&fc, inp_programFile);
+        cacheArgs(&fc, arguments, task_args);
+        openTaskDir(task_dir, out_dir, taskNumber, shard_output);
+        // the files of the task are written to the scratch directory, and
+        // moved to the task directory once it ends
+        in_scratch = staging && stageTaskDir(&stg, work_dir, taskNumber) == 0;
+        if (in_scratch) {
+            setenv(SCRATCH_ENV, work_dir, 1);
+        } else {
+            strcpy(work_dir, task_dir);
+            unsetenv(SCRATCH_ENV);
+        }
+        // persistent interpreters and zygotes get the emit file name only once,
+        // so the name cannot depend on the task
+        if (createEmitFile(emit_file, emit_dir,
+                           worker_mode == WORKER_FORK ? taskNumber : 0) != 0)
+            emit_file[0] = '\0';
         clock_gettime(CLOCK_REALTIME, &tspec_before);
 
         /* Fork one process that will do the execution
          * the "parent task" will only wait for this process to end
          * and then report resource usage via getrusage()
          */
-        pid_t pid = fork();
-        // If fork fails, notify master and exit
-        if (pid < 0) {
+        // the command line is built here, the child only execs it
+        if (worker_mode == WORKER_FORK)
+            task_argv = launchArgv(&tpl, taskNumber, inp_programFile,
+                                   task_args, work_dir,
+                                   custom_path_ptr, cores);
+        // the output goes through pipes, or to the task files if they fail
+        streaming = worker_mode == WORKER_FORK &&
+                    output_mode != OUTPUT_FILES &&
+                    outputPipes(&out, myparent, taskNumber, tries,
+                                flag_err, stop_mode == STOP_REGEX) == 0;
+        // or through compressors, or to the task files if they fail
+        compressing = worker_mode == WORKER_FORK &&
+                      compress_mode != COMPRESS_NONE &&
+                      compressStart(&cz, compress_mode, compress_level,
+                                    work_dir, taskNumber, flag_err) == 0;
+        // the child moves itself to the cgroup before exec
+        in_cgroup = cgroup_cores >= 0 &&
+                    cgroupCreate(&cg, taskNumber, max_task_size,
+                                 cgroup_cores) == 0;
+        if (worker_mode != WORKER_FORK) {
+            state = workerRun(&wk, taskNumber, inp_programFile, task_args,
+                              work_dir, flag_err, myparent, &exit_code,
+                              &usage);
+            pid = wk.task_pid;
+        } else if (taskScript(task_type, taskNumber, task_args,
+                              inp_programFile, &script) != 0 ||
+                   (pid = launcher == LAUNCH_SPAWN
+                              ? spawnProcess(task_argv, work_dir, taskNumber,
+                                             flag_err, emit_file, script)
+                              : fork()) < 0) {
+            if (script >= 0)
+                close(script);
+            state = ST_FORK_ERR;
+        } else if (pid == 0) {
+            // Child code (work done here)
+            if (in_cgroup)
+                cgroupJoin(&cg);
+            execTask(task_argv, work_dir, taskNumber, flag_err, emit_file,
+                     streaming ? &out : NULL, compressing ? &cz : NULL,
+                     script);
+        } else {
+            // Also set by the parent, so a kill before the child has run
+            // setpgid still reaches the group
+            setpgid(pid, pid);
+            if (script >= 0)
+                close(script);
+            if (streaming)
+                outputStarted(&out);
+            if (compressing)
+                compressStarted(&cz);
+            /* Attempt at measuring memory usage for the child process */
+            // Stores information about the child execution
+            siginfo_t infop;
+            int sampling = sample_interval > 0 &&
+                           samplerStart(&smp, pid, sample_interval,
+                                        taskNumber, work_dir,
+                                        in_cgroup ? cg.procs : NULL) == 0;
+            // Wait for the execution to end
+            sw.sq = work_stealing ? &sq : NULL;
+            sw.out = streaming ? &out : NULL;
+            sw.stg = staging ? &stg : NULL;
+            sw.master = myparent;
+            cancelled = waitChild(pid, &infop, &usage, myparent, taskNumber,
+                                  sw.sq != NULL || sw.out != NULL ||
+                                          sw.stg != NULL
+                                      ? serveWait
+                                      : NULL,
+                                  &sw);
+            // the master only cancels everything when stealing
+            if (cancelled && work_stealing)
+                stealCancel(&sq);
+            if (sampling)
+                samplerStop(&smp);
+            exit_code = infop.si_code == CLD_EXITED ? infop.si_status : 0;
+            if (cancelled)
+                state = ST_TASK_CANCELLED;
+            else if (infop.si_code == CLD_KILLED || infop.si_code == CLD_DUMPED)
+                state = ST_TASK_KILLED;
+            else
+                state = 0;
+        }
+
+        if (task_argv != NULL) {
+            freeArgv(task_argv);
+            task_argv = NULL;
+        }
+        // the output reaches the master before the result
+        if (streaming)
+            outputFinish(&out);
+        if (compressing) {
+            compressFinish(&cz, state == ST_FORK_ERR ? 0 : pid);
+            compress_cpu += compressCpu(&cz);
+        }
+        if (cgroup_cores >= 0) {
+            // the counters of the cgroup include the whole process tree
+            if (cgroupFinish(&cg, &cgu) == 0 && in_cgroup)
+                cgroupUsage(&cgu, &usage);
+            else
+                in_cgroup = 0;
+        }
+
+        // If the program could not be started, notify master
+        if (state == ST_FORK_ERR) {
             fprintf(stderr,
                     "ERROR - task %d could not spawn execution process\n",
                     taskNumber);
-            int state = ST_FORK_ERR;
-            pvm_initsend(PVM_ENCODING);
-            pvm_pkint(&me, 1, 1);
-            pvm_pkint(&taskNumber, 1, 1);
-            pvm_pkint(&tries, 1, 1);
-            pvm_pkint(&state, 1, 1);
-            pvm_pkstr(arguments);
-            pvm_pkdouble(&totalt, 1, 1);
-            pvm_send(myparent, MSG_RESULT);
-            continue;
-        }
-        // Child code (work done here)
-        if (pid == 0) {
-            char output_file[BUFFER_SIZE];
-
-            // Move stdout to taskNumber_out.txt
-            sprintf(output_file, "%s/task%d_stdout.txt", out_dir, taskNumber);
-            int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            dup2(fd, 1);
-            close(fd);
-
-            // Move stderr to taskNumber_err.txt
-            if (flag_err) {
-                sprintf(output_file, "%s/task%d_stderr.txt", out_dir,
-                        taskNumber);
-                fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-                dup2(fd, 2);
-                close(fd);
-            }
-
-            /*
-             * GENERATE EXECUTION OF PROGRAM
-             */
-            switch (task_type) {
-            case 0:
-                /* MAPLE */
-                mapleProcess(taskNumber, inp_programFile, arguments,
-                             custom_path_ptr);
-                perror("ERROR:: child Maple process");
-                break;
-            case 1:
-                /* C */
-                cProcess(taskNumber, inp_programFile, arguments,
-                         custom_path_ptr);
-                perror("ERROR:: child C process");
-                break;
-            case 2:
-                /* PYTHON */
-                pythonProcess(taskNumber, inp_programFile, arguments,
-                              custom_path_ptr);
-                perror("ERROR:: child Python process");
-                break;
-            case 3:
-                /* PARI/GP */
-                pariProcess(taskNumber, out_dir, custom_path_ptr);
-                perror("ERROR:: child PARI process");
-                break;
-            case 4:
-                /* SAGE */
-                sageProcess(taskNumber, out_dir, custom_path_ptr);
-                perror("ERROR:: child Sage process");
-                break;
-            case 5:
-                /* OCTAVE */
-                octaveProcess(taskNumber, out_dir, custom_path_ptr);
-                perror("ERROR:: child Octave process");
-                break;
-            default:
-                /* This should never happen */
+            if (in_scratch) {
+                packResult(me, taskNumber, tries, state, arguments, 0, totalt,
+                           0, 0, emit_file, NULL);
+                stageSubmit(&stg, work_dir, task_dir);
+            } else {
+                sendResult(myparent, me, taskNumber, tries, state, arguments,
+                           0, totalt, 0, 0, emit_file, NULL);
             }
+            continue;
         }
 
-        /* Attempt at measuring memory usage for the child process */
-        // Stores information about the child execution
-        siginfo_t infop;
-        // Wait for the execution to end
-        waitid(P_PID, pid, &infop, WEXITED);
-
         // Computation time
         clock_gettime(CLOCK_REALTIME, &tspec_after);
         timespec_subtract(&tspec_result, &tspec_after, &tspec_before);
@@ -212,32 +1299,85 @@ int main(int argc, char *argv[]) {
 
         difft = sec + nsec * 1e-9;
         totalt += difft;
-        if (infop.si_code == CLD_KILLED || infop.si_code == CLD_DUMPED) {
-            prterror(pid, taskNumber, out_dir,
+        if (streaming &&
+            (state == ST_TASK_KILLED || (state == 0 && flag_mem))) {
+            // the reports travel to the master with the output
+            char *report = NULL;
+            size_t len = 0;
+            FILE *f = open_memstream(&report, &len);
+            if (f != NULL) {
+                if (state == ST_TASK_KILLED) {
+                    fprterror(f, pid, taskNumber, difft);
+                } else {
+                    fprtusage(f, pid, taskNumber, usage);
+                    if (in_cgroup)
+                        cgroupReport(f, &cgu);
+                }
+                fclose(f);
+                outputReport(&out,
+                             state == ST_TASK_KILLED ? OUTPUT_KILLED
+                                                     : OUTPUT_MEM,
+                             report, len);
+                free(report);
+            }
+        } else if (state == ST_TASK_KILLED) {
+            prterror(pid, taskNumber, work_dir,
                      difft); // this could fail silently
-            state = ST_TASK_KILLED;
-        } else if (flag_mem) {
-            struct rusage
-                usage; // Stores information about the child's resource usage
-            getrusage(RUSAGE_CHILDREN, &usage); // Get child resource usage
-            prtusage(pid, taskNumber, out_dir,
+        } else if (state == 0 && flag_mem) {
+            prtusage(pid, taskNumber, work_dir,
                      usage); // Print resource usage to file
-            state = 0;
+            if (in_cgroup)
+                cgroupPrint(&cgu, taskNumber, work_dir);
+            if (compressing)
+                compressPrint(&cz, taskNumber, work_dir);
         }
 
-        // Send response to master
-        pvm_initsend(PVM_ENCODING);
-        pvm_pkint(&me, 1, 1);
-        pvm_pkint(&taskNumber, 1, 1);
-        pvm_pkint(&tries, 1, 1);
-        pvm_pkint(&state, 1, 1);
-        pvm_pkstr(arguments);
-        pvm_pkdouble(&difft, 1, 1);
-        pvm_pkdouble(&totalt, 1, 1);
-        pvm_send(myparent, MSG_RESULT);
+        // Check if this result should stop the whole execution
+        stop_match = stopMatch(stop_mode, stop_code, &stop_re, state,
+                               exit_code, work_dir, taskNumber,
+                               streaming ? outputKept(&out, &kept) : NULL);
+        if (streaming)
+            outputFree(&out);
+
+        // Send response to master (once the files are in the task directory)
+        if (in_scratch) {
+            packResult(me, taskNumber, tries, state, arguments, difft, totalt,
+                       exit_code, stop_match, emit_file,
+                       flag_ledger ? &usage : NULL);
+            stageSubmit(&stg, work_dir, task_dir);
+        } else {
+            sendResult(myparent, me, taskNumber, tries, state, arguments,
+                       difft, totalt, exit_code, stop_match, emit_file,
+                       flag_ledger ? &usage : NULL);
+        }
+
+        // Start a fresh interpreter if this one has run long enough
+        if (worker_mode != WORKER_FORK)
+            workerCheck(&wk, worker_recycle, max_task_size);
     }
 
     // Dismantle slave
+    if (staging) {
+        stageFlush(&stg, myparent, 2);
+        stageStop(&stg);
+    }
+    if (compress_mode != COMPRESS_NONE)
+        fprintf(stderr,
+                "%-20s - Slave %d spent %.3f s of CPU compressing the output "
+                "of its tasks\n",
+                "[INFO]", me, compress_cpu);
+    if (worker_mode != WORKER_FORK)
+        workerStop(&wk);
+    else if (task_type != 6)
+        launchFree(&tpl);
+    if (cgroup_cores >= 0)
+        cgroupStop(&cg);
+    if (work_stealing)
+        stealFree(&sq);
+    cacheFree(&fc);
+    removeEmitDir(emit_dir);
+    if (stop_mode == STOP_REGEX)
+        regfree(&stop_re);
     pvm_exit();
     exit(0);
 }
@@ -0,0 +1,695 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PBala_worker.h"
+#include "PBala_errcodes.h"
+#include "PBala_lib.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pvm3.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+/* Driver run by Python (and by Sage's Python): reads one task per line from
+ * stdin as "program<TAB>taskId<TAB>args" and prints the sentinel and the exit
+ * code of the task when it finishes */
+static const char *pyDriver =
+    "import os, sys, runpy, traceback\n"
+    "S = sys.argv[1]\n"
+    "SAGE = len(sys.argv) > 2\n"
+    "if SAGE:\n"
+    "    import sage.all\n"
+    "    from sage.all import preparse, load\n"
+    "while True:\n"
+    "    line = sys.stdin.readline()\n"
+    "    if not line:\n"
+    "        break\n"
+    "    prog, tid, args = line.rstrip('\\n').split('\\t')\n"
+    "    code = 0\n"
+    "    try:\n"
+    "        if SAGE:\n"
+    "            g = dict(sage.all.__dict__)\n"
+    "            g['__name__'] = '__main__'\n"
+    "            exec(preparse('taskId=%s; taskArgs=[%s]' % (tid, args)), g)\n"
+    "            load(prog, g)\n"
+    "        else:\n"
+    "            sys.argv = [prog, tid] + (args.split(',') if args else [])\n"
+    "            sys.path[0] = os.path.dirname(os.path.abspath(prog))\n"
+    "            runpy.run_path(prog, run_name='__main__')\n"
+    "    except SystemExit as e:\n"
+    "        code = e.code if isinstance(e.code, int) else int(e.code is not "
+    "None)\n"
+    "    except BaseException:\n"
+    "        traceback.print_exc()\n"
+    "        code = 1\n"
+    "    sys.stdout.flush()\n"
+    "    sys.stderr.flush()\n"
+    "    sys.stdout.write('\\n%s:%d\\n' % (S, code))\n"
+    "    sys.stdout.flush()\n";
+
+/* Zygote run by Python: executes the imports of the program once, then reads
+ * one task per line from stdin as "taskId<TAB>args<TAB>stdout<TAB>stderr" and
+ * runs each one in a forked copy of itself. For every task it prints a START
+ * line with the pid of the copy and a DONE line with its exit status, CPU
+ * times and peak resident size */
+static const char *pyZygote =
+    "import ast, os, sys, runpy, traceback\n"
+    "S = sys.argv[1]\n"
+    "prog = sys.argv[2]\n"
+    "sys.path[0] = os.path.dirname(os.path.abspath(prog))\n"
+    "try:\n"
+    "    tree = ast.parse(open(prog).read(), prog)\n"
+    "    body = [n for n in tree.body\n"
+    "            if isinstance(n, (ast.Import, ast.ImportFrom))]\n"
+    "    try:\n"
+    "        mod = ast.Module(body=body, type_ignores=[])\n"
+    "    except TypeError:\n"
+    "        mod = ast.Module(body=body)\n"
+    "    exec(compile(mod, prog, 'exec'), {'__name__': '__pbala_zygote__'})\n"
+    "except BaseException:\n"
+    "    traceback.print_exc()\n"
+    "while True:\n"
+    "    line = sys.stdin.readline()\n"
+    "    if not line:\n"
+    "        break\n"
+    "    tid, args, out, err = line.rstrip('\\n').split('\\t')\n"
+    "    sys.stdout.flush()\n"
+    "    sys.stderr.flush()\n"
+    "    pid = os.fork()\n"
+    "    if pid == 0:\n"
+    "        code = 1\n"
+    "        try:\n"
+    "            os.setpgid(0, 0)\n"
+    "            fd = os.open(os.devnull, os.O_RDONLY)\n"
+    "            os.dup2(fd, 0)\n"
+    "            os.close(fd)\n"
+    "            for name, target in ((out, 1), (err, 2)):\n"
+    "                if name:\n"
+    "                    fd = os.open(name, os.O_WRONLY | os.O_CREAT | "
+    "os.O_TRUNC, 438)\n"
+    "                    os.dup2(fd, target)\n"
+    "                    os.close(fd)\n"
+    "            sys.argv = [prog, tid] + (args.split(',') if args else [])\n"
+    "            code = 0\n"
+    "            try:\n"
+    "                runpy.run_path(prog, run_name='__main__')\n"
+    "            except SystemExit as e:\n"
+    "                code = e.code if isinstance(e.code, int) else "
+    "int(e.code is not None)\n"
+    "            except BaseException:\n"
+    "                traceback.print_exc()\n"
+    "                code = 1\n"
+    "            sys.stdout.flush()\n"
+    "            sys.stderr.flush()\n"
+    "        finally:\n"
+    "            os._exit(code)\n"
+    "    try:\n"
+    "        os.setpgid(pid, pid)\n"
+    "    except OSError:\n"
+    "        pass\n"
+    "    sys.stdout.write('%s START %d\\n' % (S, pid))\n"
+    "    sys.stdout.flush()\n"
+    "    status, ru = os.wait4(pid, 0)[1:]\n"
+    "    if os.WIFSIGNALED(status):\n"
+    "        kind, value = 'signal', os.WTERMSIG(status)\n"
+    "    else:\n"
+    "        kind, value = 'exit', os.WEXITSTATUS(status)\n"
+    "    sys.stdout.write('%s DONE %s %d %.6f %.6f %d\\n' % (S, kind, value,\n"
+    "                     ru.ru_utime, ru.ru_stime, ru.ru_maxrss))\n"
+    "    sys.stdout.flush()\n";
+
+int workerParseMode(char *str) {
+    if (strcmp(str, "fork") == 0)
+        return WORKER_FORK;
+    if (strcmp(str, "persistent") == 0)
+        return WORKER_PERSISTENT;
+    if (strcmp(str, "zygote") == 0)
+        return WORKER_ZYGOTE;
+    return -1;
+}
+
+void workerInit(worker_ptr w, int mode, int task_type, char *custom_path,
+                char *emit_file, int cores) {
+    memset(w, 0, sizeof(worker));
+    w->in = w->out = w->err = -1;
+    w->mode = mode;
+    w->task_type = task_type;
+    w->custom_path = custom_path;
+    w->emit_file = emit_file;
+    snprintf(w->sentinel, sizeof(w->sentinel), "PBALA_TASK_DONE_%d_%lx",
+             (int)getpid(), (unsigned long)time(NULL));
+    snprintf(w->numcpus, sizeof(w->numcpus), "kernelopts(numcpus=%d):", cores);
+    // a dead interpreter must not kill the slave when we write to it
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/* CPU time (clock ticks) and resident size (KB) of the processes in a group */
+static void groupUsage(pid_t pgid, unsigned long long *utime,
+                       unsigned long long *stime, long *rss) {
+    DIR *dir;
+    struct dirent *ent;
+    FILE *f;
+    char fname[2 * FNAME_SIZE], line[BUFFER_SIZE], *p;
+    int pgrp;
+    unsigned long long ut, st, cut, cst;
+    long pages, page_kb = sysconf(_SC_PAGESIZE) / 1024;
+
+    *utime = *stime = 0;
+    *rss = 0;
+    if ((dir = opendir("/proc")) == NULL)
+        return;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!isdigit((unsigned char)ent->d_name[0]))
+            continue;
+        snprintf(fname, sizeof(fname), "/proc/%s/stat", ent->d_name);
+        if ((f = fopen(fname, "r")) == NULL)
+            continue;
+        // fields after the command name, which may contain spaces
+        if (fgets(line, BUFFER_SIZE, f) != NULL &&
+            (p = strrchr(line, ')')) != NULL &&
+            sscanf(p + 2,
+                   "%*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu "
+                   "%llu %*d %*d %*d %*d %*u %*u %ld",
+                   &pgrp, &ut, &st, &cut, &cst, &pages) == 6 &&
+            pgrp == pgid) {
+            *utime += ut + cut;
+            *stime += st + cst;
+            *rss += pages * page_kb;
+        }
+        fclose(f);
+    }
+    closedir(dir);
+}
+
+/* Convert clock ticks to a timeval */
+static struct timeval ticksToTimeval(unsigned long long ticks) {
+    struct timeval tv;
+    long hz = sysconf(_SC_CLK_TCK);
+    tv.tv_sec = ticks / hz;
+    tv.tv_usec = (ticks % hz) * 1000000 / hz;
+    return tv;
+}
+
+/* Convert a timeval to clock ticks */
+static unsigned long long timevalToTicks(struct timeval tv) {
+    long hz = sysconf(_SC_CLK_TCK);
+    return (unsigned long long)tv.tv_sec * hz + tv.tv_usec * hz / 1000000;
+}
+
+/* Start the interpreter with its standard streams connected to pipes */
+static int workerStart(worker_ptr w, char *program) {
+    int in[2], out[2], err[2];
+    char *args[8];
+    char *def;
+    int n = 0;
+    pid_t pid;
+
+    switch (w->task_type) {
+    case 0:
+        def = "maple";
+        break;
+    case 2:
+        def = "python";
+        break;
+    case 3:
+        def = "gp";
+        break;
+    case 4:
+        def = "sage";
+        break;
+    case 5:
+        def = "octave";
+        break;
+    default:
+        return -1;
+    }
+    args[n++] = w->custom_path != NULL ? w->custom_path : def;
+    if (w->mode == WORKER_ZYGOTE) {
+        args[n++] = "-u";
+        args[n++] = "-c";
+        args[n++] = (char *)pyZygote;
+        args[n++] = w->sentinel;
+        args[n++] = program;
+    } else if (w->task_type == 0) {
+        args[n++] = "-q";
+        args[n++] = "-c";
+        args[n++] = w->numcpus;
+    } else if (w->task_type == 2 || w->task_type == 4) {
+        if (w->task_type == 4)
+            args[n++] = "-python";
+        args[n++] = "-u";
+        args[n++] = "-c";
+        args[n++] = (char *)pyDriver;
+        args[n++] = w->sentinel;
+        if (w->task_type == 4)
+            args[n++] = "sage";
+    } else if (w->task_type == 3) {
+        args[n++] = "-q";
+        args[n++] = "-f";
+        args[n++] = "-s400G";
+    } else {
+        args[n++] = "-qf";
+    }
+    args[n] = NULL;
+
+    if (pipe(in) != 0)
+        return -1;
+    if (pipe(out) != 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    if (pipe(err) != 0) {
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    if ((pid = fork()) < 0) {
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        sigset_t none;
+        // Own process group, so the whole interpreter can be killed
+        setpgid(0, 0);
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        dup2(err[1], 2);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        if (w->emit_file != NULL && w->emit_file[0] != '\0')
+            setenv(EMIT_ENV, w->emit_file, 1);
+        execvp(args[0], args);
+        perror("ERROR:: persistent interpreter");
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    fcntl(err[0], F_SETFD, FD_CLOEXEC);
+    w->pid = pid;
+    w->running = 1;
+    w->in = in[1];
+    w->out = out[0];
+    w->err = err[0];
+    w->tasks = 0;
+    w->base_rss = w->rss = 0;
+    return 0;
+}
+
+/* Write the commands that run one task, followed by the sentinel */
+static int workerSnippet(worker_ptr w, char *s, size_t size, int taskNumber,
+                         char *program, char *arguments) {
+    switch (w->task_type) {
+    case 0:
+        return snprintf(s, size,
+                        "restart;\n"
+                        "taskId:=%d: taskArgs:=[%s]:\n"
+                        "read \"%s\";\n"
+                        "printf(\"\\n%s:0\\n\");\n",
+                        taskNumber, arguments, program, w->sentinel);
+    case 2:
+    case 4:
+        return snprintf(s, size, "%s\t%d\t%s\n", program, taskNumber,
+                        arguments);
+    case 3:
+        return snprintf(s, size,
+                        "taskId=%d;taskArgs=[%s];\n"
+                        "\\r %s\n"
+                        "print(\"\\n%s:0\");\n",
+                        taskNumber, arguments, program, w->sentinel);
+    case 5:
+        return snprintf(
+            s, size,
+            "clear all; taskId = %d; taskArgs = {%s}; pbala_code__ = 0; "
+            "try; source (\"%s\"); catch pbala_err__; fputs (stderr, "
+            "[\"error: \" pbala_err__.message \"\\n\"]); pbala_code__ = 1; "
+            "end_try_catch;\n"
+            "printf (\"\\n%s:%%d\\n\", pbala_code__); fflush (stdout);\n",
+            taskNumber, arguments, program, w->sentinel);
+    default:
+        return -1;
+    }
+}
+
+/* Write a whole buffer to a file descriptor */
+static int writeAll(int fd, const char *data, size_t len) {
+    ssize_t n;
+    while (len > 0) {
+        if ((n = write(fd, data, len)) <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Position of needle in the first len bytes of buf, NULL if not found */
+static char *findBytes(char *buf, size_t len, const char *needle,
+                       size_t nlen) {
+    size_t i;
+    for (i = 0; i + nlen <= len; i++)
+        if (buf[i] == needle[0] && memcmp(buf + i, needle, nlen) == 0)
+            return buf + i;
+    return NULL;
+}
+
+/* Copy whatever the interpreter left in its stderr pipe */
+static void drainErr(worker_ptr w, int errfd, int timeout) {
+    struct pollfd pfd;
+    char buf[BUFFER_SIZE];
+    ssize_t n;
+    pfd.fd = w->err;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, timeout) > 0 &&
+           (n = read(w->err, buf, BUFFER_SIZE)) > 0)
+        writeAll(errfd, buf, n);
+}
+
+/* Close the pipes of a dead interpreter */
+static void workerClose(worker_ptr w) {
+    close(w->in);
+    close(w->out);
+    close(w->err);
+    w->in = w->out = w->err = -1;
+    w->running = 0;
+}
+
+/* Collect a dead interpreter and tell why it died: ST_TASK_CANCELLED if we
+ * killed it, ST_TASK_KILLED if it was killed, ST_FORK_ERR if it could not be
+ * executed, and otherwise 0 with its exit code */
+static int workerDied(worker_ptr w, int killed, int *exit_code,
+                      struct rusage *usage) {
+    int status;
+
+    if (wait4(w->pid, &status, 0, usage) < 0)
+        status = 0;
+    workerClose(w);
+    if (killed)
+        return ST_TASK_CANCELLED;
+    if (WIFSIGNALED(status))
+        return ST_TASK_KILLED;
+    if (WEXITSTATUS(status) == 127 && w->tasks == 0)
+        return ST_FORK_ERR; // the interpreter could not be executed
+    *exit_code = WEXITSTATUS(status);
+    return 0;
+}
+
+/* Run a task in a forked copy of the zygote */
+static int zygoteRun(worker_ptr w, int taskNumber, char *arguments,
+                     char *out_dir, int flag_err, int master, int *exit_code,
+                     struct rusage *usage) {
+    char line[4 * BUFFER_SIZE], errname[FNAME_SIZE], kind[16];
+    char buf[BUFFER_SIZE], *p, *nl;
+    int len, victim, value, killed = 0, state = -1;
+    size_t have = 0, slen = strlen(w->sentinel);
+    ssize_t n;
+    long maxrss;
+    double ut, st;
+    unsigned long long zut, zst;
+    struct pollfd fds[2];
+
+    w->task_pid = 0;
+    errname[0] = '\0';
+    if (flag_err)
+        sprintf(errname, "%s/task%d_stderr.txt", out_dir, taskNumber);
+    len = snprintf(line, sizeof(line), "%d\t%s\t%s/task%d_stdout.txt\t%s\n",
+                   taskNumber, arguments, out_dir, taskNumber, errname);
+    writeAll(w->in, line, len);
+
+    fds[0].fd = w->out;
+    fds[1].fd = w->err;
+    fds[0].events = fds[1].events = POLLIN;
+    while (state < 0) {
+        poll(fds, 2, WAIT_POLL_MS);
+        // only kill requests for this task count, older ones are stale
+        while (pvm_nrecv(master, MSG_KILL) > 0) {
+            pvm_upkint(&victim, 1, 1);
+            if (victim == taskNumber && !killed) {
+                killed = 1;
+                if (w->task_pid > 0)
+                    kill(-w->task_pid, SIGKILL);
+            }
+        }
+        // messages of the zygote itself (e.g. failed imports)
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            if ((n = read(w->err, buf, BUFFER_SIZE)) > 0)
+                writeAll(2, buf, n);
+            else
+                fds[1].fd = -1;
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP)))
+            continue;
+        if ((n = read(w->out, line + have, sizeof(line) - 1 - have)) <= 0) {
+            // the zygote died, take the running task with it
+            if (w->task_pid > 0)
+                kill(-w->task_pid, SIGKILL);
+            drainErr(w, 2, WAIT_POLL_MS);
+            state = workerDied(w, killed, exit_code, usage);
+            if (state == 0)
+                state = ST_TASK_KILLED;
+            memset(usage, 0, sizeof(struct rusage));
+            return state;
+        }
+        have += n;
+        line[have] = '\0';
+        // process complete lines, ignore what is not ours
+        p = line;
+        while (state < 0 && (nl = strchr(p, '\n')) != NULL) {
+            *nl = '\0';
+            if (strncmp(p, w->sentinel, slen) == 0 && p[slen] == ' ') {
+                if (sscanf(p + slen, " START %d", &value) == 1) {
+                    w->task_pid = value;
+                    if (killed)
+                        kill(-w->task_pid, SIGKILL);
+                } else if (sscanf(p + slen, " DONE %15s %d %lf %lf %ld", kind,
+                                  &value, &ut, &st, &maxrss) == 5) {
+                    usage->ru_utime.tv_sec = (long)ut;
+                    usage->ru_utime.tv_usec = (long)((ut - (long)ut) * 1e6);
+                    usage->ru_stime.tv_sec = (long)st;
+                    usage->ru_stime.tv_usec = (long)((st - (long)st) * 1e6);
+                    usage->ru_maxrss = maxrss;
+                    if (killed)
+                        state = ST_TASK_CANCELLED;
+                    else if (strcmp(kind, "signal") == 0)
+                        state = ST_TASK_KILLED;
+                    else {
+                        state = 0;
+                        *exit_code = value;
+                    }
+                }
+            }
+            p = nl + 1;
+        }
+        have -= p - line;
+        memmove(line, p, have);
+        if (have == sizeof(line) - 1)
+            have = 0; // a line too long to be ours
+    }
+
+    w->tasks++;
+    groupUsage(w->pid, &zut, &zst, &w->rss);
+    if (w->tasks == 1)
+        w->base_rss = w->rss;
+    return state;
+}
+
+int workerRun(worker_ptr w, int taskNumber, char *program, char *arguments,
+              char *out_dir, int flag_err, int master, int *exit_code,
+              struct rusage *usage) {
+    char fname[FNAME_SIZE], snippet[4 * BUFFER_SIZE], marker[72];
+    char buf[BUFFER_SIZE + 128], errbuf[BUFFER_SIZE], *p;
+    int outfd, errfd, len, victim;
+    int found = 0, done = 0, killed = 0, state = 0;
+    size_t have = 0, mlen, keep;
+    ssize_t n;
+    struct pollfd fds[2];
+    unsigned long long ut0, st0, ut, st;
+    long rss, peak = 0;
+
+    *exit_code = 0;
+    memset(usage, 0, sizeof(struct rusage));
+    if (!w->running && workerStart(w, program) != 0)
+        return ST_FORK_ERR;
+    if (w->mode == WORKER_ZYGOTE)
+        return zygoteRun(w, taskNumber, arguments, out_dir, flag_err, master,
+                         exit_code, usage);
+    w->task_pid = w->pid;
+
+    sprintf(fname, "%s/task%d_stdout.txt", out_dir, taskNumber);
+    outfd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    errfd = 2;
+    if (flag_err) {
+        sprintf(fname, "%s/task%d_stderr.txt", out_dir, taskNumber);
+        errfd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+
+    groupUsage(w->pid, &ut0, &st0, &rss);
+    mlen = sprintf(marker, "\n%s:", w->sentinel);
+    len = workerSnippet(w, snippet, sizeof(snippet), taskNumber, program,
+                        arguments);
+    // if the interpreter is gone, the read loop finds out
+    writeAll(w->in, snippet, len);
+
+    fds[0].fd = w->out;
+    fds[1].fd = w->err;
+    fds[0].events = fds[1].events = POLLIN;
+    while (!done) {
+        if (poll(fds, 2, WAIT_POLL_MS) == 0) {
+            groupUsage(w->pid, &ut, &st, &rss);
+            if (rss > peak)
+                peak = rss;
+        }
+        // only kill requests for this task count, older ones are stale
+        while (pvm_nrecv(master, MSG_KILL) > 0) {
+            pvm_upkint(&victim, 1, 1);
+            if (victim == taskNumber && !killed) {
+                kill(-w->pid, SIGKILL);
+                killed = 1;
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            if ((n = read(w->err, errbuf, BUFFER_SIZE)) > 0)
+                writeAll(errfd, errbuf, n);
+            else
+                fds[1].fd = -1;
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP)))
+            continue;
+        if ((n = read(w->out, buf + have, BUFFER_SIZE)) <= 0) {
+            // interpreter exited before printing the sentinel
+            if (!found)
+                writeAll(outfd, buf, have);
+            break;
+        }
+        have += n;
+        if (!found) {
+            if ((p = findBytes(buf, have, marker, mlen)) != NULL) {
+                writeAll(outfd, buf, p - buf);
+                have -= (p - buf) + mlen;
+                memmove(buf, p + mlen, have);
+                found = 1;
+            } else {
+                // keep a possible partial marker for the next read
+                keep = have < mlen - 1 ? have : mlen - 1;
+                writeAll(outfd, buf, have - keep);
+                memmove(buf, buf + have - keep, keep);
+                have = keep;
+            }
+        }
+        if (found && (p = memchr(buf, '\n', have)) != NULL) {
+            *p = '\0';
+            *exit_code = atoi(buf);
+            done = 1;
+        } else if (found && have > 64) {
+            done = 1;
+        }
+    }
+
+    if (done) {
+        drainErr(w, errfd, 0);
+        groupUsage(w->pid, &ut, &st, &rss);
+        if (rss > peak)
+            peak = rss;
+        usage->ru_utime = ticksToTimeval(ut - ut0);
+        usage->ru_stime = ticksToTimeval(st - st0);
+        usage->ru_maxrss = peak;
+        w->tasks++;
+        w->rss = rss;
+        if (w->tasks == 1)
+            w->base_rss = rss;
+    } else {
+        // the interpreter died: collect it and start a new one next time
+        drainErr(w, errfd, WAIT_POLL_MS);
+        state = workerDied(w, killed, exit_code, usage);
+        ut = timevalToTicks(usage->ru_utime);
+        st = timevalToTicks(usage->ru_stime);
+        usage->ru_utime = ticksToTimeval(ut > ut0 ? ut - ut0 : 0);
+        usage->ru_stime = ticksToTimeval(st > st0 ? st - st0 : 0);
+    }
+
+    if (outfd >= 0)
+        close(outfd);
+    if (flag_err && errfd >= 0)
+        close(errfd);
+    return state;
+}
+
+int workerCheck(worker_ptr w, int recycle, long max_rss) {
+    char *reason = NULL;
+
+    if (!w->running)
+        return 0;
+    if (recycle > 0 && w->tasks >= recycle)
+        reason = "task limit";
+    else if (max_rss > 0 && w->rss > max_rss)
+        reason = "memory limit";
+    else if (w->base_rss > 0 && w->rss > WORKER_RSS_GROWTH * w->base_rss)
+        reason = "memory growth";
+    if (reason == NULL)
+        return 0;
+    printf("%-20s - Recycling interpreter %d after %d tasks (%s, %ld KB)\n",
+           "[WORKER]", (int)w->pid, w->tasks, reason, w->rss);
+    workerStop(w);
+    return 1;
+}
+
+void workerStop(worker_ptr w) {
+    int i, status;
+
+    if (!w->running)
+        return;
+    // interpreters exit when their input ends, give them some time
+    close(w->in);
+    w->in = -1;
+    for (i = 0; i < 10; i++) {
+        if (waitpid(w->pid, &status, WNOHANG) == w->pid) {
+            workerClose(w);
+            return;
+        }
+        usleep(WAIT_POLL_MS * 1000);
+    }
+    kill(-w->pid, SIGKILL);
+    waitpid(w->pid, &status, 0);
+    workerClose(w);
+}
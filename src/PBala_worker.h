@@ -0,0 +1,128 @@
+/* This file is part of PBala (http://github.com/oscarsaleta/PBala)
+ *
+ * Copyright (C) 2016  O. Saleta
+ *
+ * PBala is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PBALA_WORKER_H
+#define PBALA_WORKER_H
+/*! \file PBala_worker.h
+ * \brief Persistent interpreter workers for the slaves
+ * \author Oscar Saleta Reig
+ *
+ * In persistent mode every slave keeps one interpreter (Maple, Python, PARI,
+ * Sage or Octave) alive and feeds it one task after another through its
+ * standard input. After each task the interpreter prints a sentinel line with
+ * the exit code of the task, which tells the slave that the task is done and
+ * that its output is complete.
+ *
+ * In zygote mode (Python only) the slave keeps a Python process that has
+ * already executed the imports of the program, and that forks a copy of
+ * itself for every task. The copy writes its own output files, and the zygote
+ * reports its pid, exit status and resource usage to the slave.
+ */
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#define WORKER_FORK 0       ///< One new process per task (default)
+#define WORKER_PERSISTENT 1 ///< One long-lived interpreter per slave
+#define WORKER_ZYGOTE 2     ///< One forking Python process per slave
+#define WORKER_RECYCLE 100  ///< Default number of tasks per interpreter
+/** Restart the interpreter when its resident size grows this many times
+ * over the size it had after its first task */
+#define WORKER_RSS_GROWTH 2
+
+typedef struct worker_ {
+    pid_t pid;          ///< interpreter process (last one if not running)
+    int running;        ///< 1 if the interpreter is alive
+    int mode;           ///< WORKER_PERSISTENT or WORKER_ZYGOTE
+    pid_t task_pid;     ///< process that ran the last task
+    int in;             ///< pipe to the interpreter stdin
+    int out;            ///< pipe from the interpreter stdout
+    int err;            ///< pipe from the interpreter stderr
+    int task_type;      ///< program type (0, 2, 3, 4 or 5)
+    char *custom_path;  ///< custom interpreter path (NULL for default)
+    char *emit_file;    ///< emit file given to the interpreter
+    int tasks;          ///< tasks run by the current interpreter
+    long base_rss;      ///< resident size after the first task (KB)
+    long rss;           ///< resident size after the last task (KB)
+    char sentinel[64];  ///< marker printed by the interpreter after a task
+    char numcpus[48];   ///< Maple kernelopts setting the cores of a task
+} worker, *worker_ptr;
+
+/**
+ * Parse the name of a worker mode
+ *
+ * @param  str "fork", "persistent" or "zygote"
+ * @return     WORKER_FORK, WORKER_PERSISTENT or WORKER_ZYGOTE, -1 if unknown
+ */
+int workerParseMode(char *str);
+/**
+ * Prepare a worker (the interpreter is started by the first workerRun)
+ *
+ * @param w           worker to fill
+ * @param mode        WORKER_PERSISTENT or WORKER_ZYGOTE
+ * @param task_type   program type
+ * @param custom_path custom interpreter path (NULL for default)
+ * @param emit_file   file where tasks can emit new tasks (exported as
+ *                    PBALA_EMIT_FILE to the interpreter)
+ * @param cores       cores each task may use
+ */
+void workerInit(worker_ptr w, int mode, int task_type, char *custom_path,
+                char *emit_file, int cores);
+/**
+ * Run a task in the worker, starting the interpreter if needed
+ *
+ * The interpreter stdout is copied to taskN_stdout.txt and its stderr to
+ * taskN_stderr.txt (if flag_err, otherwise to the slave stderr) until the
+ * sentinel is read. While waiting, kill requests from the master for this
+ * task are honoured by killing the interpreter (or, for a zygote, the forked
+ * copy that runs the task).
+ *
+ * @param  w          worker
+ * @param  taskNumber task number
+ * @param  program    program file
+ * @param  arguments  task arguments, as read from the datafile
+ * @param  out_dir    output directory
+ * @param  flag_err   1 if stderr files are created
+ * @param  master     PVM id of the master
+ * @param  exit_code  where the exit code of the task is stored
+ * @param  usage      where the CPU time and peak resident size used by the
+ *                    task are stored
+ * @return            0 if the task completed, ST_TASK_CANCELLED if the
+ *                    master killed it, ST_TASK_KILLED if the interpreter was
+ *                    killed, ST_FORK_ERR if it could not be started
+ */
+int workerRun(worker_ptr w, int taskNumber, char *program, char *arguments,
+              char *out_dir, int flag_err, int master, int *exit_code,
+              struct rusage *usage);
+/**
+ * Restart the interpreter if it ran too many tasks or grew too much
+ *
+ * @param w       worker
+ * @param recycle maximum number of tasks per interpreter (0 for no limit)
+ * @param max_rss maximum resident size in KB (0 for no limit)
+ * @return        1 if the interpreter was stopped, 0 otherwise
+ */
+int workerCheck(worker_ptr w, int recycle, long max_rss);
+/**
+ * Stop the interpreter (it is restarted by the next workerRun)
+ *
+ * @param w worker
+ */
+void workerStop(worker_ptr w);
+
+#endif /* PBALA_WORKER_H */